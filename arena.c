@@ -0,0 +1,69 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file arena.c
+ * @brief Bump allocator for data that lives as long as the program, eg.
+ *        everything built for each URL at startup.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    char *p;
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (size > arena->left) {
+        if (size > ARENA_CHUNK / 4) {
+            /* don't throw away the rest of the chunk for this */
+            if ((p = malloc(size)) == NULL)
+                return NULL;
+            arena->size += size;
+            arena->used += size;
+            return p;
+        }
+        if ((p = malloc(ARENA_CHUNK)) == NULL)
+            return NULL;
+        arena->next = p;
+        arena->left = ARENA_CHUNK;
+        arena->size += ARENA_CHUNK;
+    }
+    p = arena->next;
+    arena->next += size;
+    arena->left -= size;
+    arena->used += size;
+    return p;
+}
+
+char *arena_strmemdup(struct arena *arena, const char *str, size_t len)
+{
+    char *p = arena_alloc(arena, len + 1);
+    if (p == NULL)
+        return NULL;
+    memcpy(p, str, len);
+    p[len] = '\0';
+    return p;
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+    return arena_strmemdup(arena, str, strlen(str));
+}
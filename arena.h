@@ -0,0 +1,59 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file arena.h
+ * @brief Bump allocator for data that lives as long as the program, eg.
+ *        everything built for each URL at startup.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#ifndef __arena_h
+#define __arena_h
+
+#include "config.h"
+
+#include <stddef.h>
+
+/* allocations are carved out of chunks of this size, bigger ones get a
+ * chunk of their own */
+#define ARENA_CHUNK (1048576)
+#define ARENA_ALIGN (sizeof(void *))
+
+struct arena {
+    char *next;     /* free space in the current chunk */
+    size_t left;    /* bytes of it */
+    size_t size;    /* total bytes in all the chunks */
+    size_t used;    /* bytes handed out */
+};
+
+/**
+ * Allocate size bytes, aligned for any pointer or integer. There is no
+ * way to free them.
+ * @returns NULL if the memory can't be had.
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/**
+ * Copy len bytes of str into the arena and \0-terminate them.
+ * @returns NULL if the memory can't be had.
+ */
+char *arena_strmemdup(struct arena *arena, const char *str, size_t len);
+
+char *arena_strdup(struct arena *arena, const char *str);
+
+#endif /* __arena_h */
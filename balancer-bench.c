@@ -0,0 +1,206 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file balancer-bench.c
+ * @brief Microbenchmark of get_next_location() as the number of URLs
+ *        grows: the fair balancer against the linear scan it replaced,
+ *        and each of the --balance strategies. Run "make bench".
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "params.h"
+#include "balancer.h"
+
+#define CONCURRENCY 100 /* requests kept in flight */
+#define DISPATCHES 1000000
+#define SCANNED 200000000.0 /* locations the linear scan looks at, at most */
+#define CHECKED 100000 /* dispatches compared between the two */
+
+/* --- the old linear scan, for comparison --- */
+
+static struct location *old_get_next_location(struct location *locations,
+                                              int n_locations)
+{
+    int i;
+    struct location *lowconn_loc = NULL;
+    for (i = 0; i < n_locations; i++) {
+        struct location *testloc = &locations[i];
+        if (lowconn_loc == NULL)
+            lowconn_loc = testloc;
+        else if (testloc->n_concurrent < lowconn_loc->n_concurrent)
+            lowconn_loc = testloc;
+    }
+    lowconn_loc->n_concurrent++;
+    return lowconn_loc;
+}
+
+/* --- the benchmark --- */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Replace config_opts.urls with n made-up URLs and build a balancer
+ * over them.
+ */
+static struct balancer *make_balancer(int n)
+{
+    struct urls *urls = NULL;
+    int i;
+    for (i = 0; i < n; i++) {
+        struct urls *url = malloc(sizeof(*url));
+        char buf[64];
+        if (url == NULL) {
+            fprintf(stderr, "Unable to allocate URLs, exiting\n");
+            exit(-2);
+        }
+        snprintf(buf, sizeof(buf), "http://127.0.0.1/%d", i);
+        RING_INIT(url);
+        url->url = strdup(buf);
+        RING_APPEND(urls, url);
+    }
+    config_opts.urls = urls;
+    initialize_balancer();
+    return create_balancer();
+}
+
+/**
+ * Dispatch requests to n locations, always keeping CONCURRENCY of them
+ * in flight, and print the time per dispatch with each balancer. The
+ * two must pick the same locations.
+ */
+static void run(int n)
+{
+    struct balancer *balancer;
+    struct location *old_locations = calloc(n, sizeof(*old_locations));
+    struct location *ring[CONCURRENCY], *old_ring[CONCURRENCY];
+    long i, dispatches;
+    double start, heap_ns, scan_ns;
+
+    config_opts.balance = BALANCE_FAIR;
+    balancer = make_balancer(n);
+    if (old_locations == NULL) {
+        fprintf(stderr, "Unable to allocate locations, exiting\n");
+        exit(-2);
+    }
+    memset(ring, 0, sizeof(ring));
+    memset(old_ring, 0, sizeof(old_ring));
+    for (i = 0; i < CHECKED; i++) {
+        struct location **slot = &ring[i % CONCURRENCY];
+        struct location **old_slot = &old_ring[i % CONCURRENCY];
+        if (*slot) {
+            location_release(*slot);
+            (*old_slot)->n_concurrent--;
+        }
+        *slot = get_next_location(balancer);
+        location_reuse(*slot);
+        *old_slot = old_get_next_location(old_locations, n);
+        if ((*slot)->index != *old_slot - old_locations) {
+            fprintf(stderr, "%d locations: dispatch %ld went to %d, "
+                    "not %d\n", n, i, (*slot)->index,
+                    (int)(*old_slot - old_locations));
+            exit(-1);
+        }
+    }
+
+    start = now();
+    for (i = 0; i < DISPATCHES; i++) {
+        struct location **slot = &ring[i % CONCURRENCY];
+        location_release(*slot);
+        *slot = get_next_location(balancer);
+        location_reuse(*slot);
+    }
+    heap_ns = (now() - start) * 1e9 / DISPATCHES;
+
+    /* the scan gets slow, so it does fewer */
+    dispatches = SCANNED / n < DISPATCHES ? (long)(SCANNED / n) : DISPATCHES;
+    start = now();
+    for (i = 0; i < dispatches; i++) {
+        struct location **slot = &old_ring[i % CONCURRENCY];
+        (*slot)->n_concurrent--;
+        *slot = old_get_next_location(old_locations, n);
+    }
+    scan_ns = (now() - start) * 1e9 / dispatches;
+
+    printf("%8d URLs %10.1lf ns/dispatch %12.1lf ns/dispatch\n",
+           n, heap_ns, scan_ns);
+    free(old_locations);
+}
+
+/**
+ * Time dispatching to n locations with the given strategy, always
+ * keeping CONCURRENCY requests in flight.
+ * @returns the time per dispatch in ns.
+ */
+static double time_strategy(int n, enum balance_mode mode)
+{
+    struct balancer *balancer;
+    struct location *ring[CONCURRENCY];
+    double start;
+    long i;
+
+    config_opts.balance = mode;
+    balancer = make_balancer(n);
+    memset(ring, 0, sizeof(ring));
+    start = now();
+    for (i = 0; i < DISPATCHES; i++) {
+        struct location **slot = &ring[i % CONCURRENCY];
+        if (*slot)
+            location_release(*slot);
+        *slot = get_next_location(balancer);
+        location_reuse(*slot);
+    }
+    return (now() - start) * 1e9 / DISPATCHES;
+}
+
+int main(int argc, char *argv[])
+{
+    char *args[] = { argv[0], "http://127.0.0.1/", NULL };
+    int n, mode;
+
+    parse_args(2, args);
+    config_opts.count = INT_MAX; /* no location ever runs out */
+    printf("%d requests in flight\n", CONCURRENCY);
+    printf("%14s %21s %25s\n", "", "heap", "linear scan");
+    for (n = 1; n <= 100000; n *= 10)
+        run(n);
+
+    printf("\n%14s", "ns/dispatch");
+    for (mode = BALANCE_RR; mode <= BALANCE_RANDOM; mode++)
+        printf(" %9s", balance_names[mode]);
+    printf("\n");
+    for (n = 10; n <= 100000; n *= 100) {
+        printf("%8d URLs ", n);
+        for (mode = BALANCE_RR; mode <= BALANCE_RANDOM; mode++)
+            printf(" %9.1lf", time_strategy(n, mode));
+        printf("\n");
+    }
+    return 0;
+}
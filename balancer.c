@@ -32,13 +32,97 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "params.h"
 #include "balancer.h"
+#include "crc32c.h"
+#include "arena.h"
+#include "dns.h"
+#include "formats.h"
+#include "template.h"
 
-static struct location *locations;
+/**
+ * Each dispatcher thread balances over its own copy of the locations,
+ * so nothing on the request path is shared between threads. The copies
+ * share everything that is read-only (URI, address and request).
+ */
+/* what one thread has seen of one address, see location_accumulate() */
+struct address_stats {
+    struct accumulator accumulator;
+    int n_connects;
+    int n_errors;
+};
+
+struct balancer {
+    struct location *locations;
+    /* indexed like dns_address(), allocated as each address is first used */
+    struct address_stats **addresses;
+    const struct strategy *strategy; /* picked with --balance */
+    int current_location_rr;
+    /* min-heap of the locations that haven't run out, ordered by
+     * n_concurrent and then index, see get_next_location_fair() */
+    struct location **heap;
+    int heap_size;
+    unsigned short rand48[3]; /* for the random strategies */
+};
+
+/**
+ * A way of picking the location for each request (--balance).
+ * get_next_location() does the n_concurrent bookkeeping for all of them.
+ */
+struct strategy {
+    void (*setup)(void);        /* once, after the locations are set up */
+    void (*init)(struct balancer *balancer); /* for each thread's balancer */
+    struct location *(*next)(struct balancer *balancer);
+};
+
+static struct location *locations; /* the master copy */
 static int n_locations = 0;
 
+static struct balancer **balancers;
+static int n_balancers = 0;
+
+/* failures for each location across all the threads, which -M caps */
+static volatile int *connect_errors;
+
+/* Vose's alias table for --balance weighted, shared by all the threads:
+ * location i is picked with probability alias_prob[i], and otherwise
+ * alias_index[i] is */
+static double *alias_prob;
+static int *alias_index;
+
+static struct arena location_arena; /* URIs, addresses and requests */
+
+/* the -H headers (and the defaults) as they are sent */
+static char *header_block;
+static size_t header_block_len;
+
+/* the --body-file, open for sendfile() by every thread */
+static int body_fd = -1;
+static off_t body_len;
+
+/* the -f file, see map_url_file() */
+static char *url_file;
+static size_t url_file_len;
+static int n_file_locations;
+
+/* --template: the most placeholders in a request, and the number of the
+ * last request given out by location_request() over all the threads */
+static int max_template_vars;
+static uint64_t template_seq;
+
+static uint64_t setup_ns; /* how long initialize_balancer() took */
+
+/* per-location latency histograms cost about 25KB each per thread, so
+ * past this many (locations times threads) only the totals get them */
+#define MAX_LOCATION_HISTOGRAMS 1024
+static int location_histograms;
+
 static int count_locations(struct urls *urls)
 {
     int i = 0;
@@ -52,6 +136,120 @@ static int count_locations(struct urls *urls)
     return i;
 }
 
+/**
+ * Find the next URL in the -f file from *p on: one per line, ignoring
+ * whitespace around it, blank lines and lines that start with '#'.
+ * Moves *p past its line.
+ * @returns its length with *url pointing at it, 0 if there are no more.
+ */
+static size_t next_file_url(char **p, char **url)
+{
+    char *end = url_file + url_file_len;
+    while (*p < end) {
+        char *line = *p, *eol = memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+        *p = eol < end ? eol + 1 : end;
+        while (line < eol && isspace((unsigned char)*line))
+            line++;
+        while (eol > line && isspace((unsigned char)eol[-1]))
+            eol--;
+        if (line == eol || *line == '#')
+            continue;
+        *url = line;
+        return eol - line;
+    }
+    return 0;
+}
+
+/**
+ * Map the -f file and count the URLs in it. It is mapped copy-on-write,
+ * so the URLs can be \0-terminated where they are and stay put for the
+ * rest of the run instead of being copied.
+ */
+static void map_url_file(const char *path)
+{
+    struct stat st;
+    char *p, *url;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        exit(-1);
+    }
+    url_file_len = st.st_size;
+    if (url_file_len > 0) {
+        url_file = mmap(NULL, url_file_len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE, fd, 0);
+        if (url_file == MAP_FAILED) {
+            perror("mmap");
+            exit(-2);
+        }
+#ifdef MADV_SEQUENTIAL
+        (void)madvise(url_file, url_file_len, MADV_SEQUENTIAL);
+#endif
+    }
+    (void)close(fd);
+    for (p = url_file; next_file_url(&p, &url) > 0; )
+        n_file_locations++;
+}
+
+/**
+ * Open the --body-file, it is sent from the page cache rather than read.
+ */
+static void open_body_file(const char *path)
+{
+    struct stat st;
+    body_fd = open(path, O_RDONLY);
+    if (body_fd < 0 || fstat(body_fd, &st) < 0) {
+        fprintf(stderr, "Unable to open %s (--body-file): %s\n", path,
+                strerror(errno));
+        exit(-1);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s (--body-file) isn't a regular file\n", path);
+        exit(-1);
+    }
+    body_len = st.st_size;
+}
+
+/**
+ * Build the header lines (-H and the defaults) once, they are the same
+ * in every request.
+ */
+static void create_header_block()
+{
+    struct headers *header = config_opts.headers;
+    char *p;
+    header_block_len = 0;
+    if (body_fd >= 0)
+        header_block_len += snprintf(NULL, 0, "Content-Length: %lld\r\n",
+                                     (long long)body_len);
+    while (1) {
+        if (header->value)
+            header_block_len += strlen(header->header) + sizeof(": ") - 1
+                                + strlen(header->value) + sizeof("\r\n") - 1;
+        if (header->next == config_opts.headers)
+            break;
+        header = header->next;
+    }
+    p = header_block = arena_alloc(&location_arena, header_block_len + 1);
+    if (p == NULL) {
+        fprintf(stderr, "Unable to allocate headers, exiting\n");
+        exit(-2);
+    }
+    *p = '\0';
+    if (body_fd >= 0)
+        p += sprintf(p, "Content-Length: %lld\r\n", (long long)body_len);
+    header = config_opts.headers;
+    while (1) {
+        if (header->value)
+            p += sprintf(p, "%s: %s\r\n", header->header, header->value);
+        if (header->next == config_opts.headers)
+            break;
+        header = header->next;
+    }
+}
+
 static size_t resource_length(struct location *location)
 {
     size_t rlen = 0;
@@ -66,23 +264,14 @@ static size_t resource_length(struct location *location)
 static size_t request_length(struct location *location)
 {
     size_t rlen = 0;
-    struct headers *header = config_opts.headers;
-    rlen += sizeof("GET ") - 1;
+    rlen += strlen(config_opts.method) + sizeof(" ") - 1;
     rlen += resource_length(location);
     rlen += sizeof(" HTTP/1.1\r\n") - 1;
-    while (1) {
-        if (header->value) {
-            rlen += strlen(header->header);
-            rlen += sizeof(": ") - 1;
-            rlen += strlen(header->value);
-            rlen += sizeof("\r\n") - 1;
-        }
-        if (header->next == config_opts.headers)
-            break;
-        header = header->next;
-    }
+    rlen += header_block_len;
     rlen += sizeof("Host: ") - 1;
     rlen += strlen(location->uri->hostname);
+    if (strchr(location->uri->hostname, ':'))
+        rlen += sizeof("[]") - 1;
     rlen += sizeof("\r\n\r\n") - 1;
     return rlen;
 }
@@ -96,9 +285,9 @@ static size_t write_resource(struct uri *uri, char *p)
         fprintf(stderr, "uri->fragment = '%s'\n", uri->fragment ? uri->fragment : "NULL");
     }
     if (uri->path)
-        p += sprintf(p, "GET %s", uri->path);
+        p += sprintf(p, "%s %s", config_opts.method, uri->path);
     else
-        p += sprintf(p, "GET /");
+        p += sprintf(p, "%s /", config_opts.method);
     if (uri->query)
         p += sprintf(p, "?%s", uri->query);
     if (uri->fragment)
@@ -109,143 +298,655 @@ static size_t write_resource(struct uri *uri, char *p)
 
 static void create_request(struct location *location)
 {
-    struct headers *header = config_opts.headers;
     char *p;
     location->rlen = request_length(location);
-    p = malloc(location->rlen + 1);
-    memset(p, 0, location->rlen + 1);
+    p = arena_alloc(&location_arena, location->rlen + 1);
+    if (p == NULL) {
+        fprintf(stderr, "Unable to allocate requests, exiting\n");
+        exit(-2);
+    }
     location->request = p;
     p += write_resource(location->uri, p);
-    while (1) {
-        if (header->value)
-            p += sprintf(p, "%s: %s\r\n", header->header, header->value);
-        if (header->next == config_opts.headers)
-            break;
-        header = header->next;
+    memcpy(p, header_block, header_block_len);
+    p += header_block_len;
+    /* IPv6 addresses keep their brackets */
+    if (strchr(location->uri->hostname, ':'))
+        sprintf(p, "Host: [%s]\r\n\r\n", location->uri->hostname);
+    else
+        sprintf(p, "Host: %s\r\n\r\n", location->uri->hostname);
+    if (config_opts.template) {
+        location->template = template_compile(location->request,
+                                              location->rlen, &location_arena);
+        if (location->template
+            && template_vars(location->template) > max_template_vars)
+            max_template_vars = template_vars(location->template);
+    }
+}
+
+static void set_location(struct location *location, int i, const char *url)
+{
+    location->index = i;
+    location->uristr = url;
+    location->uri = parse_uri(url, &location_arena);
+    if (location->uri == NULL) {
+        fprintf(stderr, "error parsing URI: %s, failing\n", url);
+        exit(-4);
     }
-    p += sprintf(p, "Host: %s\r\n\r\n", location->uri->hostname);
+    location->host = dns_host(config_opts.connect ? config_opts.connect
+                              : location->uri->hostname);
+    location->port = htons(config_opts.connect && config_opts.connect_port
+                           ? config_opts.connect_port : location->uri->port);
+    create_request(location);
 }
 
+/**
+ * Set up the locations for the URLs on the command line, followed by
+ * the ones in the -f file.
+ */
 static void set_locations(struct urls *urls)
 {
+    int i, n_urls = n_locations - n_file_locations;
+    char *p = url_file, *url;
+    size_t len;
+    for (i = 0; i < n_urls; i++) {
+        set_location(&locations[i], i, urls->url);
+        urls = urls->next;
+    }
+    for (; (len = next_file_url(&p, &url)) > 0; i++) {
+        if (url + len < url_file + url_file_len)
+            url[len] = '\0'; /* the \n or whitespace after it */
+        else if ((url = arena_strmemdup(&location_arena, url, len)) == NULL) {
+            fprintf(stderr, "Unable to allocate URLs, exiting\n");
+            exit(-2);
+        }
+        set_location(&locations[i], i, url);
+    }
+    /* all the hosts are looked up at once */
+    if (dns_resolve_all() < 0)
+        exit(-4);
+}
+
+/**
+ * Set up the --validate expectations, from --expect-crc if given: a
+ * comma-separated list of checksums in the same order as the URLs,
+ * where "-" (or nothing) means learn it from the first response.
+ */
+static void set_expectations()
+{
+    struct body_expect *expect = calloc(n_locations, sizeof(*expect));
+    char *list, *tok, *last, *end;
     int i;
-    for (i = 0; i < n_locations; i++) {
-        const char *host;
-        unsigned short port;
-        struct hostent *hostent;
-        locations[i].uristr = urls->url;
-        locations[i].uri = parse_uri(urls->url);
-        if (locations[i].uri == NULL) {
-            fprintf(stderr, "error parsing URI: %s, failing\n", urls->url);
-            exit(-4);
+    if (expect == NULL) {
+        fprintf(stderr, "Unable to allocate expectations, exiting\n");
+        exit(-2);
+    }
+    for (i = 0; i < n_locations; i++)
+        locations[i].expect = &expect[i];
+    if (config_opts.expect_crc == NULL)
+        return;
+    list = strdup(config_opts.expect_crc);
+    for (i = 0, tok = strtok_r(list, ",", &last); tok;
+         i++, tok = strtok_r(NULL, ",", &last)) {
+        if (i >= n_locations) {
+            fprintf(stderr, "More checksums (--expect-crc) than URLs\n");
+            exit(-1);
         }
-        host = locations[i].uri->hostname;
-        port = htons(locations[i].uri->port);
-        if (config_opts.connect) {
-            host = config_opts.connect;
-            if (config_opts.connect_port) {
-                port = htons(config_opts.connect_port);
-            }
+        if (strcmp(tok, "-") == 0)
+            continue;
+        expect[i].crc = strtoul(tok, &end, 16);
+        if (*tok == '\0' || *end != '\0') {
+            fprintf(stderr, "invalid checksum (--expect-crc): %s\n", tok);
+            exit(-1);
         }
-        hostent = gethostbyname(host);
-        if (hostent == NULL) {
-            fprintf(stderr, "gethostbyname error resolving %s: %s\n",
-                    host, hstrerror(h_errno));
-            exit(-4);
+        expect[i].state = EXPECT_READY;
+    }
+    free(list);
+}
+
+int location_validate(struct location *location,
+                      const struct response *resp)
+{
+    struct body_expect *expect = location->expect;
+    uint32_t crc = crc32c_final(resp->crc);
+    int rc = 0;
+
+    /* a short body read up to EOF isn't caught by the framing */
+    if (resp->content_length >= 0
+        && resp->body_bytes != (unsigned long long)resp->content_length) {
+        location->n_length_mismatches++;
+        rc = -1;
+    }
+    if (expect->state != EXPECT_READY) {
+        /* whichever thread gets here first sets the expectation */
+        if (rc == 0 && expect->state == EXPECT_LEARN
+            && __sync_bool_compare_and_swap(&expect->state, EXPECT_LEARN,
+                                            EXPECT_LEARNING)) {
+            expect->crc = crc;
+            expect->length = resp->body_bytes;
+            expect->has_length = 1;
+            __sync_synchronize();
+            expect->state = EXPECT_READY;
+            if (config_opts.verbose > 0)
+                fprintf(stderr, "Expecting crc32c %08x, %llu bytes from %s\n",
+                        crc, expect->length, location->uristr);
         }
-        if (hostent->h_addrtype == AF_INET) {
-            struct sockaddr_in *sa = malloc(sizeof(*sa));
-            locations[i].name = (struct sockaddr *)sa;
-            locations[i].namelen = sizeof(*sa);
-            sa->sin_family = hostent->h_addrtype;
-            sa->sin_port = port;
-            memcpy(&(sa->sin_addr.s_addr), hostent->h_addr_list[0],
-                   hostent->h_length);
-        } else if (hostent->h_addrtype == AF_INET6) {
-            fprintf(stderr, "ipv6 not yet supported\n");
-            exit(-3);
-        } else {
-            fprintf(stderr, "unknown address type\n");
-            exit(-3);
+        return rc;
+    }
+    if (expect->has_length && resp->body_bytes != expect->length) {
+        location->n_length_mismatches++;
+        rc = -1;
+    } else if (crc != expect->crc) {
+        location->n_crc_mismatches++;
+        rc = -1;
+    }
+    if (rc < 0 && config_opts.verbose > 0)
+        fprintf(stderr, "Unexpected body (crc32c %08x, %llu bytes) from %s\n",
+                crc, resp->body_bytes, location->uristr);
+    return rc;
+}
+
+static void tally_value(struct header_tally *tally, const char *value,
+                        size_t len, int count)
+{
+    int i;
+    if (len >= MAX_HEADER_VALUE_LEN)
+        len = MAX_HEADER_VALUE_LEN - 1;
+    for (i = 0; i < tally->n_values; i++) {
+        if (strncmp(tally->values[i], value, len) == 0
+            && tally->values[i][len] == '\0') {
+            tally->counts[i] += count;
+            return;
         }
-        create_request(&locations[i]);
-        urls = urls->next;
     }
+    if (tally->n_values == MAX_HEADER_VALUES) {
+        tally->other += count;
+        return;
+    }
+    memcpy(tally->values[i], value, len);
+    tally->values[i][len] = '\0';
+    tally->counts[i] = count;
+    tally->n_values++;
+}
+
+void location_record_headers(struct location *location,
+                             const struct response *resp)
+{
+    int i;
+    for (i = 0; i < config_opts.n_record_headers; i++) {
+        if (resp->recorded[i])
+            tally_value(&location->recorded[i], resp->recorded[i],
+                        resp->recorded_len[i], 1);
+        else
+            location->recorded[i].missing++;
+    }
+}
+
+static int max_connects_per_location;
+
+/* the heap order, ties go to the location given first like a scan would */
+#define HEAP_BEFORE(a, b) ((a)->n_concurrent < (b)->n_concurrent \
+                           || ((a)->n_concurrent == (b)->n_concurrent \
+                               && (a)->index < (b)->index))
+
+static void heap_place(struct balancer *balancer, int pos,
+                       struct location *location)
+{
+    balancer->heap[pos] = location;
+    location->heap_pos = pos;
+}
+
+/**
+ * Move the location at pos towards the root until its parent is before it.
+ */
+static void heap_up(struct balancer *balancer, int pos)
+{
+    struct location *location = balancer->heap[pos];
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (!HEAP_BEFORE(location, balancer->heap[parent]))
+            break;
+        heap_place(balancer, pos, balancer->heap[parent]);
+        pos = parent;
+    }
+    heap_place(balancer, pos, location);
+}
+
+/**
+ * Move the location at pos towards the leaves until its children are
+ * both after it.
+ */
+static void heap_down(struct balancer *balancer, int pos)
+{
+    struct location *location = balancer->heap[pos];
+    int child;
+    while ((child = 2 * pos + 1) < balancer->heap_size) {
+        if (child + 1 < balancer->heap_size
+            && HEAP_BEFORE(balancer->heap[child + 1], balancer->heap[child]))
+            child++;
+        if (!HEAP_BEFORE(balancer->heap[child], location))
+            break;
+        heap_place(balancer, pos, balancer->heap[child]);
+        pos = child;
+    }
+    heap_place(balancer, pos, location);
+}
+
+/**
+ * Take a location that has used up its share of the requests out of the
+ * heap for good.
+ */
+static void heap_remove(struct location *location)
+{
+    struct balancer *balancer = location->balancer;
+    int pos = location->heap_pos;
+    struct location *last;
+    if (pos < 0)
+        return;
+    location->heap_pos = -1;
+    last = balancer->heap[--balancer->heap_size];
+    if (last == location)
+        return;
+    /* the last one goes where the removed one was, and then wherever
+     * it belongs relative to its new neighbours */
+    heap_place(balancer, pos, last);
+    heap_up(balancer, pos);
+    heap_down(balancer, last->heap_pos);
+}
+
+static void init_rr(struct balancer *balancer)
+{
+    balancer->current_location_rr = -1;
+}
+
+static struct location *get_next_location_rr(struct balancer *balancer)
+{
+    /* Round-Robin */
+    if (++balancer->current_location_rr >= n_locations)
+        balancer->current_location_rr = 0;
+    return &balancer->locations[balancer->current_location_rr];
+}
+
+static void init_fair(struct balancer *balancer)
+{
+    int i;
+    /* nothing is in flight yet, so in order of index is already a heap */
+    balancer->heap = malloc(sizeof(*balancer->heap) * n_locations);
+    if (balancer->heap == NULL) {
+        fprintf(stderr, "Unable to allocate location heap, exiting\n");
+        exit(-2);
+    }
+    balancer->heap_size = n_locations;
+    for (i = 0; i < n_locations; i++)
+        heap_place(balancer, i, &balancer->locations[i]);
+}
+
+static struct location *get_next_location_fair(struct balancer *balancer)
+{
+    /* Locations leave the heap as soon as they run out (in
+     * location_connect() and location_reuse()), so the root is always
+     * the least loaded one that's left. */
+    if (balancer->heap_size == 0)
+        return NULL; /* no more locations left */
+    return balancer->heap[0];
+}
+
+/* a location index from 0 to n_locations - 1, without a division */
+#define RANDOM_INDEX(balancer) \
+    ((int)(((uint64_t)nrand48((balancer)->rand48) * n_locations) >> 31))
+
+static struct location *get_next_location_random(struct balancer *balancer)
+{
+    return &balancer->locations[RANDOM_INDEX(balancer)];
+}
+
+static struct location *get_next_location_p2c(struct balancer *balancer)
+{
+    struct location *a = get_next_location_random(balancer);
+    struct location *b = get_next_location_random(balancer);
+    return b->n_concurrent < a->n_concurrent ? b : a;
+}
+
+/**
+ * Read the --weights list (in the same order as the URLs, any left out
+ * are 1) and build the alias table from it.
+ */
+static void setup_weighted()
+{
+    double *scaled = malloc(sizeof(*scaled) * n_locations), total = 0.0;
+    int *small = malloc(sizeof(*small) * n_locations);
+    int *large = malloc(sizeof(*large) * n_locations);
+    int i, n_small = 0, n_large = 0;
+    char *list, *tok, *last, *end;
+
+    alias_prob = malloc(sizeof(*alias_prob) * n_locations);
+    alias_index = malloc(sizeof(*alias_index) * n_locations);
+    if (scaled == NULL || small == NULL || large == NULL
+        || alias_prob == NULL || alias_index == NULL) {
+        fprintf(stderr, "Unable to allocate weights, exiting\n");
+        exit(-2);
+    }
+    for (i = 0; i < n_locations; i++)
+        scaled[i] = 1.0;
+    list = config_opts.weights ? strdup(config_opts.weights) : NULL;
+    for (i = 0, tok = list ? strtok_r(list, ",", &last) : NULL; tok;
+         i++, tok = strtok_r(NULL, ",", &last)) {
+        if (i >= n_locations) {
+            fprintf(stderr, "More weights (--weights) than URLs\n");
+            exit(-1);
+        }
+        scaled[i] = strtod(tok, &end);
+        if (*end != '\0' || scaled[i] < 0.0) {
+            fprintf(stderr, "invalid weight (--weights): %s\n", tok);
+            exit(-1);
+        }
+    }
+    free(list);
+    for (i = 0; i < n_locations; i++)
+        total += scaled[i];
+    if (total <= 0.0) {
+        fprintf(stderr, "At least one weight (--weights) must be above 0\n");
+        exit(-1);
+    }
+
+    /* scale so the average is 1, then pair each location below that with
+     * one above it to make up the difference */
+    for (i = 0; i < n_locations; i++) {
+        scaled[i] *= n_locations / total;
+        if (scaled[i] < 1.0)
+            small[n_small++] = i;
+        else
+            large[n_large++] = i;
+    }
+    while (n_small > 0 && n_large > 0) {
+        int s = small[--n_small], l = large[--n_large];
+        alias_prob[s] = scaled[s];
+        alias_index[s] = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0)
+            small[n_small++] = l;
+        else
+            large[n_large++] = l;
+    }
+    /* whatever is left is 1 give or take rounding */
+    while (n_large > 0) {
+        i = large[--n_large];
+        alias_prob[i] = 1.0;
+        alias_index[i] = i;
+    }
+    while (n_small > 0) {
+        i = small[--n_small];
+        alias_prob[i] = 1.0;
+        alias_index[i] = i;
+    }
+    free(scaled);
+    free(small);
+    free(large);
+}
+
+static struct location *get_next_location_weighted(struct balancer *balancer)
+{
+    int i = RANDOM_INDEX(balancer);
+    if (erand48(balancer->rand48) >= alias_prob[i])
+        i = alias_index[i];
+    return &balancer->locations[i];
+}
+
+/* indexed by enum balance_mode */
+static const struct strategy strategies[] = {
+    { NULL, init_rr, get_next_location_rr },
+    { NULL, init_fair, get_next_location_fair },
+    { setup_weighted, NULL, get_next_location_weighted },
+    { NULL, NULL, get_next_location_p2c },
+    { NULL, NULL, get_next_location_random },
+};
+
+struct location *get_next_location(struct balancer *balancer)
+{
+    struct location *location = balancer->strategy->next(balancer);
+    if (location == NULL)
+        return NULL;
+    location->n_concurrent++;
+    if (location->heap_pos >= 0)
+        heap_down(balancer, location->heap_pos);
+    return location;
+}
+
+/* the heap is only kept by the fair balancer */
+#define THREAD_LOCATION_BYTES() \
+    ((sizeof(struct location) \
+      + (config_opts.balance == BALANCE_FAIR ? sizeof(struct location *) : 0)) \
+     * n_locations)
+
+void initialize_balancer()
+{
+    char buf[BUFSIZ], buf2[BUFSIZ], buf3[BUFSIZ];
+    uint64_t start = clock_ns();
+    int i;
+    if (config_opts.url_file)
+        map_url_file(config_opts.url_file);
+    n_locations = count_locations(config_opts.urls) + n_file_locations;
+    if (n_locations == 0) {
+        fprintf(stderr, "No URLs in %s\n", config_opts.url_file);
+        exit(-1);
+    }
+    locations = calloc(n_locations, sizeof(struct location));
+    connect_errors = calloc(n_locations, sizeof(*connect_errors));
+    if (locations == NULL || connect_errors == NULL) {
+        fprintf(stderr, "Unable to allocate locations, exiting\n");
+        exit(-2);
+    }
+    if (config_opts.csv && template_load_csv(config_opts.csv) < 0) {
+        fprintf(stderr, "Unable to read %s (--csv): %s\n", config_opts.csv,
+                strerror(errno));
+        exit(-1);
+    }
+    if (config_opts.body_file)
+        open_body_file(config_opts.body_file);
+    create_header_block();
+    set_locations(config_opts.urls);
+    if (config_opts.validate)
+        set_expectations();
+    for (i = 0; i < config_opts.n_record_headers; i++)
+        (void)response_record_header(config_opts.record_headers[i]);
+    /* only the fair balancer gives every location an even share of -n */
+    max_connects_per_location = config_opts.balance == BALANCE_FAIR
+                                ? config_opts.count / n_locations : INT_MAX;
+    if (strategies[config_opts.balance].setup)
+        strategies[config_opts.balance].setup();
+    location_histograms = n_locations * config_opts.threads
+                          <= MAX_LOCATION_HISTOGRAMS;
+    if (!location_histograms && config_opts.verbose > 0)
+        fprintf(stderr, "Too many URLs, not keeping per-URL latency "
+                "percentiles\n");
+    if (config_opts.dns_refresh && dns_start_refresh() < 0) {
+        perror("dns_start_refresh");
+        exit(-3);
+    }
+    setup_ns = clock_ns() - start;
+    if ((config_opts.url_file || config_opts.verbose > 1)
+        && config_opts.output == OUTPUT_TEXT) {
+        (void)format_ns(buf, sizeof(buf), setup_ns);
+        (void)format_bytes(buf2, sizeof(buf2), location_arena.size
+                           + sizeof(struct location) * n_locations);
+        (void)format_bytes(buf3, sizeof(buf3), THREAD_LOCATION_BYTES());
+        printf("Set up %d URLs in %s, using %s plus %s per thread\n",
+               n_locations, buf, buf2, buf3);
+    }
+}
+
+struct balancer *create_balancer()
+{
+    int i;
+    struct balancer *balancer = malloc(sizeof(*balancer));
+    if (balancer == NULL) {
+        fprintf(stderr, "Unable to allocate balancer, exiting\n");
+        exit(-2);
+    }
+    memset(balancer, 0, sizeof(*balancer));
+    balancer->strategy = &strategies[config_opts.balance];
+    balancer->locations = malloc(sizeof(struct location) * n_locations);
+    if (balancer->locations == NULL) {
+        fprintf(stderr, "Unable to allocate locations, exiting\n");
+        exit(-2);
+    }
+    memcpy(balancer->locations, locations,
+           sizeof(struct location) * n_locations);
     for (i = 0; i < n_locations; i++) {
-        int rv = start_accumulator(&locations[i].accumulator);
+        balancer->locations[i].balancer = balancer;
+        balancer->locations[i].heap_pos = -1;
+    }
+    balancer->addresses = calloc(MAX_ADDRESSES, sizeof(*balancer->addresses));
+    if (balancer->addresses == NULL) {
+        fprintf(stderr, "Unable to allocate address statistics, exiting\n");
+        exit(-2);
+    }
+    /* each thread gets its own random sequence */
+    balancer->rand48[0] = (unsigned short)clock_ns();
+    balancer->rand48[1] = (unsigned short)(clock_ns() >> 16);
+    balancer->rand48[2] = (unsigned short)n_balancers;
+    if (balancer->strategy->init)
+        balancer->strategy->init(balancer);
+    for (i = 0; i < n_locations; i++) {
+        int rv = start_accumulator(&balancer->locations[i].accumulator,
+                                   location_histograms);
         if (rv < 0) {
-            perror("start_accumulator (gettimeofday()) from set_locations");
+            perror("start_accumulator from create_balancer");
             exit(-3);
         }
+        if (config_opts.n_record_headers > 0) {
+            balancer->locations[i].recorded
+                = calloc(config_opts.n_record_headers,
+                         sizeof(struct header_tally));
+            if (balancer->locations[i].recorded == NULL) {
+                fprintf(stderr, "Unable to allocate header tallies, "
+                        "exiting\n");
+                exit(-2);
+            }
+        }
     }
+
+    balancers = realloc(balancers, sizeof(*balancers) * (n_balancers + 1));
+    if (balancers == NULL) {
+        fprintf(stderr, "Unable to allocate balancer list, exiting\n");
+        exit(-2);
+    }
+    balancers[n_balancers++] = balancer;
+    return balancer;
 }
 
-static int max_connects_per_location;
-void initialize_balancer()
+int balancer_locations()
 {
-    n_locations = count_locations(config_opts.urls);
-    locations = malloc(sizeof(struct location) * n_locations);
-    memset(locations, 0, sizeof(struct location) * n_locations);
-    set_locations(config_opts.urls);
-    max_connects_per_location = config_opts.count / n_locations;
+    return n_locations;
 }
 
-static int current_location_rr = -1;
-struct location *get_next_location_rr()
+int balancer_body(off_t *len)
 {
-    /* Round-Robin */
-    if (++current_location_rr >= n_locations)
-        current_location_rr = 0;
-    return &locations[current_location_rr];
+    *len = body_len;
+    return body_fd;
+}
+
+int balancer_template_vars()
+{
+    return max_template_vars;
+}
+
+int location_request(struct location *location, struct iovec *iov,
+                     char *scratch, size_t *len)
+{
+    if (location->template == NULL) {
+        iov[0].iov_base = (void *)location->request;
+        iov[0].iov_len = *len = location->rlen;
+        return 1;
+    }
+    return template_expand(location->template,
+                           __sync_add_and_fetch(&template_seq, 1),
+                           location->balancer->rand48, iov, scratch, len);
+}
+
+const char *balancer_location_url(int i)
+{
+    return locations[i].uristr;
 }
 
-struct location *get_next_location_fair()
+void balancer_reset_accumulators(struct balancer *balancer)
 {
     int i;
-    struct location *lowconn_loc = NULL;
-    /* FIXME: improve the efficiency of this for larger numbers of locations
-     * by using a heap */
     for (i = 0; i < n_locations; i++) {
-        struct location *testloc = &locations[i];
-        if (testloc->n_connects > max_connects_per_location)
-            continue;
-        else if (lowconn_loc == NULL)
-            lowconn_loc = testloc;
-        else if (testloc->n_concurrent < lowconn_loc->n_concurrent)
-            lowconn_loc = testloc;
+        struct location *location = &balancer->locations[i];
+        (void)reset_accumulator(&location->accumulator);
+        /* n_connects and n_concurrent go with the connections, which
+         * carry on from the warmup */
+        location->n_errors = 0;
+        connect_errors[i] = 0;
+        location->n_refused = 0;
+        location->n_http_errors = 0;
+        location->n_socket_errors = 0;
+        location->n_connect_timeouts = 0;
+        location->n_first_byte_timeouts = 0;
+        location->n_request_timeouts = 0;
+        location->n_crc_mismatches = 0;
+        location->n_length_mismatches = 0;
+        if (location->recorded)
+            memset(location->recorded, 0, config_opts.n_record_headers
+                                          * sizeof(struct header_tally));
+    }
+    for (i = 0; i < MAX_ADDRESSES; i++) {
+        if (balancer->addresses[i]) {
+            (void)reset_accumulator(&balancer->addresses[i]->accumulator);
+            balancer->addresses[i]->n_errors = 0;
+        }
     }
+}
 
-    if (lowconn_loc == NULL) {
-        return NULL; /* no more locations left */
-    } else {
-        lowconn_loc->n_concurrent++;
-        return lowconn_loc;
+/**
+ * This thread's statistics for an address, set up the first time it's
+ * connected to.
+ */
+static struct address_stats *address_stats(struct balancer *balancer,
+                                           int address)
+{
+    struct address_stats *stats = balancer->addresses[address];
+    if (stats)
+        return stats;
+    stats = calloc(1, sizeof(*stats));
+    if (stats == NULL || start_accumulator(&stats->accumulator, 1) < 0) {
+        fprintf(stderr, "Unable to allocate address statistics, exiting\n");
+        exit(-2);
     }
+    balancer->addresses[address] = stats;
+    return stats;
 }
 
-struct location *get_next_location()
+int location_address(struct location *location)
 {
-    /* FIXME: allow user to chose between Round-Robin and Fair */
-    return get_next_location_fair();
+    return dns_pick(location->host);
 }
 
-int location_connect(struct location *location, int sock)
+int location_connect(struct location *location, int sock, int address)
 {
+    const struct dns_addr *addr = dns_address(address);
+    struct sockaddr_storage sa;
     int e;
     int rc;
     if (config_opts.verbose > 4)
         fprintf(stderr, "location_connect(location '%s', sock %d)\n",
                 location->uristr, sock);
 retry_connect:
-    if (location->n_errors >= config_opts.max_connect_errors) {
+    if (connect_errors[location->index] >= config_opts.max_connect_errors) {
         fprintf(stderr, "Exceeded maximum connect errors for host: %s:%d\n",
                 location->uri->hostname,
                 location->uri->port);
+        errno = ECONNABORTED; /* so that it is counted as a failure */
         return -1;
     }
     if (config_opts.verbose > 3)
         fprintf(stderr, "connect()ing to socket %d\n", sock);
-    rc = connect(sock, location->name, location->namelen);
+    memcpy(&sa, &addr->sa, addr->len);
+    if (sa.ss_family == AF_INET6)
+        ((struct sockaddr_in6 *)&sa)->sin6_port = location->port;
+    else
+        ((struct sockaddr_in *)&sa)->sin_port = location->port;
+    rc = connect(sock, (struct sockaddr *)&sa, addr->len);
     e = errno;
     if (rc < 0) { /* failed connect */
         switch (e) {
@@ -253,46 +954,381 @@ retry_connect:
             goto retry_connect;
         case ECONNREFUSED:
         case ENETUNREACH:
+        case EHOSTUNREACH:
             if (config_opts.verbose > 2)
                 perror("connect");
-            location->n_errors++;
+            location_error(location, address);
+            location->n_refused++;
             goto retry_connect;
         case EAGAIN: // local port exhaustion on Linux
         case EADDRNOTAVAIL: // local port exhaustion on Solaris
+            return rc; // not a connect, the dispatcher will try again
         case EINPROGRESS: // non-blocking socket still connecting (good error)
         default:
             break;
         };
     }
     location->n_connects++;
+    address_stats(location->balancer, address)->n_connects++;
+    if (location->n_connects > max_connects_per_location)
+        heap_remove(location);
     return rc;
 }
 
+void location_reuse(struct location *location)
+{
+    if (config_opts.verbose > 4)
+        fprintf(stderr, "location_reuse(location '%s')\n",
+                location->uristr);
+    location->n_connects++;
+    if (location->n_connects > max_connects_per_location)
+        heap_remove(location);
+}
+
+void location_release(struct location *location)
+{
+    location->n_concurrent--;
+    if (location->heap_pos >= 0)
+        heap_up(location->balancer, location->heap_pos);
+    if (location->n_connects > max_connects_per_location) {
+        (void)stop_accumulator(&location->accumulator);
+    }
+}
+
+int location_reachable(struct location *location, struct location *prev,
+                       int address)
+{
+    return location->port == prev->port
+           && (location->host == prev->host
+               || dns_host_has(location->host, address));
+}
+
+void location_accumulate(struct location *location, int address,
+                         struct metrics *metrics)
+{
+    accumulate_metrics(&location->accumulator, metrics);
+    accumulate_metrics(&address_stats(location->balancer,
+                                      address)->accumulator, metrics);
+}
+
+void location_error(struct location *location, int address)
+{
+    location->n_errors++;
+    (void)__sync_add_and_fetch(&connect_errors[location->index], 1);
+    address_stats(location->balancer, address)->n_errors++;
+}
+
 int location_close(struct location *location, int sock)
 {
     int rc;
     rc = close(sock);
     if (rc == 0) { /* if successful close(), decrease concurrency count */
-        location->n_concurrent--;
-        if (location->n_connects > max_connects_per_location) {
-            (void)stop_accumulator(&location->accumulator);
-        }
+        location_release(location);
     }
     return rc;
 }
 
-int balancer_display(FILE *stream)
+/**
+ * Everything the dispatcher threads have counted for one location.
+ */
+struct location_totals {
+    struct accumulator acc;
+    int refused, http_errors, socket_errors;
+    int connect_timeouts, first_byte_timeouts, request_timeouts;
+    int crc_mismatches, length_mismatches;
+};
+
+/**
+ * Add up what each dispatcher thread did with location i. Unless this
+ * is the final display, the test is still running and the accumulators
+ * are left running.
+ * @returns -1 if the accumulator can't be allocated.
+ */
+static int total_location(struct location_totals *t, int i, int final)
+{
+    int j;
+    memset(t, 0, sizeof(*t));
+    if (start_accumulator(&t->acc, location_histograms) < 0) {
+        perror("start_accumulator from balancer_display");
+        return -1;
+    }
+    for (j = 0; j < n_balancers; j++) {
+        struct location *location = &balancers[j]->locations[i];
+        merge_accumulator(&t->acc, &location->accumulator);
+        t->refused += location->n_refused;
+        t->http_errors += location->n_http_errors;
+        t->socket_errors += location->n_socket_errors;
+        t->connect_timeouts += location->n_connect_timeouts;
+        t->first_byte_timeouts += location->n_first_byte_timeouts;
+        t->request_timeouts += location->n_request_timeouts;
+        t->crc_mismatches += location->n_crc_mismatches;
+        t->length_mismatches += location->n_length_mismatches;
+    }
+    if (!final) {
+        t->acc.stop = clock_ns();
+        t->acc.tdiff = t->acc.stop - t->acc.start;
+    }
+    return 0;
+}
+
+static void stop_location_accumulators()
 {
-    int i, ret = 0;
+    int i, j;
     for (i = 0; i < n_locations; i++)
-        (void)stop_accumulator(&locations[i].accumulator);
+        for (j = 0; j < n_balancers; j++)
+            (void)stop_accumulator(&balancers[j]->locations[i].accumulator);
+}
+
+/**
+ * Add up what each dispatcher thread saw of address i, like
+ * total_location().
+ * @returns 0 if no thread has connected to it, -1 if the accumulator
+ *          can't be allocated.
+ */
+static int total_address(struct address_stats *t, int i, int final)
+{
+    int j, used = 0;
+    memset(t, 0, sizeof(*t));
+    if (start_accumulator(&t->accumulator, 1) < 0) {
+        perror("start_accumulator from balancer_display");
+        return -1;
+    }
+    for (j = 0; j < n_balancers; j++) {
+        struct address_stats *from = balancers[j]->addresses[i];
+        if (from == NULL)
+            continue;
+        if (final)
+            (void)stop_accumulator(&from->accumulator);
+        merge_accumulator(&t->accumulator, &from->accumulator);
+        t->n_connects += from->n_connects;
+        t->n_errors += from->n_errors;
+        used = 1;
+    }
+    if (!final) {
+        t->accumulator.stop = clock_ns();
+        t->accumulator.tdiff = t->accumulator.stop - t->accumulator.start;
+    }
+    if (!used)
+        free_accumulator(&t->accumulator);
+    return used;
+}
+
+/**
+ * Print the per-address statistics, if the URLs have more than one
+ * address between them, to show up a backend that is slower.
+ */
+static int display_addresses(FILE *stream, int final)
+{
+    char buf[INET6_ADDRSTRLEN];
+    int i, n = dns_addresses(), ret = 0;
+    if (n < 2)
+        return 0;
+    for (i = 0; i < n; i++) {
+        struct address_stats t;
+        if (total_address(&t, i, final) <= 0)
+            continue;
+        ret += fprintf(stream, "Statistics for address %s\n",
+                       dns_address_string(i, buf, sizeof(buf)));
+        ret += print_accumulator(stream, &t.accumulator);
+        ret += fprintf(stream, "    Connections: %d, Errors: %d\n\n",
+                       t.n_connects, t.n_errors);
+        free_accumulator(&t.accumulator);
+    }
+    return ret;
+}
+
+static int print_validation(FILE *stream, struct location *location,
+                            struct location_totals *t)
+{
+    struct body_expect *expect = location->expect;
+    if (expect->state != EXPECT_READY)
+        return fprintf(stream, "    Validation: no good body seen,"
+                       " %d length mismatches\n", t->length_mismatches);
+    if (expect->has_length)
+        return fprintf(stream, "    Validation: crc32c %08x, %llu bytes:"
+                       " %d checksum mismatches, %d length mismatches\n",
+                       expect->crc, expect->length, t->crc_mismatches,
+                       t->length_mismatches);
+    return fprintf(stream, "    Validation: crc32c %08x: %d checksum"
+                   " mismatches, %d length mismatches\n", expect->crc,
+                   t->crc_mismatches, t->length_mismatches);
+}
+
+/**
+ * Add up each thread's counts of the values of recorded header h.
+ */
+static void total_recorded(struct header_tally *tally, int i, int h)
+{
+    int j, k;
+    memset(tally, 0, sizeof(*tally));
+    for (j = 0; j < n_balancers; j++) {
+        struct header_tally *from = &balancers[j]->locations[i].recorded[h];
+        for (k = 0; k < from->n_values; k++)
+            tally_value(tally, from->values[k], strlen(from->values[k]),
+                        from->counts[k]);
+        tally->other += from->other;
+        tally->missing += from->missing;
+    }
+}
+
+static int print_recorded(FILE *stream, int i)
+{
+    struct header_tally tally;
+    int h, k, ret = 0;
+    for (h = 0; h < config_opts.n_record_headers; h++) {
+        total_recorded(&tally, i, h);
+        ret += fprintf(stream, "    Header %s:", config_opts.record_headers[h]);
+        for (k = 0; k < tally.n_values; k++)
+            ret += fprintf(stream, "%s \"%s\" x %d", k ? "," : "",
+                           tally.values[k], tally.counts[k]);
+        if (tally.other)
+            ret += fprintf(stream, "%s (other) x %d",
+                           tally.n_values ? "," : "", tally.other);
+        if (tally.missing)
+            ret += fprintf(stream, "%s (not sent) x %d",
+                           tally.n_values || tally.other ? "," : "",
+                           tally.missing);
+        ret += fprintf(stream, "\n");
+    }
+    return ret;
+}
+
+/**
+ * Print the per-location statistics. Unless this is the final display,
+ * the test is still running and the accumulators are left running.
+ */
+static int display_locations(FILE *stream, int final)
+{
+    int i, ret = 0, unused = 0;
+    if (final)
+        stop_location_accumulators();
     for (i = 0; i < n_locations; i++) {
-        ret += fprintf(stream, "Statistics for URL %d: %s\n", i + 1, locations[i].uristr);
-        if (n_locations == 1)
+        struct location_totals t;
+        if (n_locations == 1) {
+            ret += fprintf(stream, "Statistics for URL %d: %s\n", i + 1,
+                           locations[i].uristr);
+            /* the rest is the same as the totals */
+            if (config_opts.n_record_headers > 0)
+                ret += print_recorded(stream, i) + fprintf(stream, "\n");
+            return ret + display_addresses(stream, final);
+        }
+        if (total_location(&t, i, final) < 0)
             return ret;
-        ret += print_accumulator(stream, &locations[i].accumulator);
+        /* with a long list (-f) most URLs may never have been used */
+        if (!location_histograms && t.acc.total_measurements == 0
+            && t.refused + t.http_errors + t.socket_errors
+               + t.connect_timeouts + t.first_byte_timeouts
+               + t.request_timeouts == 0) {
+            unused++;
+            free_accumulator(&t.acc);
+            continue;
+        }
+        ret += fprintf(stream, "Statistics for URL %d: %s\n", i + 1, locations[i].uristr);
+        ret += print_accumulator(stream, &t.acc);
+        if (t.http_errors || t.socket_errors || t.refused)
+            ret += fprintf(stream, "    Errors: %d HTTP, %d socket,"
+                           " %d connect refused\n", t.http_errors,
+                           t.socket_errors, t.refused);
+        if (t.connect_timeouts || t.first_byte_timeouts || t.request_timeouts)
+            ret += fprintf(stream, "    Timeouts: %d connect, %d first byte,"
+                           " %d total\n", t.connect_timeouts,
+                           t.first_byte_timeouts, t.request_timeouts);
+        if (config_opts.validate)
+            ret += print_validation(stream, &locations[i], &t);
+        ret += print_recorded(stream, i);
         ret += fprintf(stream, "\n");
+        free_accumulator(&t.acc);
     }
-    return ret;
+    if (unused > 0)
+        ret += fprintf(stream, "(%d URLs with no requests not shown)\n\n",
+                       unused);
+    return ret + display_addresses(stream, final);
+}
+
+static void report_recorded(struct report *r, int i)
+{
+    struct header_tally tally;
+    int h, k;
+    report_begin(r, "headers");
+    for (h = 0; h < config_opts.n_record_headers; h++) {
+        total_recorded(&tally, i, h);
+        report_begin(r, config_opts.record_headers[h]);
+        for (k = 0; k < tally.n_values; k++)
+            report_int(r, tally.values[k], tally.counts[k]);
+        report_int(r, "(other)", tally.other);
+        report_int(r, "(not sent)", tally.missing);
+        report_end(r);
+    }
+    report_end(r);
 }
 
+void balancer_report(struct report *r, int final)
+{
+    int i;
+    if (final)
+        stop_location_accumulators();
+    report_begin(r, "url_setup");
+    report_int(r, "urls", n_locations);
+    report_uint(r, "setup_ns", setup_ns);
+    report_uint(r, "shared_bytes", location_arena.size
+                + sizeof(struct location) * n_locations);
+    report_uint(r, "per_thread_bytes", THREAD_LOCATION_BYTES());
+    report_end(r);
+    report_begin_list(r, "locations");
+    for (i = 0; i < n_locations; i++) {
+        struct location_totals t;
+        if (total_location(&t, i, final) < 0)
+            break;
+        report_begin(r, NULL);
+        report_string(r, "url", locations[i].uristr);
+        report_accumulator(r, &t.acc);
+        report_begin(r, "errors");
+        report_int(r, "http", t.http_errors);
+        report_int(r, "socket", t.socket_errors);
+        report_int(r, "connect_refused", t.refused);
+        report_int(r, "connect_timeouts", t.connect_timeouts);
+        report_int(r, "first_byte_timeouts", t.first_byte_timeouts);
+        report_int(r, "request_timeouts", t.request_timeouts);
+        report_int(r, "crc_mismatches", t.crc_mismatches);
+        report_int(r, "length_mismatches", t.length_mismatches);
+        report_end(r);
+        if (config_opts.validate
+            && locations[i].expect->state == EXPECT_READY) {
+            report_begin(r, "expect");
+            report_uint(r, "crc32c", locations[i].expect->crc);
+            if (locations[i].expect->has_length)
+                report_uint(r, "length", locations[i].expect->length);
+            report_end(r);
+        }
+        if (config_opts.n_record_headers > 0)
+            report_recorded(r, i);
+        report_end(r);
+        free_accumulator(&t.acc);
+    }
+    report_end_list(r);
+    report_begin_list(r, "addresses");
+    for (i = 0; i < dns_addresses(); i++) {
+        char buf[INET6_ADDRSTRLEN];
+        struct address_stats t;
+        if (total_address(&t, i, final) <= 0)
+            continue;
+        report_begin(r, NULL);
+        report_string(r, "address", dns_address_string(i, buf, sizeof(buf)));
+        report_int(r, "connections", t.n_connects);
+        report_int(r, "errors", t.n_errors);
+        report_accumulator(r, &t.accumulator);
+        report_end(r);
+        free_accumulator(&t.accumulator);
+    }
+    report_end_list(r);
+}
+
+int balancer_display(FILE *stream)
+{
+    return display_locations(stream, 1);
+}
+
+int balancer_snapshot(FILE *stream)
+{
+    return display_locations(stream, 0);
+}
@@ -28,33 +28,204 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "parse_uri.h"
+#include "response.h"
 #include "metrics.h"
+#include "report.h"
+
+/* what every response body from a location should look like (--validate),
+ * shared by all the threads' copies of the location */
+struct body_expect {
+    volatile int state;     /* EXPECT_LEARN until the first body is seen */
+    int has_length;         /* not set when only --expect-crc was given */
+    uint32_t crc;
+    unsigned long long length;
+};
+
+/* distinct values counted for each --record-header, per location */
+#define MAX_HEADER_VALUES 16
+#define MAX_HEADER_VALUE_LEN 64
+
+struct header_tally {
+    int n_values;
+    char values[MAX_HEADER_VALUES][MAX_HEADER_VALUE_LEN];
+    int counts[MAX_HEADER_VALUES];
+    int other;              /* values that didn't fit */
+    int missing;            /* responses without the header */
+};
+
+#define EXPECT_LEARN 0
+#define EXPECT_LEARNING 1
+#define EXPECT_READY 2
+
+struct balancer;
+struct dns_host;
 
 struct location {
+    int index; /* position in the list of URLs, from 0 */
+    struct balancer *balancer; /* the thread's balancer this copy is in */
+    int heap_pos; /* in the balancer's heap, -1 once it has run out
+                   * (or if the balancer doesn't keep one) */
     const char *uristr;
     struct uri *uri;
-    struct sockaddr *name;
-    socklen_t namelen;
+    struct dns_host *host; /* the -C host, or the one in the URL */
+    unsigned short port; /* in network byte order */
 
     const char *request;
     size_t rlen;
+    struct template *template; /* NULL unless --template found placeholders */
 
     int n_errors;
+    int n_refused; /* connects refused or unreachable (counted in n_errors) */
+    int n_http_errors; /* 4xx/5xx responses */
+    int n_socket_errors; /* other failures, eg. resets */
     int n_connects;
     int n_concurrent; /* total currently connected to this location */
+    int n_connect_timeouts;
+    int n_first_byte_timeouts;
+    int n_request_timeouts; /* hit the total (--timeout) limit */
+    struct body_expect *expect; /* NULL unless --validate */
+    int n_crc_mismatches;
+    int n_length_mismatches; /* wrong size, or not what Content-Length said */
+    struct header_tally *recorded; /* one per --record-header */
     struct accumulator accumulator;
 };
 
 void initialize_balancer();
 
-struct location *get_next_location();
+/**
+ * Create a balancer with its own copy of the per-location counters and
+ * accumulators, for use by a single dispatcher thread.
+ */
+struct balancer *create_balancer();
+
+/**
+ * How many locations there are: the URLs on the command line followed
+ * by those in the -f file.
+ */
+int balancer_locations();
+
+/**
+ * The URL of location i, counting from 0 in the same order.
+ */
+const char *balancer_location_url(int i);
+
+/**
+ * Throw away what this balancer's accumulators and error counters have
+ * collected so far, eg. at the end of the --warmup period.
+ */
+void balancer_reset_accumulators(struct balancer *balancer);
+
+/**
+ * Pick the location for the next request as --balance says, and count
+ * one more request in flight against it. The default (fair) picks the
+ * location with the fewest requests in flight (the lowest index among
+ * equals) that hasn't used up its share of the -n count, in O(log n)
+ * in the number of locations. The others take constant time.
+ * @returns NULL once every location has used up its share.
+ */
+struct location *get_next_location(struct balancer *balancer);
+
+/**
+ * Pick which of the location's addresses to connect to next, each in
+ * turn, for location_connect() and dns_address().
+ */
+int location_address(struct location *location);
+
+/**
+ * The --body-file sent after every request, and its length.
+ * @returns its descriptor, for sendfile(), or -1 if there is no body.
+ */
+int balancer_body(off_t *len);
+
+/**
+ * The most placeholders in any location's request (--template), 0 if
+ * every request is sent as it is.
+ */
+int balancer_template_vars();
+
+/**
+ * Point iov at the next request for this location: just location->request,
+ * or with --template its text and this request's values in between, the
+ * numbers written into scratch (TEMPLATE_NUMBER_LEN bytes for each of
+ * balancer_template_vars()).
+ * @returns the number of iovecs, at most 2 * balancer_template_vars() + 1,
+ *          with the total length in *len.
+ */
+int location_request(struct location *location, struct iovec *iov,
+                     char *scratch, size_t *len);
 
-int location_connect(struct location *location, int sock);
+/**
+ * Start connecting the socket to the location at the given address, which
+ * must be of the socket's family.
+ */
+int location_connect(struct location *location, int sock, int address);
 int location_close(struct location *location, int sock);
 
+/**
+ * Count a request sent to this location over an already open (kept-alive)
+ * connection, in place of location_connect().
+ */
+void location_reuse(struct location *location);
+
+/**
+ * Stop counting a finished request against this location's concurrency,
+ * without closing its socket. location_close() does this implicitly.
+ */
+void location_release(struct location *location);
+
+/**
+ * Check a complete response body against what this location is expected
+ * to return, counting any mismatches. The first body checked for each
+ * location becomes the expected one, unless --expect-crc gave it.
+ * @returns 0 if it matched (or set the expectation), -1 if not.
+ */
+int location_validate(struct location *location,
+                      const struct response *resp);
+
+/**
+ * Count the values of the --record-header headers in a response.
+ */
+void location_record_headers(struct location *location,
+                             const struct response *resp);
+
+/**
+ * Add a finished request's metrics to the location's accumulator, and to
+ * those of the address it was sent to.
+ */
+void location_accumulate(struct location *location, int address,
+                         struct metrics *metrics);
+
+/**
+ * Count a failed request (including a timeout) against its location and
+ * the address it was sent to, and towards the -M limit for the location,
+ * which is shared by all the threads. The location keeps its own more
+ * detailed counts.
+ */
+void location_error(struct location *location, int address);
+
+/**
+ * True if a connection to address, made for prev, can carry requests for
+ * the location.
+ */
+int location_reachable(struct location *location, struct location *prev,
+                       int address);
+
 int balancer_display(FILE *stream);
 
+/**
+ * Like balancer_display(), but while the test is still running.
+ */
+int balancer_snapshot(FILE *stream);
+
+/**
+ * Add the per-location statistics to a JSON or CSV report, as the
+ * "locations" list. Unless final is set the test is still running.
+ */
+void balancer_report(struct report *r, int final);
+
 #endif /* __balancer_h */
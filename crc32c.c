@@ -0,0 +1,116 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file crc32c.c
+ * @brief Streaming CRC32C (Castagnoli) checksums, for --validate.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#include <string.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#define HAVE_SSE42_CRC 1
+#endif
+
+#include "crc32c.h"
+
+#define POLY 0x82f63b78U /* reflected Castagnoli polynomial */
+
+/* slicing-by-8 tables for the portable version */
+static uint32_t table[8][256];
+
+#ifdef HAVE_SSE42_CRC
+static int use_sse42 = 0;
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t crc64;
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    while (len-- > 0)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + 4, sizeof(hi));
+#ifdef WORDS_BIGENDIAN
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff]
+              ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24]
+              ^ table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff]
+              ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    }
+    while (len-- > 0)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+int crc32c_init(void)
+{
+    uint32_t i, j, crc;
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 8; j++)
+            table[j][i] = (table[j - 1][i] >> 8)
+                          ^ table[0][table[j - 1][i] & 0xff];
+#ifdef HAVE_SSE42_CRC
+    __builtin_cpu_init();
+    use_sse42 = __builtin_cpu_supports("sse4.2");
+    return use_sse42;
+#else
+    return 0;
+#endif
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len)
+{
+#ifdef HAVE_SSE42_CRC
+    if (use_sse42)
+        return crc32c_sse42(crc, buf, len);
+#endif
+    return crc32c_sw(crc, buf, len);
+}
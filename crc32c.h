@@ -0,0 +1,51 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file crc32c.h
+ * @brief Streaming CRC32C (Castagnoli) checksums, for --validate.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#ifndef __crc32c_h
+#define __crc32c_h
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC32C_INIT 0xffffffffU
+
+/**
+ * Pick the SSE4.2 crc32 instruction if the CPU has it, or build the
+ * tables for the portable version. Must be called before any threads
+ * are started.
+ * @returns 1 if the hardware version will be used, 0 if not.
+ */
+int crc32c_init(void);
+
+/**
+ * Add len bytes to a running checksum, which starts out as CRC32C_INIT.
+ * The finished checksum is crc32c_final() of the last value returned.
+ */
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len);
+
+#define crc32c_final(crc) ((crc) ^ 0xffffffffU)
+
+#endif /* __crc32c_h */
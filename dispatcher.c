@@ -22,6 +22,11 @@
  * @author Aaron Bannert (aaron@codemass.com)
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for splice() */
+#endif
+#include "config.h"
+
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -29,83 +34,1043 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <event.h>
 #include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#include <limits.h>
 
 #include "params.h"
 #include "dispatcher.h"
 #include "balancer.h"
 #include "metrics.h"
 #include "formats.h"
+#include "response.h"
+#include "timer_wheel.h"
+#include "trace.h"
+#include "crc32c.h"
+#include "dns.h"
+#include "template.h"
+
+#define HEADER_SLAB (64) /* header buffers allocated at once */
+#define DISCARD_MAX (1048576) /* bytes thrown away at once with --discard */
+#define PORT_RETRY_US (10000) /* wait after running out of local ports */
+#define MAX_SOURCES (65536) /* --bind addresses, a /16 worth */
+#ifdef MSG_MORE
+#define HEADER_MORE MSG_MORE /* a header with a body to follow */
+#else
+#define HEADER_MORE 0
+#endif
 
-#define MAX_HEADER (4096)
-#define BODY_BUFSIZ (131072)
+/* resolution of the connect/first byte/total timeouts */
+#define WHEEL_TICK_USEC (10000)
+
+enum timeout_kind {
+    TIMEOUT_CONNECT = 0, /* also for connects libevent timed out */
+    TIMEOUT_FIRST_BYTE,
+    TIMEOUT_TOTAL,
+};
+
+struct dispatcher;
 
 struct connection {
     int num;
+    struct dispatcher *dispatcher; /* the thread this connection runs in */
     enum state state;
     int socket;
+    int sockopen; /* set to 1 while socket is open and needs closing */
     int error;
     int written;
     struct location *location; /* currently fetching from this location */
-    char buf[MAX_HEADER];
+    int address; /* which of its addresses the socket is connected to */
+    char *buf; /* header buffer from the thread's pool, NULL unless one
+                * is being read, see hold_header_buffer() */
     ssize_t nbytes; /* number of bytes read into buffer */
     ssize_t responselen; /* total bytes read for the response */
-    float http_version;
-    unsigned int resp_code; /* response code */
-    const char *resp_str; /* response string */
-    struct metrics metrics; /* metrics for this request */
+    struct response resp; /* parsed response header and framing state */
+    const char *leftover; /* bytes read past the end of the response */
+    size_t leftoverlen;
+    int reuse; /* set to 1 if the connection is kept alive afterwards */
+    int batch; /* number of requests pipelined in the current write */
+    int current; /* index of the response currently being read */
+    struct metrics *metrics; /* metrics for each request in the batch */
+    struct iovec *iov; /* --template: the batch being written, NULL without */
+    char *scratch; /* the numbers that iov points at */
+    int n_iov; /* iovecs in iov, 0 until the batch is filled in */
+    int iov_pos; /* the first one not yet completely written */
+    size_t request_len; /* bytes in the whole batch */
+    /* with a --body-file the requests of a batch go one at a time, iov
+     * holding just the header of the one being sent */
+    int sending; /* the request of the batch being sent */
+    off_t body_sent; /* bytes of its body sent so far */
     int connected; /* set to 1 when connected, 0 otherwise */
+    struct event ev; /* persistent I/O event, re-armed in place */
+    short ev_flags; /* EV_READ/EV_WRITE currently armed, 0 if not added */
+    struct wheel_timer phase_timer; /* the connect or first byte timeout */
+    enum timeout_kind phase_kind; /* which one phase_timer is */
+    struct wheel_timer total_timer; /* the --timeout for the request */
+    enum timeout_kind timed_out; /* which timeout sent us to ST_TIMEOUT */
+    int exhausted; /* connects in a row that found no local port */
+    int fastopen; /* set until the first response shows if TFO was used */
+    int scheduled; /* set when started by the --rate schedule */
+    uint64_t intended; /* when the schedule wanted it to start */
 };
 
-static struct accumulator global_accumulator;
+/**
+ * Everything a dispatcher thread (-T) touches while running. Each thread
+ * has its own event base, its own slice of the connections and its own
+ * balancer and accumulators, which are merged for display at the end.
+ */
+struct dispatcher {
+    int num;
+    pthread_t thread;
+    struct event_base *base;
+    struct balancer *balancer;
+    struct connection *connections;
+    int n_slots; /* number of connections in this thread */
+    struct metrics *connection_metrics;
+    struct iovec *connection_iov; /* --template, iov_stride per connection */
+    char *connection_scratch; /* scratch_stride per connection */
+    struct accumulator accumulator;
+    int n_connections;
+    unsigned long long total_bytes_received;
+    unsigned long long total_bytes_sent; /* requests, with any bodies */
+    int idle_depth;
+    int n_finished; /* connections that have nothing left to do */
+    struct timer_wheel wheel; /* every connection's timeouts */
+    struct event wheel_ev; /* ticks the wheel */
+    int n_connect_timeouts;
+    int n_first_byte_timeouts;
+    int n_request_timeouts;
+    int n_http_errors;
+    int n_socket_errors;
+    int n_port_exhausted; /* connects that found no local port */
+    int n_fastopen; /* connections whose SYN carried the request */
+    int next_source; /* the --bind address bind_source() tries next */
+    int n_validated; /* bodies checked by --validate */
+    int n_invalid; /* ... that didn't match */
+    struct event deadline_ev; /* fires when -t runs out */
+    struct event interval_ev; /* fires every --interval */
+    struct event usr1_ev; /* SIGUSR1, only in the first thread */
+    int snapshot_pipe[2]; /* wakes the others to hold still for it */
+    struct event snapshot_ev;
+    struct trace_buffer *trace; /* records on their way to --trace */
+
+    /* results since this thread last added to the --interval report */
+    struct accumulator interval;
+    unsigned long long interval_bytes;
+    int interval_errors;
+    struct event warmup_ev; /* fires when --warmup is over */
+
+    /* the open-loop (--rate) schedule, see rate_schedule() */
+    double rate; /* this thread's share of the requests per second */
+    struct event rate_ev; /* fires when the next arrival is due */
+    uint64_t rate_start;
+    double rate_offset; /* ns from rate_start to next_arrival */
+    uint64_t next_arrival;
+    unsigned short rand48[3];
+    struct connection **waiting; /* free connections, as a stack */
+    int n_waiting;
+    int scheduling; /* set while rate_schedule() is starting requests */
+    int n_scheduled;
+    double lag_total; /* ns that requests started behind schedule */
+    double lag_max;
 
-static int n_dispatched = 0;
-static int n_concurrent = 0;
-static int max_concurrent = 0;
-static unsigned long long total_bytes_received = 0;
+    int discard_pipe[2]; /* --discard splice goes socket -> pipe -> devnull */
+
+    char *body_buf; /* config_opts.read_buffer bytes */
+
+    /* Header buffers are only needed while a header is being read, so
+     * connections take them from here and give them back once the body
+     * starts, instead of each carrying one around. */
+    char *free_headers; /* linked through the first bytes of each */
+    int n_header_buffers; /* allocated so far */
+    int headers_in_use;
+    int headers_peak;
+};
+
+static struct dispatcher *dispatchers;
+
+/* shared by all threads, only ever updated atomically */
+static volatile int n_dispatched = 0;
+static volatile int n_concurrent = 0;
+static volatile int max_concurrent = 0;
+static volatile int stop_dispatching = 0; /* set once -t runs out */
+
+/* any of the connect/first byte/total timeouts is configured */
+#define TIMEOUTS_ENABLED() (config_opts.connect_timeout > 0.0 \
+                            || config_opts.first_byte_timeout > 0.0 \
+                            || config_opts.timeout > 0.0)
+
+/* no more requests are to be started, by -n or by -t */
+#define DISPATCH_DONE() (stop_dispatching || n_dispatched >= config_opts.count)
+
+/* The --interval report. Each thread adds in its share when its interval
+ * timer fires, and whichever one is last prints the line. */
+static pthread_mutex_t interval_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct accumulator interval_acc;
+static unsigned long long interval_bytes;
+static int interval_errors;
+static int interval_added; /* threads that have added to this interval */
+static int interval_threads; /* threads that are still running */
+static uint64_t interval_start;
+
+/* A SIGUSR1 snapshot is printed by the first thread while the others are
+ * held still in snapshot_pause(), so that it never sees their counters
+ * half updated. Also under interval_lock. */
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;
+static int snapshot_paused; /* threads waiting for the snapshot to finish */
+static int snapshot_generation; /* counts the snapshots taken */
+static int live_threads; /* threads that haven't run out of requests */
+
+static uint64_t run_start; /* when run_dispatcher() was called */
+static struct rusage run_usage; /* CPU used before run_dispatcher() */
+static int devnull = -1; /* for --discard splice */
+static int body_fd = -1; /* balancer_body(), -1 if the requests have none */
+static off_t body_len;
+static int head_requests; /* -m HEAD, so no response has a body */
+static uint64_t warmup_end; /* results from before this are dropped */
+
+/* the --bind source addresses, used in turn by bind_source() */
+static struct sockaddr_storage *sources;
+static int n_sources;
 
 static struct timeval tvnow = { 0, 0 };
 
-static struct connection *connections;
+/* the metrics for the request whose response we're currently reading */
+#define CURRENT_METRICS(conn) (&(conn)->metrics[(conn)->current])
+
+/* libevent wants its timeouts as timevals */
+#define NS_TO_TIMEVAL(ns, tv) \
+    do { \
+        (tv)->tv_sec = (ns) / 1000000000ULL; \
+        (tv)->tv_usec = ((ns) % 1000000000ULL) / 1000; \
+    } while (0)
+
+/* rusage times come back as timevals */
+#define TIMEVAL_NS(tv) ((tv)->tv_sec * 1000000000ULL + (tv)->tv_usec * 1000ULL)
+
+/* Bounds how deeply ST_IDLE may be processed by direct call (eg. when
+ * connects fail immediately) before we fall back to the event loop. */
+#define MAX_IDLE_DEPTH (64)
 
 static void process_state(struct connection *conn);
+static void process_event(int fd, short event, void *_conn);
+
+/**
+ * Make sure the connection's persistent event is watching for exactly
+ * the given events. This is a no-op if it already is, so consecutive
+ * states waiting on the same event (eg. reading the header then the
+ * body) don't touch the event loop at all.
+ */
+static void arm_event(struct connection *conn, short what)
+{
+    if (conn->ev_flags == what)
+        return;
+    if (conn->ev_flags)
+        event_del(&conn->ev);
+    event_set(&conn->ev, conn->socket, what | EV_PERSIST, process_event,
+              conn);
+    event_base_set(conn->dispatcher->base, &conn->ev);
+    if (event_add(&conn->ev, NULL) < 0) {
+        perror("event_add");
+        exit(-5);
+    }
+    conn->ev_flags = what;
+}
+
+/**
+ * Remove the connection's persistent event from the event loop. Must be
+ * called before the socket is closed or the connection is reset.
+ */
+static void disarm_event(struct connection *conn)
+{
+    if (conn->ev_flags) {
+        event_del(&conn->ev);
+        conn->ev_flags = 0;
+    }
+}
+
+static void start_connect(struct connection *conn);
+void process_idle(int fd, short event, void *_conn);
+
+static void timeout_fired(struct wheel_timer *timer, void *_conn)
+{
+    struct connection *conn = (struct connection *)_conn;
+    conn->timed_out = timer == &conn->total_timer ? TIMEOUT_TOTAL
+                                                  : conn->phase_kind;
+    conn->state = ST_TIMEOUT;
+    process_state(conn);
+}
+
+static void init_timeouts(struct connection *conn)
+{
+    wheel_timer_init(&conn->phase_timer, timeout_fired, conn);
+    wheel_timer_init(&conn->total_timer, timeout_fired, conn);
+}
+
+/**
+ * Start the connect or first byte timeout, if that one is configured.
+ */
+static void start_phase_timeout(struct connection *conn,
+                                enum timeout_kind kind, double seconds)
+{
+    if (seconds <= 0.0)
+        return;
+    conn->phase_kind = kind;
+    wheel_timer_add(&conn->dispatcher->wheel, &conn->phase_timer,
+                    (long long)(seconds * 1000000.0));
+}
+
+/**
+ * Start the --timeout for a whole request (or pipelined batch).
+ */
+static void start_total_timeout(struct connection *conn)
+{
+    if (config_opts.timeout <= 0.0)
+        return;
+    wheel_timer_add(&conn->dispatcher->wheel, &conn->total_timer,
+                    (long long)(config_opts.timeout * 1000000.0));
+}
+
+#define stop_phase_timeout(conn) \
+    wheel_timer_del(&(conn)->dispatcher->wheel, &(conn)->phase_timer)
+
+static void stop_timeouts(struct connection *conn)
+{
+    wheel_timer_del(&conn->dispatcher->wheel, &conn->phase_timer);
+    wheel_timer_del(&conn->dispatcher->wheel, &conn->total_timer);
+}
+
+/**
+ * Close the connection's socket, if it is still open.
+ */
+static void close_socket(struct connection *conn)
+{
+    disarm_event(conn);
+    if (conn->sockopen) {
+        (void)location_close(conn->location, conn->socket);
+        conn->sockopen = 0;
+    }
+}
+
+/* header buffers are rounded up so the free list links stay aligned */
+#define HEADER_STRIDE() ((config_opts.header_buffer + 15) & ~(size_t)15)
+
+/**
+ * Make sure the connection has a header buffer, taking one from its
+ * thread's pool. The pool grows by HEADER_SLAB buffers when it runs dry
+ * and never shrinks, so it tops out at the most headers ever read at once.
+ * @returns -1 if the memory can't be had.
+ */
+static int hold_header_buffer(struct connection *conn)
+{
+    struct dispatcher *d = conn->dispatcher;
+    char *buf;
+    if (conn->buf)
+        return 0;
+    if (d->free_headers == NULL) {
+        size_t stride = HEADER_STRIDE();
+        char *slab = malloc(stride * HEADER_SLAB);
+        int i;
+        if (slab == NULL)
+            return -1;
+        for (i = 0; i < HEADER_SLAB; i++)
+            *(char **)(slab + i * stride)
+                = i + 1 < HEADER_SLAB ? slab + (i + 1) * stride : NULL;
+        d->free_headers = slab;
+        d->n_header_buffers += HEADER_SLAB;
+    }
+    buf = d->free_headers;
+    d->free_headers = *(char **)buf;
+    if (++d->headers_in_use > d->headers_peak)
+        d->headers_peak = d->headers_in_use;
+    conn->buf = buf;
+    return 0;
+}
+
+/**
+ * Give the connection's header buffer back to the pool, if it has one.
+ * Nothing may point into it any more: the parsed response keeps only
+ * what it needs past the header.
+ */
+static void release_header_buffer(struct connection *conn)
+{
+    struct dispatcher *d = conn->dispatcher;
+    if (conn->buf == NULL)
+        return;
+    /* last in, first out, so the next one taken is still in the cache */
+    *(char **)conn->buf = d->free_headers;
+    d->free_headers = conn->buf;
+    d->headers_in_use--;
+    conn->buf = NULL;
+}
+
+/**
+ * Clear everything about the current request, but leave the socket and
+ * its event alone so the connection can carry another request.
+ */
+static void reset_request(struct connection *conn)
+{
+    conn->error = 0;
+    conn->written = 0;
+    conn->nbytes = 0;
+    conn->responselen = 0;
+    conn->reuse = 0;
+    conn->batch = 0;
+    conn->current = 0;
+    conn->leftover = NULL;
+    conn->leftoverlen = 0;
+    conn->n_iov = 0;
+    conn->iov_pos = 0;
+    conn->sending = 0;
+    conn->body_sent = 0;
+    memset(&conn->resp, 0, sizeof(conn->resp));
+    memset(conn->metrics, 0, sizeof(*conn->metrics) * config_opts.pipeline);
+}
+
+/**
+ * Clear the whole connection back to ST_IDLE, keeping only the thread
+ * it belongs to and its slot in the metrics array.
+ */
+static void reset_connection(struct connection *conn)
+{
+    struct dispatcher *dispatcher = conn->dispatcher;
+    struct metrics *metrics = conn->metrics;
+    struct iovec *iov = conn->iov;
+    char *scratch = conn->scratch;
+    stop_timeouts(conn);
+    release_header_buffer(conn);
+    memset(conn, 0, sizeof(*conn)); // clear the memory
+    conn->dispatcher = dispatcher;
+    conn->metrics = metrics;
+    conn->iov = iov;
+    conn->scratch = scratch;
+    init_timeouts(conn);
+    memset(conn->metrics, 0, sizeof(*conn->metrics) * config_opts.pipeline);
+}
+
+/**
+ * Claim up to config_opts.pipeline requests from the -n budget that is
+ * shared by all dispatcher threads. A request counts against the budget
+ * once it has been attempted.
+ * @returns the number claimed, 0 once the budget is spent.
+ */
+static int claim_requests()
+{
+    int claimed, want;
+    if (stop_dispatching)
+        return 0;
+    do {
+        claimed = n_dispatched;
+        if (claimed >= config_opts.count)
+            return 0;
+        want = config_opts.pipeline;
+        if (want > config_opts.count - claimed)
+            want = config_opts.count - claimed;
+    } while (!__sync_bool_compare_and_swap(&n_dispatched, claimed,
+                                           claimed + want));
+    return want;
+}
+
+/**
+ * Give back requests that were claimed but never attempted.
+ */
+static void unclaim_requests(int n)
+{
+    (void)__sync_fetch_and_sub(&n_dispatched, n);
+}
+
+/**
+ * Count the rest of a pipelined batch against its location, all of
+ * the requests in a batch go to the same one.
+ */
+static void account_batch(struct connection *conn)
+{
+    int i;
+    for (i = 1; i < conn->batch; i++)
+        location_reuse(conn->location);
+}
+
+/**
+ * Print the --interval report line and start the next interval.
+ * Must be called with interval_lock held.
+ */
+static void print_interval()
+{
+    char bytes[BUFSIZ], p50[BUFSIZ], p90[BUFSIZ], p99[BUFSIZ], max[BUFSIZ];
+    uint64_t now = clock_ns();
+    double secs = (now - interval_start) / 1000000000.0;
+    struct histogram *h = &interval_acc.hist[PHASE(ME_READ)];
+
+    if (secs <= 0.0)
+        secs = config_opts.interval;
+    if (config_opts.output == OUTPUT_JSON) {
+        struct report r;
+        report_open(&r, stderr, OUTPUT_JSON);
+        report_begin(&r, "interval");
+        report_uint(&r, "elapsed_ns", now - run_start);
+        report_uint(&r, "duration_ns", now - interval_start);
+        report_int(&r, "requests", interval_acc.total_measurements);
+        report_int(&r, "errors", interval_errors);
+        report_int(&r, "concurrency", n_concurrent);
+        report_uint(&r, "bytes", interval_bytes);
+        report_begin(&r, "read");
+        report_uint(&r, "p50_ns", histogram_percentile(h, 50.0));
+        report_uint(&r, "p90_ns", histogram_percentile(h, 90.0));
+        report_uint(&r, "p99_ns", histogram_percentile(h, 99.0));
+        report_uint(&r, "max_ns", h->max);
+        report_end(&r);
+        report_end(&r);
+        report_close(&r);
+    } else if (config_opts.output == OUTPUT_CSV) {
+        /* one row per interval, rather than a metric,value report each */
+        if (interval_start == run_start)
+            fprintf(stderr, "elapsed_ns,duration_ns,requests,errors,"
+                    "concurrency,bytes,read_p50_ns,read_p90_ns,"
+                    "read_p99_ns,read_max_ns\n");
+        fprintf(stderr, "%llu,%llu,%d,%d,%d,%llu,%llu,%llu,%llu,%llu\n",
+                (unsigned long long)(now - run_start),
+                (unsigned long long)(now - interval_start),
+                interval_acc.total_measurements, interval_errors,
+                n_concurrent, interval_bytes,
+                (unsigned long long)histogram_percentile(h, 50.0),
+                (unsigned long long)histogram_percentile(h, 90.0),
+                (unsigned long long)histogram_percentile(h, 99.0),
+                (unsigned long long)h->max);
+    } else {
+        (void)format_double_bytes(bytes, sizeof(bytes), interval_bytes / secs);
+        (void)format_ns(p50, sizeof(p50), histogram_percentile(h, 50.0));
+        (void)format_ns(p90, sizeof(p90), histogram_percentile(h, 90.0));
+        (void)format_ns(p99, sizeof(p99), histogram_percentile(h, 99.0));
+        (void)format_ns(max, sizeof(max), h->max);
+        fprintf(stderr, "[%7.1lfs] %9.1lf req/s %7.1lf err/s %5d conc %s/s"
+                "  read p50 %s p90 %s p99 %s max %s\n",
+                (now - run_start) / 1000000000.0,
+                interval_acc.total_measurements / secs, interval_errors / secs,
+                n_concurrent, bytes, p50, p90, p99, max);
+    }
+
+    (void)reset_accumulator(&interval_acc);
+    interval_bytes = 0;
+    interval_errors = 0;
+    interval_added = 0;
+    interval_start = now;
+}
+
+/**
+ * Hand what this thread did since last time to the --interval report.
+ * Must be called with interval_lock held.
+ */
+static void add_interval(struct dispatcher *d)
+{
+    merge_accumulator(&interval_acc, &d->interval);
+    interval_bytes += d->interval_bytes;
+    interval_errors += d->interval_errors;
+    (void)reset_accumulator(&d->interval);
+    d->interval_bytes = 0;
+    d->interval_errors = 0;
+}
+
+static void interval_tick(int fd, short event, void *_d)
+    /* input fd and event are ignored */
+{
+    struct dispatcher *d = (struct dispatcher *)_d;
+    pthread_mutex_lock(&interval_lock);
+    add_interval(d);
+    if (++interval_added >= interval_threads)
+        print_interval();
+    pthread_mutex_unlock(&interval_lock);
+}
+
+/**
+ * This thread is done, so the others shouldn't wait for it any more.
+ */
+static void interval_finished(struct dispatcher *d)
+{
+    pthread_mutex_lock(&interval_lock);
+    add_interval(d);
+    if (--interval_threads > 0 && interval_added >= interval_threads)
+        print_interval();
+    pthread_mutex_unlock(&interval_lock);
+}
+
+/**
+ * Another thread is taking a SIGUSR1 snapshot, wait until it's done.
+ */
+static void snapshot_pause(int fd, short event, void *_d)
+    /* input event is ignored */
+{
+    char buf[16];
+    int generation;
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ; /* one wakeup is as good as several */
+    pthread_mutex_lock(&interval_lock);
+    generation = snapshot_generation;
+    snapshot_paused++;
+    pthread_cond_broadcast(&snapshot_cond);
+    while (generation == snapshot_generation)
+        pthread_cond_wait(&snapshot_cond, &interval_lock);
+    pthread_mutex_unlock(&interval_lock);
+}
+
+/**
+ * SIGUSR1 prints the results so far, and the test carries on.
+ */
+static void dump_snapshot(int sig, short event, void *arg)
+    /* input sig, event and arg are ignored */
+{
+    int i;
+    pthread_mutex_lock(&interval_lock);
+    for (i = 1; i < config_opts.threads; i++)
+        if (write(dispatchers[i].snapshot_pipe[1], "", 1) < 0
+            && errno != EAGAIN)
+            perror("write to snapshot pipe");
+    /* the ones that have finished don't change anything any more */
+    while (snapshot_paused < live_threads - 1)
+        pthread_cond_wait(&snapshot_cond, &interval_lock);
+
+    if (config_opts.output != OUTPUT_TEXT) {
+        report_results(stdout, 0);
+    } else {
+        printf("--- SNAPSHOT at %.1lfs:\n", (clock_ns() - run_start) / 1e9);
+        balancer_snapshot(stdout);
+        dispatcher_snapshot(stdout);
+        printf("\n");
+    }
+    fflush(stdout);
+
+    snapshot_paused = 0;
+    snapshot_generation++;
+    pthread_cond_broadcast(&snapshot_cond);
+    pthread_mutex_unlock(&interval_lock);
+}
+
+/**
+ * Called once for each connection when it runs out of requests to make.
+ * After the last one, nothing must be left in the event loop, or it
+ * won't return.
+ */
+static void slot_finished(struct connection *conn)
+{
+    struct dispatcher *d = conn->dispatcher;
+    if (++d->n_finished < d->n_slots)
+        return;
+    if (config_opts.duration > 0.0)
+        (void)evtimer_del(&d->deadline_ev);
+    if (config_opts.warmup > 0.0)
+        (void)evtimer_del(&d->warmup_ev);
+    if (config_opts.rate > 0.0)
+        (void)evtimer_del(&d->rate_ev);
+    if (TIMEOUTS_ENABLED())
+        (void)evtimer_del(&d->wheel_ev);
+    if (config_opts.interval > 0.0) {
+        (void)evtimer_del(&d->interval_ev);
+        interval_finished(d);
+    }
+    if (d->num == 0) {
+        /* nobody is left to answer it */
+        (void)event_del(&d->usr1_ev);
+        signal(SIGUSR1, SIG_IGN);
+    } else {
+        (void)event_del(&d->snapshot_ev);
+    }
+    /* a snapshot in progress mustn't wait for this thread any more */
+    pthread_mutex_lock(&interval_lock);
+    live_threads--;
+    pthread_cond_broadcast(&snapshot_cond);
+    pthread_mutex_unlock(&interval_lock);
+}
+
+/**
+ * Move the schedule on to the next arrival: evenly spaced, or with
+ * exponentially distributed gaps for --poisson.
+ */
+static void advance_schedule(struct dispatcher *d)
+{
+    double interval = 1000000000.0 / d->rate;
+    if (config_opts.poisson)
+        interval *= -log(1.0 - erand48(d->rand48));
+    d->rate_offset += interval;
+    /* computed from the start each time, so rounding doesn't add up */
+    d->next_arrival = d->rate_start + (uint64_t)d->rate_offset;
+}
+
+/**
+ * Called right after a scheduled request took its ME_EPOCH measurement.
+ * Record how far behind schedule it is and measure it from when it
+ * should have started instead.
+ */
+static void apply_schedule(struct connection *conn)
+{
+    struct dispatcher *d = conn->dispatcher;
+    double lag;
+    if (!conn->scheduled)
+        return;
+    conn->scheduled = 0;
+    lag = conn->metrics->epoch > conn->intended
+          ? (double)(conn->metrics->epoch - conn->intended) : 0.0;
+    d->n_scheduled++;
+    d->lag_total += lag;
+    if (lag > d->lag_max)
+        d->lag_max = lag;
+    conn->metrics->epoch = conn->intended;
+}
+
+/**
+ * Let go of a connection that is waiting for an arrival that will never
+ * come, closing it if it was kept alive.
+ */
+static void finish_waiting(struct connection *conn)
+{
+    if (conn->reuse) {
+        close_socket(conn);
+        (void)__sync_fetch_and_sub(&n_concurrent, conn->connected);
+    }
+    reset_connection(conn);
+    slot_finished(conn);
+}
+
+static void process_reuse(struct connection *conn);
+static void rate_wait(struct connection *conn);
+
+/**
+ * In open-loop mode (--rate) requests are started on a fixed timeline
+ * rather than as soon as a connection is free. Free connections wait on
+ * the dispatcher until the next arrival is due. If arrivals fall due
+ * while none are free, they are started as soon as one is, and still
+ * measured from when they were due.
+ */
+static void rate_schedule(int fd, short event, void *_d)
+    /* input fd and event are ignored */
+{
+    struct dispatcher *d = (struct dispatcher *)_d;
+    struct timeval delay;
+    uint64_t now = clock_ns();
+
+    d->scheduling = 1;
+    while (d->n_waiting > 0 && d->next_arrival <= now
+           && !DISPATCH_DONE()) {
+        struct connection *conn = d->waiting[--d->n_waiting];
+        conn->intended = d->next_arrival;
+        conn->scheduled = 1;
+        advance_schedule(d);
+        if (conn->reuse)
+            process_reuse(conn);
+        else
+            process_idle(-1, 0, conn);
+    }
+    d->scheduling = 0;
+
+    if (DISPATCH_DONE()) {
+        while (d->n_waiting > 0)
+            finish_waiting(d->waiting[--d->n_waiting]);
+    } else if (d->n_waiting > 0) {
+        NS_TO_TIMEVAL(d->next_arrival - now, &delay);
+        if (evtimer_add(&d->rate_ev, &delay) < 0) {
+            perror("evtimer_add");
+            exit(-5);
+        }
+    }
+}
+
+/**
+ * Park a free connection (kept alive or not) until the next arrival.
+ */
+static void rate_wait(struct connection *conn)
+{
+    struct dispatcher *d = conn->dispatcher;
+    if (DISPATCH_DONE()) {
+        finish_waiting(conn);
+        return;
+    }
+    d->waiting[d->n_waiting++] = conn;
+    if (!d->scheduling)
+        rate_schedule(-1, 0, d);
+}
+
+/**
+ * Add the current request to the --trace file, error is 0 if it
+ * succeeded.
+ */
+static void trace_current(struct connection *conn, int error)
+{
+    struct metrics *m = CURRENT_METRICS(conn);
+    struct trace_record *rec = trace_append(&conn->dispatcher->trace);
+    if (rec == NULL)
+        return;
+    rec->epoch = m->epoch;
+    rec->connect = m->connect;
+    rec->write = m->write;
+    rec->first = m->first;
+    rec->read = m->read;
+    rec->close = m->close;
+    rec->responselen = conn->responselen;
+    rec->location = conn->location->index;
+    rec->error = error;
+    rec->resp_code = conn->resp.resp_code;
+    rec->reused = m->reused;
+    rec->pad = 0;
+    rec->thread = conn->dispatcher->num;
+}
+
+/**
+ * Count a failed request against its location and address, and trace it
+ * with the given error.
+ */
+static void count_failed(struct connection *conn, int error)
+{
+    location_error(conn->location, conn->address);
+    conn->dispatcher->interval_errors++;
+    if (config_opts.trace)
+        trace_current(conn, error);
+}
+
+/**
+ * The connection is being given up on, so the rest of its pipelined batch
+ * (already claimed from -n) fails along with the current request. Each
+ * is counted by count(), which knows what went wrong.
+ * @returns how many there were.
+ */
+static int fail_outstanding(struct connection *conn,
+                            void (*count)(struct connection *conn, int error),
+                            int error)
+{
+    int current = conn->current, n = 0;
+    for (conn->current++; conn->current < conn->batch; conn->current++, n++) {
+        /* they never got as far as sharing the first one's timings */
+        if (CURRENT_METRICS(conn)->epoch == 0) {
+            *CURRENT_METRICS(conn) = conn->metrics[0];
+            CURRENT_METRICS(conn)->reused = 1;
+        }
+        count(conn, error);
+    }
+    conn->current = current;
+    return n;
+}
+
+static void count_http_error(struct connection *conn, int error)
+{
+    count_failed(conn, error);
+    conn->location->n_http_errors++;
+    conn->dispatcher->n_http_errors++;
+}
+
+static void count_socket_error(struct connection *conn, int error)
+{
+    count_failed(conn, error);
+    conn->location->n_socket_errors++;
+    conn->dispatcher->n_socket_errors++;
+}
 
 void process_error(struct connection *conn)
 {
-    conn->location->n_errors++;
+    int outstanding;
     if (conn->error == -1) {
+        /* only a response we couldn't carry on past, see process_read() */
+        count_http_error(conn, TRACE_HTTP_ERROR);
+        outstanding = fail_outstanding(conn, count_socket_error, EPIPE);
         fprintf(stderr, "HTTP error code %d (%s) connecting to %s\n",
-                conn->resp_code, conn->resp_str,
+                conn->resp.resp_code, conn->resp.resp_str,
                 conn->location->uri->hostname);
     } else {
+        count_socket_error(conn, conn->error);
+        if (!conn->connected && (conn->error == ECONNREFUSED
+                                 || conn->error == ENETUNREACH
+                                 || conn->error == EHOSTUNREACH))
+            conn->location->n_refused++; /* noticed after the connect() */
+        outstanding = fail_outstanding(conn, count_socket_error,
+                                       conn->error);
         fprintf(stderr, "socket failure %d (%s) connecting to %s\n",
                 conn->error, strerror(conn->error),
                 conn->location->uri->hostname);
     }
+    if (outstanding > 0 && config_opts.verbose > 0)
+        fprintf(stderr, "%d pipelined requests on fd %d failed with it\n",
+                outstanding, conn->socket);
+    close_socket(conn);
+    conn->reuse = 0;
     conn->state = ST_CLEANUP;
     process_state(conn);
 }
 
+/**
+ * One of the timeouts went off, give up on the request (and the rest
+ * of its pipelined batch) and its connection.
+ */
+static void count_timeout(struct connection *conn, int error)
+{
+    struct dispatcher *d = conn->dispatcher;
+    count_failed(conn, error);
+    switch (error) {
+        case TRACE_FIRST_BYTE_TIMEOUT:
+            conn->location->n_first_byte_timeouts++;
+            d->n_first_byte_timeouts++;
+            break;
+        case TRACE_REQUEST_TIMEOUT:
+            conn->location->n_request_timeouts++;
+            d->n_request_timeouts++;
+            break;
+        case TRACE_CONNECT_TIMEOUT:
+        default:
+            conn->location->n_connect_timeouts++;
+            d->n_connect_timeouts++;
+            break;
+    };
+}
+
+static void process_timeout(struct connection *conn)
+{
+    const char *what;
+    int error, outstanding;
+    switch (conn->timed_out) {
+        case TIMEOUT_FIRST_BYTE:
+            what = "first byte";
+            error = TRACE_FIRST_BYTE_TIMEOUT;
+            break;
+        case TIMEOUT_TOTAL:
+            what = "request";
+            error = TRACE_REQUEST_TIMEOUT;
+            break;
+        case TIMEOUT_CONNECT:
+        default:
+            what = "connect";
+            error = TRACE_CONNECT_TIMEOUT;
+            break;
+    };
+    count_timeout(conn, error);
+    outstanding = fail_outstanding(conn, count_timeout, error);
+    if (config_opts.verbose > 0)
+        fprintf(stderr, "%s timeout on fd %d fetching %s (%d pipelined "
+                "requests with it)\n", what, conn->socket,
+                conn->location->uristr, outstanding);
+    stop_timeouts(conn);
+    close_socket(conn);
+    conn->reuse = 0;
+    conn->state = ST_CLEANUP;
+    process_state(conn);
+}
+
+/**
+ * Send the next request down a kept-alive connection. If the balancer
+ * picks a location at a different address, or we're done dispatching,
+ * the connection is closed instead.
+ */
+static void process_reuse(struct connection *conn)
+{
+    struct location *prev = conn->location;
+    int rv, batch;
+
+    if (config_opts.rate > 0.0 && !conn->scheduled) {
+        rate_wait(conn); /* with the socket still open */
+        return;
+    }
+
+    location_release(prev);
+    batch = claim_requests();
+    if (batch > 0) {
+        reset_request(conn);
+        conn->batch = batch;
+        conn->location = get_next_location(conn->dispatcher->balancer);
+    } else {
+        conn->location = NULL;
+    }
+
+    if (conn->location == NULL
+        || !location_reachable(conn->location, prev, conn->address)) {
+        /* prev was already released, so close the socket ourselves */
+        disarm_event(conn);
+        if (close(conn->socket) < 0 && config_opts.verbose > 0)
+            fprintf(stderr, "error closing fd %d: %s\n",
+                    conn->socket, strerror(errno));
+        (void)__sync_fetch_and_sub(&n_concurrent, conn->connected);
+        if (conn->location == NULL) {
+            reset_connection(conn);
+            process_state(conn); // idle, and done dispatching
+        } else {
+            conn->sockopen = 0;
+            conn->connected = 0;
+            start_connect(conn);
+        }
+        return;
+    }
+
+    location_reuse(conn->location);
+    rv = measure(ME_EPOCH, conn->metrics);
+    if (rv < 0) {
+        perror("measure failed");
+        exit(-4);
+    }
+    apply_schedule(conn);
+    start_total_timeout(conn);
+    /* no connect happened, so that phase takes no time */
+    conn->metrics->connect = conn->metrics->epoch;
+    conn->metrics->reused = 1;
+    account_batch(conn);
+    conn->state = ST_WRITING;
+    process_state(conn);
+}
+
 void process_cleanup(struct connection *conn)
 {
-    total_bytes_received += conn->responselen;
-    n_concurrent -= conn->connected; // only reduce concurrency if we were
-                                     // connected in the first place
-    memset(conn, 0, sizeof(*conn)); // clear the memory
+    stop_timeouts(conn);
+    release_header_buffer(conn);
+    conn->dispatcher->total_bytes_received += conn->responselen;
+    conn->dispatcher->interval_bytes += conn->responselen;
+    if (conn->reuse) {
+        process_reuse(conn);
+        return;
+    }
+    disarm_event(conn);
+    // only reduce concurrency if we were connected in the first place
+    (void)__sync_fetch_and_sub(&n_concurrent, conn->connected);
+    reset_connection(conn);
     process_state(conn); // process the new idle state
 }
 
-void process_calculating(struct connection *conn)
+static void accumulate_current(struct connection *conn)
 {
-    /* add metrics from this run to this location's total */
-    accumulate_metrics(&conn->location->accumulator, &conn->metrics);
+    int invalid = 0;
+    if (config_opts.validate) {
+        conn->dispatcher->n_validated++;
+        if (location_validate(conn->location, &conn->resp) < 0) {
+            conn->dispatcher->n_invalid++;
+            invalid = 1;
+        }
+    }
+    if (config_opts.trace)
+        trace_current(conn, invalid ? TRACE_INVALID_BODY : 0);
+    if (config_opts.interval > 0.0)
+        accumulate_metrics(&conn->dispatcher->interval,
+                           CURRENT_METRICS(conn));
+
+    /* drop anything started during the --warmup period */
+    if (config_opts.warmup > 0.0
+        && CURRENT_METRICS(conn)->epoch < warmup_end)
+        return;
+
+    /* add metrics from this run to this location's and address's totals */
+    location_accumulate(conn->location, conn->address, CURRENT_METRICS(conn));
 
     /* add metrics from this run to global total */
-    accumulate_metrics(&global_accumulator, &conn->metrics);
+    accumulate_metrics(&conn->dispatcher->accumulator, CURRENT_METRICS(conn));
 
     if (config_opts.verbose > 1)
-        print_metrics(stdout, &conn->metrics);
+        print_metrics(stdout, CURRENT_METRICS(conn));
+}
+
+void process_calculating(struct connection *conn)
+{
+    accumulate_current(conn);
 
     conn->state = ST_CLEANUP;
     process_state(conn);
@@ -113,7 +1078,7 @@ void process_calculating(struct connection *conn)
 
 void process_closed(struct connection *conn)
 {
-    int rv = measure(ME_CLOSE, &conn->metrics);
+    int rv = measure(ME_CLOSE, CURRENT_METRICS(conn));
     int e = errno;
     if (rv < 0) {
         conn->error = e;
@@ -126,7 +1091,10 @@ void process_closed(struct connection *conn)
 
 void process_closing(struct connection *conn)
 {
-    int rc = location_close(conn->location, conn->socket);
+    int rc;
+    disarm_event(conn);
+    rc = location_close(conn->location, conn->socket);
+    conn->sockopen = 0;
     if (rc < 0) {
         conn->error = errno;
         conn->state = ST_ERROR;
@@ -139,33 +1107,201 @@ void process_closing(struct connection *conn)
     process_state(conn);
 }
 
+static int parse_buffered_header(struct connection *conn);
+
+/**
+ * Move on to the next response of a pipelined batch, accumulating the
+ * previous one unless it was already counted as an error. Whatever was
+ * read past the end of the previous response is the start of this one.
+ */
+static void process_next_response(struct connection *conn, int accumulate)
+{
+    struct metrics *prev = CURRENT_METRICS(conn);
+
+    /* nothing is closed between pipelined responses */
+    prev->close = prev->read;
+    if (accumulate)
+        accumulate_current(conn);
+
+    conn->current++;
+    memset(&conn->resp, 0, sizeof(conn->resp));
+    conn->nbytes = 0;
+    conn->state = ST_READING_HEADER;
+    if (conn->leftoverlen > 0) {
+        /* never more than fits, see process_reading_body() */
+        if (hold_header_buffer(conn) < 0) {
+            conn->error = ENOMEM;
+            conn->state = ST_ERROR;
+            return;
+        }
+        memmove(conn->buf, conn->leftover, conn->leftoverlen);
+        conn->nbytes = conn->leftoverlen;
+        conn->buf[conn->nbytes] = '\0';
+    }
+    conn->leftover = NULL;
+    conn->leftoverlen = 0;
+
+    if (conn->nbytes > 0) {
+        /* the first bytes arrived along with the end of the last one */
+        CURRENT_METRICS(conn)->first = prev->read;
+        if (parse_buffered_header(conn) == 0
+            && conn->nbytes == config_opts.header_buffer - 1) {
+            conn->error = ENOMEM;
+            conn->state = ST_ERROR;
+        }
+    }
+}
+
 void process_read(struct connection *conn)
 {
-    int rv = measure(ME_READ, &conn->metrics);
+    int rv = measure(ME_READ, CURRENT_METRICS(conn));
     int e = errno;
     if (rv < 0) {
         conn->error = e;
         conn->state = ST_ERROR;
-    } else if (conn->resp_code >= 400 && conn->resp_code <= 599) {
-        /* Check the response code, if it was 4xx or 5xx then error out */
+    } else if (conn->resp.resp_code >= 400 && conn->resp.resp_code <= 599
+               && (!config_opts.keepalive || conn->resp.close)) {
+        /* a 4xx or 5xx on a connection that is going away anyway */
         conn->error = -1;
         conn->state = ST_ERROR;
+    } else if (conn->resp.resp_code >= 400 && conn->resp.resp_code <= 599) {
+        /* the response was complete, so count it as an error and carry on
+         * with the rest of the batch (or the next one) */
+        count_http_error(conn, TRACE_HTTP_ERROR);
+        fprintf(stderr, "HTTP error code %d (%s) connecting to %s\n",
+                conn->resp.resp_code, conn->resp.resp_str,
+                conn->location->uri->hostname);
+        if (conn->current + 1 < conn->batch) {
+            process_next_response(conn, 0);
+        } else {
+            conn->reuse = 1;
+            conn->state = ST_CLEANUP;
+        }
+    } else if (conn->current + 1 < conn->batch) {
+        if (conn->resp.close) {
+            if (config_opts.verbose > 0)
+                fprintf(stderr, "fd %d closed with %d pipelined responses "
+                        "outstanding\n", conn->socket,
+                        conn->batch - conn->current - 1);
+            conn->error = EPIPE;
+            conn->state = ST_ERROR;
+        } else {
+            process_next_response(conn, 1);
+        }
     } else {
-        conn->state = ST_CLOSING;
+        conn->reuse = config_opts.keepalive && !conn->resp.close;
+        /* a kept-alive connection has nothing to close, skip ahead */
+        conn->state = conn->reuse ? ST_CLOSED : ST_CLOSING;
     }
 
     process_state(conn);
 }
 
-static char body_buf[BODY_BUFSIZ];
+/**
+ * Run body bytes through the response framing. In keep-alive mode the
+ * response is read once its framing says so, otherwise we always read
+ * until the server closes.
+ */
+static int process_body_bytes(struct connection *conn, const char *p,
+                              size_t len)
+{
+    ssize_t used = consume_body(&conn->resp, p, len);
+    if (used < 0) {
+        if (config_opts.verbose > 0)
+            fprintf(stderr, "fd %d sent a malformed chunked body\n",
+                    conn->socket);
+        conn->error = EINVAL;
+        conn->state = ST_ERROR;
+        return -1;
+    }
+    if (config_opts.keepalive && response_done(&conn->resp)) {
+        if (conn->current + 1 < conn->batch) {
+            /* the start of the next pipelined response, if any */
+            conn->leftover = p + used;
+            conn->leftoverlen = len - used;
+        } else if ((size_t)used < len) {
+            /* anything past the last response is unexpected, don't reuse */
+            conn->resp.close = 1;
+        }
+        conn->state = ST_READ;
+    }
+    return 0;
+}
+
+/**
+ * Throw away up to len bytes waiting on the socket without copying them
+ * into userspace, for --discard.
+ * @returns like read().
+ */
+static ssize_t discard_bytes(struct connection *conn, int fd, size_t len)
+{
+#ifdef HAVE_SPLICE
+    if (config_opts.discard == DISCARD_SPLICE) {
+        int *p = conn->dispatcher->discard_pipe;
+        ssize_t count, left, rv;
+        count = splice(fd, NULL, p[1], NULL, len,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        /* the pipe is always left empty, so the next call has room */
+        for (left = count; left > 0; left -= rv) {
+            rv = splice(p[0], NULL, devnull, NULL, left, SPLICE_F_MOVE);
+            if (rv < 0) {
+                if (errno == EINTR) {
+                    rv = 0;
+                    continue;
+                }
+                return -1;
+            }
+        }
+        return count;
+    }
+#endif
+    return recv(fd, NULL, len, MSG_TRUNC);
+}
+
+/**
+ * Body bytes were thrown away by discard_bytes(), see if that was the
+ * end of the response.
+ */
+static void process_discarded_bytes(struct connection *conn, size_t len)
+{
+    skip_body(&conn->resp, len);
+    if (config_opts.keepalive && response_done(&conn->resp)) {
+        /* we never discard past the end, so nothing is left over */
+        conn->leftover = NULL;
+        conn->leftoverlen = 0;
+        conn->state = ST_READ;
+    }
+}
+
 void process_reading_body(int fd, short event, void *_conn)
 {
     struct connection *conn = (struct connection *)_conn;
+    char *body_buf = conn->dispatcher->body_buf;
     ssize_t count;
+    size_t want, skip;
     int e;
 
 retry:
-    count = read(fd, body_buf, sizeof(body_buf));
+    /* When we might reuse the connection, never read past the body when
+     * we know where it ends. Otherwise make sure anything we read past it
+     * still fits in the header buffer for the next pipelined response. */
+    want = config_opts.read_buffer;
+    if (config_opts.keepalive) {
+        if (conn->resp.bstate == BODY_LENGTH
+            || conn->resp.bstate == BODY_CHUNK_DATA) {
+            if (conn->resp.remaining < want)
+                want = conn->resp.remaining;
+        } else if (conn->resp.bstate != BODY_EOF) {
+            want = config_opts.header_buffer - 1;
+        }
+    }
+    /* if the framing doesn't need to see the bytes, don't copy them */
+    skip = config_opts.discard != DISCARD_READ
+           ? body_skippable(&conn->resp, DISCARD_MAX) : 0;
+    if (skip > 0)
+        count = discard_bytes(conn, fd, skip);
+    else
+        count = read(fd, body_buf, want);
     e = errno;
     if (count < 0) {
         if (e == EINTR) {
@@ -186,6 +1322,14 @@ retry:
             goto out;
         }
     } else if (count == 0) { // EOF
+        if (config_opts.keepalive && conn->resp.bstate != BODY_EOF) {
+            if (config_opts.verbose > 0)
+                fprintf(stderr, "premature EOF on fd %d\n", fd);
+            conn->error = EPIPE;
+            conn->state = ST_ERROR;
+            goto out;
+        }
+        conn->resp.close = 1;
         conn->state = ST_READ;
         if (config_opts.verbose > 4)
             fprintf(stderr, "fd %d done reading body, received %ld bytes total\n", fd, conn->responselen);
@@ -193,6 +1337,12 @@ retry:
         conn->responselen += count;
         if (config_opts.verbose > 5)
             fprintf(stderr, "fd %d read %ld body bytes...\n", fd, count);
+        if (skip > 0)
+            process_discarded_bytes(conn, count);
+        else if (process_body_bytes(conn, body_buf, count) < 0)
+            goto out;
+        if (conn->state == ST_READ)
+            goto out;
         goto retry;
     }
 
@@ -200,16 +1350,74 @@ out:
     process_state(conn);
 }
 
+/**
+ * Look for a complete response header in what we've read so far.
+ * @returns 1 if the state has moved on, 0 if more needs to be read.
+ */
+static int parse_buffered_header(struct connection *conn)
+{
+    ssize_t hlen;
+    conn->resp.head = head_requests;
+    hlen = parse_response_header(&conn->resp, conn->buf, conn->nbytes);
+    if (hlen < 0) {
+        if (config_opts.verbose > 1)
+            fprintf(stderr, "error parsing response header from fd %d\n",
+                    conn->socket);
+        conn->state = ST_ERROR;
+        conn->error = EINVAL;
+        return 1;
+    } else if (hlen == 0) {
+        return 0;
+    }
+    conn->resp.validate = config_opts.validate;
+    if (config_opts.n_record_headers > 0)
+        location_record_headers(conn->location, &conn->resp);
+    if (config_opts.verbose > 5)
+        fprintf(stderr, "fd %d returned response code %u and string %s\n",
+                conn->socket, conn->resp.resp_code, conn->resp.resp_str);
+    conn->state = ST_READING_BODY;
+    /* whatever followed the header is the start of the body */
+    (void)process_body_bytes(conn, conn->buf + hlen, conn->nbytes - hlen);
+    /* unless the next pipelined response starts in it, we're done with it */
+    if (conn->state != ST_READ)
+        release_header_buffer(conn);
+    return 1;
+}
+
+/**
+ * Count the connection if the server took the request sent in its SYN,
+ * once the response has started.
+ */
+static void count_fastopen(struct connection *conn, int fd)
+{
+#ifdef TCPI_OPT_SYN_DATA
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0
+        && (info.tcpi_options & TCPI_OPT_SYN_DATA))
+        conn->dispatcher->n_fastopen++;
+#endif
+    conn->fastopen = 0;
+}
+
 void process_reading_header(int fd, short event, void *_conn)
 {
     struct connection *conn = (struct connection *)_conn;
     ssize_t count;
     int e;
 
+    if (hold_header_buffer(conn) < 0) {
+        if (config_opts.verbose > 0)
+            fprintf(stderr, "out of memory for the header of fd %d\n", fd);
+        conn->error = ENOMEM;
+        conn->state = ST_ERROR;
+        goto out;
+    }
+
 retry:
     errno = 0;
     count = read(fd, conn->buf + conn->nbytes,
-                     sizeof(conn->buf) - conn->nbytes - 1);
+                     config_opts.header_buffer - conn->nbytes - 1);
                      // leave space for the \0
 
     e = errno;
@@ -217,7 +1425,7 @@ retry:
     if (config_opts.verbose > 5)
             fprintf(stderr, "fd %d attempted to read %ld bytes, got "
                     "%ld bytes (errno %d: %s)\n",
-                    fd, sizeof(conn->buf) - conn->nbytes - 1,
+                    fd, config_opts.header_buffer - conn->nbytes - 1,
                     count, e, strerror(e));
 
     if (count < 0) {
@@ -239,30 +1447,39 @@ retry:
             goto out;
         }
     } else if (count == 0) { // EOF
-        // error, because we didn't find the \r\n on a previous call
+        // error, because we didn't find the end of the header previously
         if (config_opts.verbose > 0)
             fprintf(stderr, "premature EOF on fd %d\n", fd);
         conn->error = EPIPE;
         conn->state = ST_ERROR;
         goto out;
     } else { // successful read, not sure if we have everything yet
-        char *end;
-
-        if (conn->nbytes == 0) { /* first read on this connection */
-            int rv = measure(ME_FIRST, &conn->metrics);
+        if (conn->nbytes == 0) { /* first read for this response */
+            int rv = measure(ME_FIRST, CURRENT_METRICS(conn));
             int e = errno;
+            stop_phase_timeout(conn);
             if (rv < 0) {
                 conn->error = e;
                 conn->state = ST_ERROR;
                 goto out;
             }
+            if (conn->fastopen)
+                count_fastopen(conn, fd);
         }
+#ifdef TCP_QUICKACK
+        /* the kernel drops out of quickack mode by itself, so keep
+         * putting it back */
+        if (config_opts.quickack) {
+            int on = 1;
+            (void)setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+        }
+#endif
 
-        end = strstr(conn->buf + conn->nbytes, "\r\n");
         conn->responselen += count;
         conn->nbytes += count;
-        if (end == NULL) { // not found
-            if (conn->nbytes - 1 == sizeof(conn->buf)) { // overflow
+        conn->buf[conn->nbytes] = '\0';
+        if (parse_buffered_header(conn) == 0) {
+            if (conn->nbytes == config_opts.header_buffer - 1) { // overflow
                 if (config_opts.verbose > 0)
                     fprintf(stderr, "fd %d header too long\n", fd);
                 conn->error = ENOMEM;
@@ -273,23 +1490,6 @@ retry:
                     fprintf(stderr, "fd %d received %ld bytes, no header found yet\n", fd, count);
                 goto retry;
             }
-        } else { // response code header found
-            int prefixlen = 0;
-            count = sscanf(conn->buf, "HTTP/%3f %u %n",
-                           &conn->http_version, &conn->resp_code, &prefixlen);
-            if (count != 2) {
-                if (config_opts.verbose > 1)
-                    fprintf(stderr, "error parsing response header from fd %d\n", fd);
-                conn->state = ST_ERROR;
-                conn->error = EINVAL;
-                goto out;
-            }
-            *end = '\0'; // set \r\n to NULL
-            conn->resp_str = conn->buf + prefixlen;
-            if (config_opts.verbose > 5)
-                fprintf(stderr, "fd %d returned response code %u and string %s\n", fd, conn->resp_code, conn->resp_str);
-            conn->state = ST_READING_BODY;
-            goto out;
         }
     }
 
@@ -297,30 +1497,187 @@ out:
     process_state(conn);
 }
 
-void process_written(struct connection *conn)
+void process_written(struct connection *conn)
+{
+    int rv = measure(ME_WRITE, conn->metrics);
+    int e = errno, i;
+    if (rv < 0) {
+        conn->error = e;
+        conn->state = ST_ERROR;
+        goto out;
+    }
+
+    /* every request in a pipelined batch shares the first one's timings
+     * up to here, but only the first one could have connected */
+    for (i = 1; i < conn->batch; i++) {
+        conn->metrics[i] = conn->metrics[0];
+        conn->metrics[i].reused = 1;
+    }
+
+/* Akami (and probably some other HTTP implementations) don't allow half-open
+ * sockets, which are HTTP sessions where from the client's perspective the
+ * socket is closed for writes immediately after sending the headers.
+ * So disable this behavior by default.
+ */
+    if (config_opts.halfopen
+        && shutdown(conn->socket, SHUT_WR) < 0) {
+        conn->error = errno;
+        conn->state = ST_ERROR;
+        fprintf(stderr, "error shutting down fd %d for writes: %s\n",
+                conn->socket, strerror(conn->error));
+    } else {
+        conn->state = ST_READING_HEADER;
+        start_phase_timeout(conn, TIMEOUT_FIRST_BYTE,
+                            config_opts.first_byte_timeout);
+    }
+
+out:
+    process_state(conn);
+}
+
+/**
+ * Point iov at the unwritten part of the current batch, which is
+ * conn->batch copies of the location's request back to back.
+ * @returns the number of iovecs used.
+ */
+static int batch_iovecs(struct connection *conn, struct iovec *iov)
+{
+    size_t rlen = conn->location->rlen;
+    int i, n = 0;
+    for (i = conn->written / rlen; i < conn->batch; i++, n++) {
+        size_t off = i == conn->written / rlen ? conn->written % rlen : 0;
+        iov[n].iov_base = (char *)conn->location->request + off;
+        iov[n].iov_len = rlen - off;
+    }
+    return n;
+}
+
+/**
+ * Fill in the --template requests of the current batch, each with its own
+ * values, for write_template() to send.
+ */
+static void fill_template(struct connection *conn)
+{
+    int i, vars = balancer_template_vars();
+    size_t len;
+    conn->request_len = 0;
+    for (i = 0; i < conn->batch; i++) {
+        conn->n_iov += location_request(conn->location,
+                                        conn->iov + conn->n_iov,
+                                        conn->scratch + i * vars
+                                        * TEMPLATE_NUMBER_LEN, &len);
+        conn->request_len += len;
+    }
+}
+
+/**
+ * Write what is left of conn->iov, stepping past the iovecs (and into the
+ * one) that the write got through. flags are for sendmsg().
+ */
+static ssize_t write_iovecs(int fd, struct connection *conn, int flags)
+{
+    struct iovec *iov = conn->iov + conn->iov_pos;
+    int n = conn->n_iov - conn->iov_pos;
+    struct msghdr msg;
+    ssize_t count;
+    size_t left;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n < IOV_MAX ? n : IOV_MAX;
+    count = sendmsg(fd, &msg, flags);
+    left = count > 0 ? count : 0;
+    while (left > 0 && left >= iov->iov_len) {
+        left -= iov->iov_len;
+        iov++;
+        conn->iov_pos++;
+    }
+    if (left > 0) {
+        iov->iov_base = (char *)iov->iov_base + left;
+        iov->iov_len -= left;
+    }
+    return count;
+}
+
+/**
+ * Send some of the --body-file from offset, without copying it through
+ * userspace if Linux's sendfile() is there.
+ */
+static ssize_t write_body(int fd, struct connection *conn, off_t offset)
+{
+    size_t len = body_len - offset;
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    /* Linux's sendfile(), the BSDs' takes different arguments */
+    return sendfile(fd, body_fd, &offset, len);
+#else
+    ssize_t count;
+    if (len > config_opts.read_buffer)
+        len = config_opts.read_buffer;
+    if ((count = pread(body_fd, conn->dispatcher->body_buf, len, offset)) <= 0)
+        return count;
+    return write(fd, conn->dispatcher->body_buf, count);
+#endif
+}
+
+/**
+ * process_writing() with a --body-file: the header of each request in the
+ * batch (held back with MSG_MORE so it can share a packet with the start
+ * of the body), then its body.
+ */
+static void process_writing_body(int fd, struct connection *conn)
 {
-    int rv = measure(ME_WRITE, &conn->metrics);
-    int e = errno;
-    if (rv < 0) {
-        conn->error = e;
-        conn->state = ST_ERROR;
-        goto out;
-    }
+    ssize_t count;
+    int e, header;
 
-/* Akami (and probably some other HTTP implementations) don't allow half-open
- * sockets, which are HTTP sessions where from the client's perspective the
- * socket is closed for writes immediately after sending the headers.
- * So disable this behavior by default.
- */
-    if (config_opts.halfopen
-        && shutdown(conn->socket, SHUT_WR) < 0) {
-        conn->error = errno;
-        conn->state = ST_ERROR;
-        fprintf(stderr, "error shutting down fd %d for writes: %s\n",
-                conn->socket, strerror(conn->error));
-    } else {
-        conn->state = ST_READING_HEADER;
+    while (conn->sending < conn->batch) {
+        if (conn->n_iov == 0) {
+            conn->n_iov = location_request(conn->location, conn->iov,
+                                           conn->scratch, &conn->request_len);
+            conn->written = 0;
+            conn->body_sent = 0;
+        }
+        errno = 0;
+        header = conn->written < conn->request_len;
+        if (header)
+            count = write_iovecs(fd, conn, body_len > 0 ? HEADER_MORE : 0);
+        else
+            count = write_body(fd, conn, conn->body_sent);
+        e = errno;
+
+        if (config_opts.verbose > 5)
+            fprintf(stderr, "fd %d wrote %ld bytes of request %d's %s "
+                    "(errno %d: %s)\n", fd, count, conn->sending,
+                    header ? "header" : "body", e, strerror(e));
+
+        if (count < 0 && e == EINTR) {
+            continue;
+        } else if (count < 0 && (e == EAGAIN || e == EWOULDBLOCK)) {
+            conn->state = ST_WRITING; /* come back later */
+            goto out;
+        } else if (count <= 0) {
+            /* nothing read means the file got shorter under us */
+            if (config_opts.verbose > 3)
+                fprintf(stderr, "write(%d) of the %s failed: (%d) %s\n", fd,
+                        header ? "header" : "body", e ? e : EIO,
+                        strerror(e ? e : EIO));
+            conn->error = e ? e : EIO;
+            conn->state = ST_ERROR;
+            goto out;
+        }
+        if (header)
+            conn->written += count;
+        else
+            conn->body_sent += count;
+        if (conn->written == conn->request_len && conn->body_sent == body_len) {
+            conn->dispatcher->total_bytes_sent += conn->request_len + body_len;
+            conn->sending++;
+            conn->n_iov = 0;
+            conn->iov_pos = 0;
+        }
     }
+    if (config_opts.verbose > 3)
+        fprintf(stderr, "write(%d) wrote %d full requests\n", fd,
+                conn->batch);
+    conn->state = ST_WRITTEN;
 
 out:
     process_state(conn);
@@ -329,19 +1686,34 @@ out:
 void process_writing(int fd, short event, void *_conn)
 {
     struct connection *conn = (struct connection *)_conn;
-    ssize_t count;
+    struct iovec iov[MAX_PIPELINE];
+    ssize_t count, total;
     int e;
 
+    if (body_fd >= 0) {
+        process_writing_body(fd, conn);
+        return;
+    }
+    if (conn->iov && conn->n_iov == 0)
+        fill_template(conn);
+    total = conn->iov ? conn->request_len
+                      : conn->location->rlen * conn->batch;
+
 retry_write:
     errno = 0;
-    count = write(fd, conn->location->request + conn->written,
-                  conn->location->rlen - conn->written);
+    if (conn->iov)
+        count = write_iovecs(fd, conn, 0);
+    else if (conn->batch == 1)
+        count = write(fd, conn->location->request + conn->written,
+                      total - conn->written);
+    else
+        count = writev(fd, iov, batch_iovecs(conn, iov));
     e = errno;
 
     if (config_opts.verbose > 5)
             fprintf(stderr, "fd %d attempted to write %ld bytes, wrote "
                     "%ld bytes (errno %d: %s)\n",
-                    fd, conn->location->rlen - conn->written,
+                    fd, total - conn->written,
                     count, e, strerror(e));
 
     if (count < 0 && e == EINTR) {
@@ -361,15 +1733,16 @@ retry_write:
         conn->error = e;
         conn->state = ST_ERROR;
         goto out;
-    } else if (count == conn->location->rlen - conn->written) {
+    } else if (count == total - conn->written) {
         /* done writing */
         if (config_opts.verbose > 4)
             fprintf(stderr, "write(%d) wrote full request, len %ld: '%s'\n",
-                    fd, count, conn->location->request + conn->written);
+                    fd, count, conn->location->request);
         else if (config_opts.verbose > 3)
             fprintf(stderr, "write(%d) wrote full request, len %ld\n", fd,
                     count);
-        conn->written = count;
+        conn->written = total;
+        conn->dispatcher->total_bytes_sent += total;
         conn->state = ST_WRITTEN;
         goto out;
     } else {
@@ -387,17 +1760,24 @@ out:
 
 void process_connected(struct connection *conn)
 {
-    int rv = measure(ME_CONNECT, &conn->metrics);
+    int rv = measure(ME_CONNECT, conn->metrics);
     int e = errno;
+    stop_phase_timeout(conn);
     if (rv < 0) {
         conn->error = e;
         conn->state = ST_ERROR;
     } else {
         conn->state = ST_WRITING;
     }
-    n_concurrent += ++conn->connected;
-    if (n_concurrent > max_concurrent)
-        max_concurrent = n_concurrent;
+    {
+        int concurrent = __sync_add_and_fetch(&n_concurrent,
+                                              ++conn->connected);
+        int max;
+        while ((max = max_concurrent) < concurrent
+               && !__sync_bool_compare_and_swap(&max_concurrent, max,
+                                                concurrent))
+            ; /* somebody else raised it first, check again */
+    }
     process_state(conn);
 }
 
@@ -442,23 +1822,103 @@ out:
     process_state(conn);
 }
 
-static struct timeval tv30sec = { 30, 0 };
+/* how long a connection waits once every --bind address has run out of
+ * local ports, before trying again */
+static struct timeval port_retry = { 0, PORT_RETRY_US };
 
-void process_idle(int fd, short event, void *_conn)
-    /* input fd is ignored */
+/**
+ * Bind the socket to the next --bind address of the right family. The
+ * port is left for connect() to pick, where the kernel supports that, so
+ * that each address's ports can be reused for different destinations.
+ * @returns -1 with errno set to EADDRINUSE if the address is out of
+ *          ports, any other failure is fatal.
+ */
+static int bind_source(struct dispatcher *d, int fd, int family)
 {
-    struct connection *conn = (struct connection *)_conn;
-    int flags, rv, e;
+    char buf[INET6_ADDRSTRLEN];
+    int i, on = 1;
+    for (i = 0; i < n_sources; i++) {
+        struct sockaddr_storage *sa = &sources[d->next_source++ % n_sources];
+        if (sa->ss_family != family)
+            continue;
+#ifdef IP_BIND_ADDRESS_NO_PORT
+        (void)setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on,
+                         sizeof(on));
+#endif
+        if (bind(fd, (struct sockaddr *)sa, family == AF_INET6
+                 ? sizeof(struct sockaddr_in6)
+                 : sizeof(struct sockaddr_in)) == 0)
+            return 0;
+        if (errno == EADDRINUSE)
+            return -1;
+        fprintf(stderr, "Unable to bind to %s (--bind): %s\n",
+                inet_ntop(family, family == AF_INET6
+                          ? (void *)&((struct sockaddr_in6 *)sa)->sin6_addr
+                          : (void *)&((struct sockaddr_in *)sa)->sin_addr,
+                          buf, sizeof(buf)), strerror(errno));
+        exit(-3);
+    }
+    return 0; /* none of this family, let the kernel pick */
+}
 
-    if (n_dispatched >= config_opts.count) {
-        if (config_opts.verbose > 1)
-            fprintf(stderr, "Finished dispatching %dth request\n",
-                    n_dispatched);
-        return; /* done */
+/**
+ * Set the socket options asked for on the command line, on a new socket.
+ */
+static void set_socket_options(int fd)
+{
+    int on = 1;
+    struct linger linger = { 1, 0 };
+    int rcvbuf = (int)config_opts.rcvbuf, sndbuf = (int)config_opts.sndbuf;
+
+    /* close with a RST, so that no TIME_WAIT is left behind */
+    if (config_opts.linger_reset
+        && setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger,
+                      sizeof(linger)) < 0) {
+        perror("setsockopt SO_LINGER");
+        exit(-3);
+    }
+    if (config_opts.nodelay
+        && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+        perror("setsockopt TCP_NODELAY");
+        exit(-3);
+    }
+    /* before connecting, so that the window scale is negotiated for them */
+    if (rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+                             sizeof(rcvbuf)) < 0) {
+        perror("setsockopt SO_RCVBUF");
+        exit(-3);
+    }
+    if (sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                             sizeof(sndbuf)) < 0) {
+        perror("setsockopt SO_SNDBUF");
+        exit(-3);
+    }
+#ifdef TCP_QUICKACK
+    if (config_opts.quickack)
+        (void)setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#endif
+#ifdef TCP_FASTOPEN_CONNECT
+    /* connect() returns straight away and the first write goes in the SYN */
+    if (config_opts.fastopen
+        && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on,
+                      sizeof(on)) < 0) {
+        perror("setsockopt TCP_FASTOPEN_CONNECT");
+        exit(-3);
     }
+#endif
+}
+
+/**
+ * Open a socket and start connecting it to conn->location.
+ */
+static void start_connect(struct connection *conn)
+{
+    int fd, flags, rv, e, family;
 
-    /* create socket */
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    /* create a socket for whichever address is next, IPv4 or IPv6 */
+    conn->address = location_address(conn->location);
+    family = dns_address(conn->address)->sa.ss_family;
+    fd = socket(family, SOCK_STREAM, 0);
     if (fd < 0) {
         perror("socket");
         exit(-3);
@@ -466,6 +1926,9 @@ void process_idle(int fd, short event, void *_conn)
     if (config_opts.verbose > 3)
         fprintf(stderr, "Created socket %d\n", fd);
 
+    set_socket_options(fd);
+    conn->fastopen = config_opts.fastopen;
+
     /* set to O_NONBLOCK */
     flags = fcntl(fd, F_GETFL, 0);
     if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
@@ -477,20 +1940,48 @@ void process_idle(int fd, short event, void *_conn)
 
     /* save the socket for later */
     conn->socket = fd;
-
-    /* fetch the next location to connect to */
-    conn->location = get_next_location();
+    conn->sockopen = 1;
 
     /* start the counter for this connection */
-    rv = measure(ME_EPOCH, &conn->metrics);
+    rv = measure(ME_EPOCH, conn->metrics);
     if (rv < 0) {
-        perror("measure (gettimeofday()) failed");
+        perror("measure failed");
         exit(-4);
     }
 
-    /* connect to the socket */
-    rv = location_connect(conn->location, fd);
+    /* connect to the socket, from the next --bind address if any */
+    if (n_sources > 0 && bind_source(conn->dispatcher, fd, family) < 0) {
+        rv = -1;
+    } else {
+        rv = location_connect(conn->location, fd, conn->address);
+    }
     e = errno;
+    if (rv < 0 && (e == EAGAIN || e == EADDRNOTAVAIL || e == EADDRINUSE)) {
+        /* we ran out of local ports: try again from the next --bind
+         * address straight away, or once they have all been tried, in
+         * a little while. Nothing was sent, so a --rate arrival is still
+         * waiting to be started (and its lag still growing). */
+        struct timeval now = { 0, 0 };
+        int all_tried = ++conn->exhausted >= n_sources;
+        conn->dispatcher->n_port_exhausted++;
+        if (config_opts.verbose > 1)
+            fprintf(stderr, "Ran out of local ports on fd %d: %s\n", fd,
+                    strerror(e));
+        (void)location_close(conn->location, fd);
+        conn->sockopen = 0;
+        unclaim_requests(conn->batch);
+        conn->batch = 0;
+        conn->state = ST_IDLE;
+        if (all_tried)
+            conn->exhausted = 0;
+        event_base_once(conn->dispatcher->base, -1, EV_TIMEOUT, process_idle,
+                        conn, all_tried ? &port_retry : &now);
+        return; /* stay idle until the timer fires */
+    }
+
+    apply_schedule(conn);
+    start_total_timeout(conn);
+    start_phase_timeout(conn, TIMEOUT_CONNECT, config_opts.connect_timeout);
     if (rv == 0) {
         /* we were able to complete the connect immediately, no waiting */
         conn->state = ST_CONNECTED;
@@ -498,29 +1989,75 @@ void process_idle(int fd, short event, void *_conn)
         /* we weren't able to complete the connect immediately,
            check later */
         conn->state = ST_CONNECTING;
-    } else if (rv < 0 && (e == EAGAIN || e == EADDRNOTAVAIL)) {
-        /* we ran out of local sockets, sleep for a little while */
-        if (config_opts.verbose > 0)
-            fprintf(stderr, "Ran out of local sockets, sleeping until "
-                    "more become available\n");
-        /* FIXME: sleep for 30 seconds, THIS MAY NOT WORK YET */
-        event_once(0, EV_TIMEOUT, process_idle, conn, &tv30sec);
-        goto out; /* skip the n_dispatched++ line */
     } else {
+        conn->error = e;
         conn->state = ST_ERROR;
         if (config_opts.verbose > 2)
             perror("connect");
         goto out;
     }
 
-    n_dispatched++; /* assumes non-reentrancy throughout above function */
+    conn->exhausted = 0;
+    account_batch(conn);
+    conn->dispatcher->n_connections++;
 out:
     process_state(conn);
 }
 
+void process_idle(int fd, short event, void *_conn)
+    /* input fd and event are ignored */
+{
+    struct connection *conn = (struct connection *)_conn;
+
+    if (config_opts.rate > 0.0 && !conn->scheduled) {
+        rate_wait(conn);
+        return;
+    }
+
+    conn->batch = claim_requests();
+    if (conn->batch == 0) {
+        if (config_opts.verbose > 1)
+            fprintf(stderr, "Finished dispatching %dth request\n",
+                    n_dispatched);
+        slot_finished(conn);
+        return; /* done */
+    }
+
+    /* fetch the next location to connect to */
+    conn->location = get_next_location(conn->dispatcher->balancer);
+
+    start_connect(conn);
+}
+
+/**
+ * Single callback for each connection's persistent event, which hands
+ * the event off to whichever state is currently waiting on the socket.
+ */
+static void process_event(int fd, short event, void *_conn)
+{
+    struct connection *conn = (struct connection *)_conn;
+    switch (conn->state) {
+        case ST_CONNECTING:
+            process_connecting(fd, event, conn);
+            break;
+        case ST_WRITING:
+            process_writing(fd, event, conn);
+            break;
+        case ST_READING_HEADER:
+            process_reading_header(fd, event, conn);
+            break;
+        case ST_READING_BODY:
+            process_reading_body(fd, event, conn);
+            break;
+        default:
+            fprintf(stderr, "Event on fd %d in unexpected state: %d. "
+                    "Internal error!\n", fd, conn->state);
+            exit(-5);
+    };
+}
+
 static void process_state(struct connection *conn)
 {
-    /* FIXME: change all event_once calls to event_add, for efficiency */
     if (config_opts.verbose > 4) {
         char *state_str;
         switch (conn->state) {
@@ -560,29 +2097,36 @@ static void process_state(struct connection *conn)
     }
     switch (conn->state) {
         case ST_IDLE:
-            /* schedule for immediate call */
-            // FIXME: maybe call this directly instead of schedule it
-            event_once(0, EV_TIMEOUT, process_idle, conn, &tvnow);
+            /* call directly, unless a run of immediate failures has
+             * already nested us too deeply */
+            if (conn->dispatcher->idle_depth < MAX_IDLE_DEPTH) {
+                conn->dispatcher->idle_depth++;
+                process_idle(-1, 0, conn);
+                conn->dispatcher->idle_depth--;
+            } else {
+                event_base_once(conn->dispatcher->base, -1, EV_TIMEOUT,
+                                process_idle, conn, &tvnow);
+            }
             break;
         case ST_CONNECTING:
-            /* FIXME: specify a connect timeout, configured globally */
-            event_once(conn->socket, EV_READ|EV_WRITE, process_connecting,
-                       conn, NULL);
+            /* a completed (or failed) connect makes the socket writable,
+             * which is also what ST_WRITING waits for next */
+            arm_event(conn, EV_WRITE);
             break;
         case ST_CONNECTED:
             process_connected(conn);
             break;
         case ST_WRITING:
-            event_once(conn->socket, EV_WRITE, process_writing, conn, NULL);
+            arm_event(conn, EV_WRITE);
             break;
         case ST_WRITTEN:
             process_written(conn);
             break;
         case ST_READING_HEADER:
-            event_once(conn->socket, EV_READ, process_reading_header, conn, NULL);
+            arm_event(conn, EV_READ);
             break;
         case ST_READING_BODY:
-            event_once(conn->socket, EV_READ, process_reading_body, conn, NULL);
+            arm_event(conn, EV_READ);
             break;
         case ST_READ:
             process_read(conn);
@@ -600,8 +2144,8 @@ static void process_state(struct connection *conn)
             process_cleanup(conn);
             break;
         case ST_TIMEOUT:
-            fprintf(stderr, "ERROR, process_timeout not implemented\n");
-            // fall through to the next state
+            process_timeout(conn);
+            break;
         case ST_ERROR:
             process_error(conn);
             break;
@@ -611,44 +2155,647 @@ static void process_state(struct connection *conn)
     };
 };
 
+/**
+ * Add a --bind address, or a range of IPv4 addresses such as
+ * 10.0.0.1-10.0.0.20, to the sources.
+ * @returns -1 if it isn't one.
+ */
+static int add_sources(char *spec)
+{
+    struct in_addr first, last;
+    struct in6_addr addr6;
+    char *dash = strchr(spec, '-');
+    uint32_t a;
+
+    if (dash) {
+        *dash = '\0';
+        if (inet_pton(AF_INET, spec, &first) != 1
+            || inet_pton(AF_INET, dash + 1, &last) != 1
+            || ntohl(last.s_addr) < ntohl(first.s_addr)) {
+            *dash = '-'; /* for the error message */
+            return -1;
+        }
+    } else if (inet_pton(AF_INET, spec, &first) == 1) {
+        last = first;
+    } else if (inet_pton(AF_INET6, spec, &addr6) == 1) {
+        struct sockaddr_in6 *sa;
+        if (n_sources >= MAX_SOURCES)
+            return -1;
+        sa = (struct sockaddr_in6 *)&sources[n_sources++];
+        sa->sin6_family = AF_INET6;
+        sa->sin6_addr = addr6;
+        return 0;
+    } else {
+        return -1;
+    }
+    for (a = ntohl(first.s_addr); ; a++) {
+        struct sockaddr_in *sa;
+        if (n_sources >= MAX_SOURCES)
+            return -1;
+        sa = (struct sockaddr_in *)&sources[n_sources++];
+        sa->sin_family = AF_INET;
+        sa->sin_addr.s_addr = htonl(a);
+        if (a == ntohl(last.s_addr))
+            break;
+    }
+    return 0;
+}
+
+/**
+ * Set up the --bind source addresses: a comma-separated list of IPv4 or
+ * IPv6 addresses and IPv4 ranges.
+ */
+static void set_sources()
+{
+    char *list, *tok, *last;
+    sources = calloc(MAX_SOURCES, sizeof(*sources));
+    list = strdup(config_opts.bind);
+    if (sources == NULL || list == NULL) {
+        fprintf(stderr, "Unable to allocate source addresses, exiting\n");
+        exit(-2);
+    }
+    for (tok = strtok_r(list, ",", &last); tok;
+         tok = strtok_r(NULL, ",", &last)) {
+        if (add_sources(tok) < 0) {
+            fprintf(stderr, "invalid source address (--bind): %s "
+                    "(at most %d addresses)\n", tok, MAX_SOURCES);
+            exit(-1);
+        }
+    }
+    free(list);
+    if (config_opts.verbose > 1)
+        printf("Binding to %d source addresses\n", n_sources);
+}
+
 void initialize_dispatcher()
 {
-    int i;
-    connections = malloc(sizeof(struct connection) * config_opts.concurrency);
-    if (connections == NULL) {
-        fprintf(stderr, "Unable to allocate connections structure, exiting\n");
+    int i, j, slot = 0;
+    /* with --template each connection fills in its own batch of requests,
+     * with a body it only needs one request's worth at a time */
+    int vars = balancer_template_vars();
+    int batch = (body_fd = balancer_body(&body_len)) >= 0
+                ? 1 : config_opts.pipeline;
+    size_t iov_stride = vars || body_fd >= 0 ? batch * (2 * vars + 1) : 0;
+    size_t scratch_stride = batch * vars * TEMPLATE_NUMBER_LEN;
+
+    head_requests = strcmp(config_opts.method, "HEAD") == 0;
+
+    if (config_opts.threads > config_opts.concurrency) {
+        fprintf(stderr, "Can't run %d threads with only %d connections\n",
+                config_opts.threads, config_opts.concurrency);
+        exit(-2);
+    }
+    dispatchers = calloc(config_opts.threads, sizeof(struct dispatcher));
+    if (dispatchers == NULL) {
+        fprintf(stderr, "Unable to allocate dispatchers, exiting\n");
+        exit(-2);
+    }
+
+    for (i = 0; i < config_opts.threads; i++) {
+        struct dispatcher *d = &dispatchers[i];
+        d->num = i;
+        /* spread the connections as evenly as possible */
+        d->n_slots = config_opts.concurrency / config_opts.threads
+                     + (i < config_opts.concurrency % config_opts.threads);
+        d->base = event_base_new();
+        if (d->base == NULL) {
+            fprintf(stderr, "Unable to create event base, exiting\n");
+            exit(-2);
+        }
+        d->balancer = create_balancer();
+        d->connections = calloc(d->n_slots, sizeof(struct connection));
+        d->connection_metrics = calloc(d->n_slots * config_opts.pipeline,
+                                       sizeof(struct metrics));
+        d->waiting = calloc(d->n_slots, sizeof(*d->waiting));
+        if (iov_stride > 0) {
+            d->connection_iov = malloc(d->n_slots * iov_stride
+                                       * sizeof(struct iovec));
+            d->connection_scratch = malloc(d->n_slots * scratch_stride);
+            if (d->connection_iov == NULL
+                || (scratch_stride > 0 && d->connection_scratch == NULL)) {
+                fprintf(stderr, "Unable to allocate request templates, "
+                        "exiting\n");
+                exit(-2);
+            }
+        }
+        d->body_buf = malloc(config_opts.read_buffer);
+        if (d->connections == NULL || d->connection_metrics == NULL
+            || d->waiting == NULL || d->body_buf == NULL) {
+            fprintf(stderr, "Unable to allocate connections structure, "
+                    "exiting\n");
+            exit(-2);
+        }
+#ifdef HAVE_SPLICE
+        if (config_opts.discard == DISCARD_SPLICE) {
+            if (pipe(d->discard_pipe) < 0) {
+                perror("pipe");
+                exit(-2);
+            }
+#ifdef F_SETPIPE_SZ
+            /* a bigger pipe moves more per splice(), it's fine if not */
+            (void)fcntl(d->discard_pipe[1], F_SETPIPE_SZ, DISCARD_MAX);
+#endif
+        }
+#endif
+        for (j = 0; j < d->n_slots; j++) {
+            d->connections[j].num = slot++;
+            d->connections[j].dispatcher = d;
+            d->connections[j].metrics
+                = &d->connection_metrics[j * config_opts.pipeline];
+            if (iov_stride > 0) {
+                d->connections[j].iov = &d->connection_iov[j * iov_stride];
+                d->connections[j].scratch
+                    = &d->connection_scratch[j * scratch_stride];
+            }
+            init_timeouts(&d->connections[j]);
+        }
+    }
+    if (config_opts.validate && config_opts.verbose > 1)
+        printf("Validating bodies with %s crc32c\n",
+               crc32c_init() ? "SSE4.2" : "table-driven");
+    else if (config_opts.validate)
+        (void)crc32c_init();
+    if (config_opts.bind)
+        set_sources();
+    if (config_opts.discard == DISCARD_SPLICE
+        && (devnull = open("/dev/null", O_WRONLY)) < 0) {
+        perror("/dev/null");
         exit(-2);
     }
-    memset(connections, 0, sizeof(struct connection) * config_opts.concurrency);
     if (config_opts.verbose > 1)
-        printf("Concurrency structure allocated for %d connections\n",
-            config_opts.concurrency);
+        printf("Concurrency structure allocated for %d connections "
+               "in %d threads\n", config_opts.concurrency, config_opts.threads);
+}
+
+static void wheel_tick(int fd, short event, void *_d)
+    /* input fd and event are ignored */
+{
+    struct dispatcher *d = (struct dispatcher *)_d;
+    timer_wheel_advance(&d->wheel);
+}
+
+/* the time the given number of seconds into the run */
+#define TIME_INTO_RUN(seconds) (run_start + (uint64_t)((seconds) * 1e9))
+
+/**
+ * Add a timer that fires the given number of seconds into the run.
+ */
+static void add_timer_at(struct event *ev, double seconds)
+{
+    struct timeval delay;
+    uint64_t now = clock_ns(), at = TIME_INTO_RUN(seconds);
+    NS_TO_TIMEVAL(at > now ? at - now : 0, &delay);
+    if (evtimer_add(ev, &delay) < 0) {
+        perror("evtimer_add");
+        exit(-5);
+    }
+}
+
+/**
+ * The -t duration is up: start no more requests, but let the ones in
+ * flight finish.
+ */
+static void deadline_reached(int fd, short event, void *_d)
+    /* input fd and event are ignored */
+{
+    struct dispatcher *d = (struct dispatcher *)_d;
+    stop_dispatching = 1;
+    if (config_opts.verbose > 0 && d->num == 0)
+        fprintf(stderr, "Test duration reached, finishing outstanding "
+                "requests\n");
+    /* let go of the connections that are waiting for --rate arrivals */
+    if (config_opts.rate > 0.0)
+        rate_schedule(-1, 0, d);
+}
+
+/**
+ * The --warmup period is over, start collecting results from scratch.
+ * Requests still in flight from the warmup are dropped as they finish.
+ */
+static void warmup_over(int fd, short event, void *_d)
+    /* input fd and event are ignored */
+{
+    struct dispatcher *d = (struct dispatcher *)_d;
+    if (config_opts.verbose > 0 && d->num == 0)
+        fprintf(stderr, "Warm-up period over, collecting results\n");
+    (void)reset_accumulator(&d->accumulator);
+    balancer_reset_accumulators(d->balancer);
+    /* n_connections still counts the whole run, since kept-alive
+     * connections opened during the warmup carry on being used */
+    d->total_bytes_received = 0;
+    d->total_bytes_sent = 0;
+    d->n_scheduled = 0;
+    d->lag_total = 0.0;
+    d->lag_max = 0.0;
+    d->n_connect_timeouts = 0;
+    d->n_first_byte_timeouts = 0;
+    d->n_request_timeouts = 0;
+    d->n_http_errors = 0;
+    d->n_socket_errors = 0;
+    d->n_port_exhausted = 0;
+    d->n_validated = 0;
+    d->n_invalid = 0;
+    /* the CPU time is for the whole process, one new baseline will do */
+    if (d->num == 0)
+        (void)getrusage(RUSAGE_SELF, &run_usage);
+}
 
-    /* process initial connections */
-    for (i = 0; i < config_opts.concurrency; i++)
-        process_state(&connections[i]);
+static void *dispatcher_thread(void *_d)
+{
+    struct dispatcher *d = (struct dispatcher *)_d;
+    int i;
 
-    i = start_accumulator(&global_accumulator);
+    i = start_accumulator(&d->accumulator, 1);
     if (i < 0) {
-        perror("start_accumulator (gettimeofday)");
+        perror("start_accumulator");
+        exit(-2);
+    }
+
+    if (config_opts.interval > 0.0) {
+        struct timeval interval;
+        if (start_accumulator(&d->interval, 1) < 0) {
+            perror("start_accumulator");
+            exit(-2);
+        }
+        NS_TO_TIMEVAL((uint64_t)(config_opts.interval * 1e9), &interval);
+        event_set(&d->interval_ev, -1, EV_PERSIST, interval_tick, d);
+        event_base_set(d->base, &d->interval_ev);
+        if (event_add(&d->interval_ev, &interval) < 0) {
+            perror("event_add");
+            exit(-5);
+        }
+    }
+
+    if (d->num == 0) {
+        signal_set(&d->usr1_ev, SIGUSR1, dump_snapshot, NULL);
+        event_base_set(d->base, &d->usr1_ev);
+        if (signal_add(&d->usr1_ev, NULL) < 0) {
+            perror("signal_add");
+            exit(-5);
+        }
+    } else {
+        event_set(&d->snapshot_ev, d->snapshot_pipe[0], EV_READ | EV_PERSIST,
+                  snapshot_pause, d);
+        event_base_set(d->base, &d->snapshot_ev);
+        if (event_add(&d->snapshot_ev, NULL) < 0) {
+            perror("event_add");
+            exit(-5);
+        }
+    }
+
+    if (TIMEOUTS_ENABLED()) {
+        struct timeval tick = { 0, WHEEL_TICK_USEC };
+        timer_wheel_init(&d->wheel, WHEEL_TICK_USEC);
+        event_set(&d->wheel_ev, -1, EV_PERSIST, wheel_tick, d);
+        event_base_set(d->base, &d->wheel_ev);
+        if (event_add(&d->wheel_ev, &tick) < 0) {
+            perror("event_add");
+            exit(-5);
+        }
+    }
+
+    if (config_opts.duration > 0.0) {
+        evtimer_set(&d->deadline_ev, deadline_reached, d);
+        event_base_set(d->base, &d->deadline_ev);
+        add_timer_at(&d->deadline_ev, config_opts.duration);
+    }
+    if (config_opts.warmup > 0.0) {
+        evtimer_set(&d->warmup_ev, warmup_over, d);
+        event_base_set(d->base, &d->warmup_ev);
+        add_timer_at(&d->warmup_ev, config_opts.warmup);
+    }
+
+    if (config_opts.rate > 0.0) {
+        /* every thread runs its own share of the schedule */
+        d->rate = config_opts.rate / config_opts.threads;
+        d->rate_start = clock_ns();
+        d->next_arrival = d->rate_start;
+        d->rand48[0] = (unsigned short)d->rate_start;
+        d->rand48[1] = (unsigned short)(d->rate_start >> 16);
+        d->rand48[2] = (unsigned short)d->num;
+        evtimer_set(&d->rate_ev, rate_schedule, d);
+        event_base_set(d->base, &d->rate_ev);
+    }
+
+    /* process initial connections, this starts the non-blocking connects */
+    for (i = 0; i < d->n_slots; i++)
+        process_state(&d->connections[i]);
+
+    if (event_base_dispatch(d->base) < 0) {
+        perror("event_base_dispatch");
+        return (void *)-1;
+    }
+    (void)stop_accumulator(&d->accumulator);
+    trace_flush(&d->trace);
+    return NULL;
+}
+
+int run_dispatcher()
+{
+    int i, rc = 0;
+    void *rv;
+
+    run_start = clock_ns();
+    (void)getrusage(RUSAGE_SELF, &run_usage);
+    warmup_end = TIME_INTO_RUN(config_opts.warmup);
+    if (config_opts.interval > 0.0) {
+        if (start_accumulator(&interval_acc, 1) < 0) {
+            perror("start_accumulator");
+            exit(-2);
+        }
+        interval_threads = config_opts.threads;
+        interval_start = run_start;
+    }
+    if (config_opts.trace
+        && trace_open(config_opts.trace, run_start,
+                      warmup_end - run_start,
+                      config_opts.keepalive && config_opts.rate <= 0.0
+                      ? TRACE_FROM_CONNECT : 0) < 0) {
+        perror(config_opts.trace);
         exit(-2);
     }
+
+    live_threads = config_opts.threads;
+    for (i = 1; i < config_opts.threads; i++) {
+        int *p = dispatchers[i].snapshot_pipe;
+        if (pipe(p) < 0 || fcntl(p[0], F_SETFL, O_NONBLOCK) < 0
+            || fcntl(p[1], F_SETFL, O_NONBLOCK) < 0) {
+            perror("pipe");
+            exit(-3);
+        }
+    }
+
+    /* the first dispatcher runs in the calling thread */
+    for (i = 1; i < config_opts.threads; i++) {
+        if (pthread_create(&dispatchers[i].thread, NULL, dispatcher_thread,
+                           &dispatchers[i]) != 0) {
+            perror("pthread_create");
+            exit(-2);
+        }
+    }
+    if (dispatcher_thread(&dispatchers[0]) != NULL)
+        rc = -1;
+    for (i = 1; i < config_opts.threads; i++) {
+        if (pthread_join(dispatchers[i].thread, &rv) != 0 || rv != NULL)
+            rc = -1;
+    }
+    dns_shutdown();
+    if (trace_close() < 0)
+        rc = -1;
+    return rc;
 }
 
-int dispatcher_display(FILE *stream)
+/**
+ * Everything the dispatcher threads have counted between them.
+ */
+struct dispatcher_totals {
+    struct accumulator acc;
+    int n_connections;
+    unsigned long long total_bytes_received;
+    unsigned long long total_bytes_sent;
+    int n_scheduled;
+    int http_errors, socket_errors;
+    int connect_timeouts, first_byte_timeouts, request_timeouts;
+    int validated, invalid;
+    int port_exhausted;
+    int fastopen;
+    double lag_total, lag_max;
+    uint64_t cpu_user, cpu_system; /* ns of CPU time used by the test */
+    uint64_t peak_rss; /* bytes, the whole process's high-water mark */
+    int header_buffers, headers_peak; /* summed over the threads' pools */
+};
+
+/**
+ * Add up what each thread did. Unless this is the final display, the
+ * test is still running and the accumulators are left running.
+ * @returns -1 if the accumulator can't be allocated.
+ */
+static int total_dispatchers(struct dispatcher_totals *t, int final)
+{
+    struct rusage usage;
+    int i;
+    memset(t, 0, sizeof(*t));
+    if (start_accumulator(&t->acc, 1) < 0) {
+        perror("start_accumulator from display_totals");
+        return -1;
+    }
+    for (i = 0; i < config_opts.threads; i++) {
+        struct dispatcher *d = &dispatchers[i];
+        if (final)
+            (void)stop_accumulator(&d->accumulator);
+        merge_accumulator(&t->acc, &d->accumulator);
+        t->n_connections += d->n_connections;
+        t->total_bytes_received += d->total_bytes_received;
+        t->total_bytes_sent += d->total_bytes_sent;
+        t->n_scheduled += d->n_scheduled;
+        t->http_errors += d->n_http_errors;
+        t->socket_errors += d->n_socket_errors;
+        t->validated += d->n_validated;
+        t->invalid += d->n_invalid;
+        t->port_exhausted += d->n_port_exhausted;
+        t->fastopen += d->n_fastopen;
+        t->connect_timeouts += d->n_connect_timeouts;
+        t->first_byte_timeouts += d->n_first_byte_timeouts;
+        t->request_timeouts += d->n_request_timeouts;
+        t->header_buffers += d->n_header_buffers;
+        t->headers_peak += d->headers_peak;
+        t->lag_total += d->lag_total;
+        if (d->lag_max > t->lag_max)
+            t->lag_max = d->lag_max;
+    }
+    if (!final) {
+        t->acc.stop = clock_ns();
+        t->acc.tdiff = t->acc.stop - t->acc.start;
+    }
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        t->cpu_user = TIMEVAL_NS(&usage.ru_utime)
+                      - TIMEVAL_NS(&run_usage.ru_utime);
+        t->cpu_system = TIMEVAL_NS(&usage.ru_stime)
+                        - TIMEVAL_NS(&run_usage.ru_stime);
+#ifdef __APPLE__
+        t->peak_rss = usage.ru_maxrss; /* already in bytes */
+#else
+        t->peak_rss = usage.ru_maxrss * 1024ULL;
+#endif
+    }
+    return 0;
+}
+
+/**
+ * Print the totals. Unless this is the final display, the test is still
+ * running and the accumulators are left running.
+ */
+static int display_totals(FILE *stream, int final)
 {
     char buf[BUFSIZ], buf2[BUFSIZ];
     int ret = 0;
-    (void)stop_accumulator(&global_accumulator);
+    struct dispatcher_totals t;
+
+    if (total_dispatchers(&t, final) < 0)
+        return ret;
+
     ret += fprintf(stream, "--- TOTALS:\n");
-    ret += print_accumulator(stream, &global_accumulator);
-    (void)format_bytes(buf, sizeof(buf), total_bytes_received);
-    (void)format_double_bytes(buf2, sizeof(buf2), (double)total_bytes_received
-                       / (global_accumulator.tdiff.tv_sec
-                          + (global_accumulator.tdiff.tv_usec / 1000000.0)));
+    ret += print_accumulator(stream, &t.acc);
+    (void)format_bytes(buf, sizeof(buf), t.total_bytes_received);
+    (void)format_double_bytes(buf2, sizeof(buf2),
+                              (double)t.total_bytes_received
+                              * 1000000000.0 / t.acc.tdiff);
     ret += fprintf(stream, "    Max Concurrency: %d,"
                    " Total Data Received: %s (%s/s)\n",
                    max_concurrent, buf, buf2);
+    if (body_fd >= 0) {
+        /* the upload side, requests and their bodies */
+        (void)format_bytes(buf, sizeof(buf), t.total_bytes_sent);
+        (void)format_double_bytes(buf2, sizeof(buf2),
+                                  (double)t.total_bytes_sent
+                                  * 1000000000.0 / t.acc.tdiff);
+        ret += fprintf(stream, "    Total Data Sent: %s (%s/s)\n", buf,
+                       buf2);
+    }
+    if (t.cpu_user + t.cpu_system > 0) {
+        (void)format_ns(buf, sizeof(buf), t.cpu_user);
+        (void)format_ns(buf2, sizeof(buf2), t.cpu_system);
+        ret += fprintf(stream, "    CPU Time: %s user, %s system,", buf, buf2);
+        (void)format_double_bytes(buf, sizeof(buf),
+                                  (double)t.total_bytes_received
+                                  * 1000000000.0
+                                  / (t.cpu_user + t.cpu_system));
+        ret += fprintf(stream, " Goodput per Core: %s/s\n", buf);
+    }
+    if (t.peak_rss > 0) {
+        (void)format_bytes(buf, sizeof(buf), t.peak_rss);
+        (void)format_bytes(buf2, sizeof(buf2), config_opts.header_buffer);
+        ret += fprintf(stream, "    Peak RSS: %s, Header Buffers: %d peak,"
+                       " %d allocated (%s each)\n", buf, t.headers_peak,
+                       t.header_buffers, buf2);
+    }
+    if (config_opts.keepalive)
+        ret += fprintf(stream, "    Connections Opened: %d,"
+                       " Requests per Connection: %.2lf\n",
+                       t.n_connections, t.n_connections
+                       ? (double)t.acc.total_measurements / t.n_connections
+                       : 0.0);
+    if (config_opts.rate > 0.0) {
+        (void)format_double_timer(buf, sizeof(buf), t.n_scheduled
+                                  ? t.lag_total / t.n_scheduled / 1000.0
+                                  : 0.0);
+        (void)format_double_timer(buf2, sizeof(buf2), t.lag_max / 1000.0);
+        ret += fprintf(stream, "    Offered Rate: %.3lf/s%s,"
+                       " Behind Schedule: %s mean, %s max\n",
+                       config_opts.rate,
+                       config_opts.poisson ? " (Poisson)" : "", buf, buf2);
+    }
+    if (t.http_errors || t.socket_errors)
+        ret += fprintf(stream, "    Errors: %d HTTP, %d socket\n",
+                       t.http_errors, t.socket_errors);
+    if (t.connect_timeouts || t.first_byte_timeouts || t.request_timeouts)
+        ret += fprintf(stream, "    Timeouts: %d connect, %d first byte,"
+                       " %d total\n", t.connect_timeouts,
+                       t.first_byte_timeouts, t.request_timeouts);
+    if (config_opts.fastopen)
+        ret += fprintf(stream, "    TCP Fast Open: %d of %d connections sent"
+                       " the request in the SYN\n", t.fastopen,
+                       t.n_connections);
+    if (t.port_exhausted)
+        ret += fprintf(stream, "    Out of Local Ports: %d connects retried\n",
+                       t.port_exhausted);
+    if (config_opts.validate)
+        ret += fprintf(stream, "    Validation: %d bodies checked,"
+                       " %d unexpected\n", t.validated, t.invalid);
+    if (config_opts.dns_refresh) {
+        struct dns_stats dns;
+        dns_get_stats(&dns);
+        ret += fprintf(stream, "    DNS: %d hosts, %d addresses, %d lookups,"
+                       " %d failed, %d changed\n", dns.hosts, dns.addresses,
+                       dns.lookups, dns.failures, dns.changes);
+    }
+    if (config_opts.threads > 1)
+        ret += fprintf(stream, "    Dispatcher Threads: %d\n",
+                       config_opts.threads);
+    free_accumulator(&t.acc);
     return ret;
 }
 
+int dispatcher_display(FILE *stream)
+{
+    return display_totals(stream, 1);
+}
+
+int dispatcher_snapshot(FILE *stream)
+{
+    return display_totals(stream, 0);
+}
+
+void dispatcher_report(struct report *r, int final)
+{
+    struct dispatcher_totals t;
+
+    if (total_dispatchers(&t, final) < 0)
+        return;
+    report_begin(r, "totals");
+    report_accumulator(r, &t.acc);
+    report_uint(r, "bytes_received", t.total_bytes_received);
+    report_uint(r, "bytes_sent", t.total_bytes_sent);
+    report_int(r, "max_concurrency", max_concurrent);
+    report_int(r, "connections_opened", t.n_connections);
+    if (config_opts.fastopen)
+        report_int(r, "fastopen_connections", t.fastopen);
+    report_uint(r, "cpu_user_ns", t.cpu_user);
+    report_uint(r, "cpu_system_ns", t.cpu_system);
+    /* bytes received per second of CPU time */
+    report_uint(r, "goodput_per_core", t.cpu_user + t.cpu_system
+                ? (uint64_t)((double)t.total_bytes_received * 1000000000.0
+                             / (t.cpu_user + t.cpu_system)) : 0);
+    report_uint(r, "peak_rss_bytes", t.peak_rss);
+    report_begin(r, "header_buffers");
+    report_int(r, "peak", t.headers_peak);
+    report_int(r, "allocated", t.header_buffers);
+    report_uint(r, "size", config_opts.header_buffer);
+    report_end(r);
+    report_begin(r, "errors");
+    report_int(r, "http", t.http_errors);
+    report_int(r, "socket", t.socket_errors);
+    report_int(r, "connect_timeouts", t.connect_timeouts);
+    report_int(r, "first_byte_timeouts", t.first_byte_timeouts);
+    report_int(r, "request_timeouts", t.request_timeouts);
+    report_int(r, "invalid_bodies", t.invalid);
+    report_int(r, "port_exhausted", t.port_exhausted);
+    report_end(r);
+    if (config_opts.validate)
+        report_int(r, "validated", t.validated);
+    if (config_opts.dns_refresh) {
+        struct dns_stats dns;
+        dns_get_stats(&dns);
+        report_begin(r, "dns");
+        report_int(r, "hosts", dns.hosts);
+        report_int(r, "addresses", dns.addresses);
+        report_int(r, "lookups", dns.lookups);
+        report_int(r, "failures", dns.failures);
+        report_int(r, "changes", dns.changes);
+        report_end(r);
+    }
+    if (config_opts.rate > 0.0) {
+        report_begin(r, "schedule");
+        report_int(r, "scheduled", t.n_scheduled);
+        report_uint(r, "lag_mean_ns", t.n_scheduled
+                    ? (uint64_t)(t.lag_total / t.n_scheduled) : 0);
+        report_uint(r, "lag_max_ns", (uint64_t)t.lag_max);
+        report_end(r);
+    }
+    report_int(r, "threads", config_opts.threads);
+    report_end(r);
+    free_accumulator(&t.acc);
+}
+
+void report_results(FILE *stream, int final)
+{
+    struct report r;
+
+    report_open(&r, stream, config_opts.output);
+    report_bool(&r, "final", final);
+    report_uint(&r, "elapsed_ns", clock_ns() - run_start);
+    report_config_opts(&r);
+    balancer_report(&r, final);
+    dispatcher_report(&r, final);
+    report_close(&r);
+}
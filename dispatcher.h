@@ -29,6 +29,8 @@
 
 #include <stdio.h>
 
+#include "report.h"
+
 enum state {
     ST_IDLE = 0,
     ST_CONNECTING,
@@ -50,6 +52,32 @@ struct connection;
 
 void initialize_dispatcher();
 
+/**
+ * Run the test to completion in config_opts.threads dispatcher threads,
+ * one of which is the calling thread.
+ * @returns 0 on success, -1 if any of the event loops failed.
+ */
+int run_dispatcher();
+
 int dispatcher_display(FILE *stream);
 
+/**
+ * Like dispatcher_display(), but while the test is still running. The
+ * numbers are read from the other threads without stopping them, so
+ * they may be a few requests out of step with each other.
+ */
+int dispatcher_snapshot(FILE *stream);
+
+/**
+ * Add the totals to a JSON or CSV report, as the "totals" object.
+ */
+void dispatcher_report(struct report *r, int final);
+
+/**
+ * Print the whole JSON or CSV (--output) report: the config, every
+ * location and the totals. Unless final is set it's a snapshot of a
+ * test that is still running.
+ */
+void report_results(FILE *stream, int final);
+
 #endif /* __dispatcher_h */
@@ -0,0 +1,489 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file dns.c
+ * @brief Resolves the hostnames of all the URLs at once, asynchronously,
+ *        and keeps them up to date during the run if asked to.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <event.h>
+#if defined(HAVE_EVDNS_H) && defined(HAVE_EVDNS_INIT)
+#include <evdns.h>
+#define USE_EVDNS 1
+#endif
+
+#include "params.h"
+#include "dns.h"
+
+#define DNS_HASH_SIZE 1024 /* buckets, there are rarely more than a few hosts */
+#define DNS_RETRY 5 /* seconds until a failed lookup is tried again */
+
+static struct dns_host *hosts[DNS_HASH_SIZE];
+static struct dns_stats stats;
+
+/* every address any host has had, so that each keeps its index for the
+ * per-address statistics even as hosts' answers change */
+static struct dns_addr addresses[MAX_ADDRESSES];
+static volatile int n_addresses;
+static pthread_mutex_t addresses_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct event_base *dns_base; /* NULL until there is a name to look up */
+static int pending; /* startup lookups still outstanding */
+static int refreshing; /* set once the refresh thread has been started */
+static pthread_t refresh_thread;
+static int stop_pipe[2]; /* dns_shutdown() writes to it to stop the thread */
+static struct event stop_ev;
+
+static unsigned int hash_name(const char *name)
+{
+    unsigned int h = 2166136261U; /* FNV-1a */
+    for (; *name; name++) {
+        h ^= (unsigned char)(*name | 0x20); /* names are case-insensitive */
+        h *= 16777619U;
+    }
+    return h % DNS_HASH_SIZE;
+}
+
+/**
+ * Find the index of an IPv4 (family AF_INET) or IPv6 address, adding it
+ * if it hasn't been seen before.
+ * @returns -1 if there are already MAX_ADDRESSES.
+ */
+static int address_index(int family, const void *addr)
+{
+    struct dns_addr a;
+    int i;
+
+    memset(&a, 0, sizeof(a));
+    a.sa.ss_family = family;
+    if (family == AF_INET6) {
+        memcpy(&((struct sockaddr_in6 *)&a.sa)->sin6_addr, addr,
+               sizeof(struct in6_addr));
+        a.len = sizeof(struct sockaddr_in6);
+    } else {
+        memcpy(&((struct sockaddr_in *)&a.sa)->sin_addr, addr,
+               sizeof(struct in_addr));
+        a.len = sizeof(struct sockaddr_in);
+    }
+    pthread_mutex_lock(&addresses_lock);
+    for (i = 0; i < n_addresses; i++)
+        if (addresses[i].len == a.len && memcmp(&addresses[i].sa, &a.sa,
+                                                a.len) == 0)
+            break;
+    if (i == n_addresses) {
+        if (i < MAX_ADDRESSES) {
+            addresses[i] = a;
+            n_addresses++;
+            stats.addresses++;
+        } else {
+            i = -1;
+        }
+    }
+    pthread_mutex_unlock(&addresses_lock);
+    return i;
+}
+
+struct dns_host *dns_host(const char *name)
+{
+    unsigned int h = hash_name(name);
+    struct dns_host *host;
+    struct in6_addr addr;
+    for (host = hosts[h]; host; host = host->hash_next)
+        if (strcasecmp(host->name, name) == 0)
+            return host;
+    host = calloc(1, sizeof(*host));
+    if (host == NULL || (host->name = strdup(name)) == NULL) {
+        fprintf(stderr, "Unable to allocate hosts, exiting\n");
+        exit(-2);
+    }
+    pthread_mutex_init(&host->lock, NULL);
+    host->ttl = DNS_DEFAULT_TTL;
+    if (inet_aton(name, (struct in_addr *)&addr))
+        host->addrs[0] = address_index(AF_INET, &addr);
+    else if (inet_pton(AF_INET6, name, &addr) == 1)
+        host->addrs[0] = address_index(AF_INET6, &addr);
+    else
+        host->addrs[0] = -1;
+    if (host->addrs[0] >= 0) {
+        host->numeric = 1;
+        host->n_addrs = 1;
+    }
+    host->hash_next = hosts[h];
+    hosts[h] = host;
+    stats.hosts++;
+    return host;
+}
+
+/**
+ * Start collecting a new answer for the host.
+ */
+static void begin_answer(struct dns_host *host)
+{
+    host->n_answer = 0;
+    host->answer_ttl = DNS_DEFAULT_TTL;
+}
+
+/**
+ * Add an address to the answer being collected, ignoring duplicates and
+ * any past MAX_DNS_ADDRS.
+ */
+static void add_answer(struct dns_host *host, int family, const void *addr,
+                       uint32_t ttl)
+{
+    int i, idx = address_index(family, addr);
+    if (idx < 0 || host->n_answer == MAX_DNS_ADDRS)
+        return;
+    for (i = 0; i < host->n_answer; i++)
+        if (host->answer[i] == idx)
+            return;
+    if (host->n_answer == 0 || ttl < host->answer_ttl)
+        host->answer_ttl = ttl;
+    host->answer[host->n_answer++] = idx;
+}
+
+/**
+ * Replace the host's addresses with the answer collected, unless it's
+ * the same set of addresses (many servers rotate the order).
+ */
+static void set_addrs(struct dns_host *host)
+{
+    int i, j, same = host->n_answer == host->n_addrs;
+    for (i = 0; same && i < host->n_answer; i++) {
+        for (j = 0; j < host->n_addrs; j++)
+            if (host->addrs[j] == host->answer[i])
+                break;
+        same = j < host->n_addrs;
+    }
+    pthread_mutex_lock(&host->lock);
+    if (!same) {
+        if (host->n_addrs > 0)
+            stats.changes++;
+        memcpy(host->addrs, host->answer, host->n_answer * sizeof(int));
+        host->n_addrs = host->n_answer;
+    }
+    host->ttl = host->answer_ttl;
+    pthread_mutex_unlock(&host->lock);
+    host->failed = 0;
+    if (config_opts.verbose > 1) {
+        char buf[INET6_ADDRSTRLEN];
+        fprintf(stderr, "%s resolves to %d address%s (%s first, ttl %us)\n",
+                host->name, host->n_answer, host->n_answer == 1 ? "" : "es",
+                dns_address_string(host->answer[0], buf, sizeof(buf)),
+                host->answer_ttl);
+    }
+}
+
+/**
+ * Look the host up with the blocking system resolver.
+ * @returns -1 if it couldn't be found.
+ */
+static int system_lookup(struct dns_host *host)
+{
+    struct addrinfo hints, *res, *ai;
+    int rv;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    stats.lookups++;
+    rv = getaddrinfo(host->name, NULL, &hints, &res);
+    if (rv != 0) {
+        stats.failures++;
+        host->failed = 1;
+        if (config_opts.verbose > 0 || !refreshing)
+            fprintf(stderr, "error resolving %s: %s\n", host->name,
+                    gai_strerror(rv));
+        return -1;
+    }
+    begin_answer(host);
+    for (ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET)
+            add_answer(host, AF_INET,
+                       &((struct sockaddr_in *)ai->ai_addr)->sin_addr,
+                       DNS_DEFAULT_TTL);
+        else if (ai->ai_family == AF_INET6)
+            add_answer(host, AF_INET6,
+                       &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr,
+                       DNS_DEFAULT_TTL);
+    }
+    freeaddrinfo(res);
+    host->system = 1;
+    if (host->n_answer == 0) {
+        stats.failures++;
+        host->failed = 1;
+        fprintf(stderr, "error resolving %s: no usable addresses\n",
+                host->name);
+        return -1;
+    }
+    set_addrs(host);
+    return 0;
+}
+
+static void schedule_refresh(struct dns_host *host)
+{
+    struct timeval tv = { 0, 0 };
+    tv.tv_sec = host->failed ? DNS_RETRY
+                : host->ttl > DNS_MIN_TTL ? host->ttl : DNS_MIN_TTL;
+    if (evtimer_add(&host->refresh_ev, &tv) < 0) {
+        perror("evtimer_add");
+        exit(-5);
+    }
+}
+
+#ifdef USE_EVDNS
+static void evdns_resolved(int result, char type, int count, int ttl,
+                           void *addrs, void *_host)
+{
+    struct dns_host *host = (struct dns_host *)_host;
+    int i;
+    if (result == DNS_ERR_NONE && type == DNS_IPv4_A) {
+        for (i = 0; i < count; i++)
+            add_answer(host, AF_INET, (struct in_addr *)addrs + i, ttl);
+    } else if (result == DNS_ERR_NONE && type == DNS_IPv6_AAAA) {
+        for (i = 0; i < count; i++)
+            add_answer(host, AF_INET6, (struct in6_addr *)addrs + i, ttl);
+    } else if (config_opts.verbose > 2) {
+        /* most hosts only have one kind of address, the other is an error */
+        fprintf(stderr, "evdns lookup of %s failed: %s\n", host->name,
+                evdns_err_to_string(result));
+    }
+    if (--host->pending > 0)
+        return; /* the other one is still to come */
+    if (host->n_answer > 0) {
+        set_addrs(host);
+    } else {
+        /* at startup, the system resolver gets a go before it counts */
+        if (refreshing)
+            stats.failures++;
+        host->failed = 1;
+        if (config_opts.verbose > 1)
+            fprintf(stderr, "evdns found no addresses for %s\n", host->name);
+    }
+    if (refreshing)
+        schedule_refresh(host);
+    else if (--pending == 0)
+        event_base_loopexit(dns_base, NULL);
+}
+
+/**
+ * Send off the A and AAAA queries for a host.
+ * @returns 0 if neither could be sent.
+ */
+static int evdns_lookup(struct dns_host *host)
+{
+    stats.lookups++;
+    begin_answer(host);
+    host->pending = 2;
+    if (evdns_resolve_ipv4(host->name, 0, evdns_resolved, host) != 0)
+        host->pending--;
+    if (evdns_resolve_ipv6(host->name, 0, evdns_resolved, host) != 0)
+        host->pending--;
+    return host->pending;
+}
+#endif
+
+/**
+ * Set up the event base (and evdns, which only has a global one in the
+ * API we use) the first time a name needs looking up.
+ */
+static void init_base()
+{
+    if (dns_base)
+        return;
+    dns_base = event_init();
+    if (dns_base == NULL) {
+        fprintf(stderr, "Unable to create event base, exiting\n");
+        exit(-2);
+    }
+#ifdef USE_EVDNS
+    if (evdns_init() != 0 && config_opts.verbose > 0)
+        fprintf(stderr, "evdns unavailable, using the system resolver\n");
+#endif
+}
+
+int dns_resolve_all(void)
+{
+    struct dns_host *host;
+    int i, rc = 0;
+
+#ifdef USE_EVDNS
+    for (i = 0; i < DNS_HASH_SIZE; i++) {
+        for (host = hosts[i]; host; host = host->hash_next) {
+            if (host->numeric || host->n_addrs > 0)
+                continue;
+            init_base();
+            if (evdns_count_nameservers() > 0 && evdns_lookup(host) > 0)
+                pending++;
+            else
+                host->failed = 1;
+        }
+    }
+    if (pending > 0 && event_base_dispatch(dns_base) < 0) {
+        perror("event_base_dispatch");
+        exit(-5);
+    }
+#endif
+    /* whatever evdns couldn't find, the system resolver might */
+    for (i = 0; i < DNS_HASH_SIZE; i++)
+        for (host = hosts[i]; host; host = host->hash_next)
+            if (!host->numeric && host->n_addrs == 0
+                && system_lookup(host) < 0)
+                rc = -1;
+    return rc;
+}
+
+int dns_pick(struct dns_host *host)
+{
+    int i;
+    if (!refreshing) /* the addresses can't change under us */
+        return host->addrs[__sync_fetch_and_add(&host->next, 1)
+                           % host->n_addrs];
+    pthread_mutex_lock(&host->lock);
+    i = host->addrs[host->next++ % host->n_addrs];
+    pthread_mutex_unlock(&host->lock);
+    return i;
+}
+
+int dns_host_has(struct dns_host *host, int i)
+{
+    int j, found = 0;
+    if (refreshing)
+        pthread_mutex_lock(&host->lock);
+    for (j = 0; j < host->n_addrs && !found; j++)
+        found = host->addrs[j] == i;
+    if (refreshing)
+        pthread_mutex_unlock(&host->lock);
+    return found;
+}
+
+const struct dns_addr *dns_address(int i)
+{
+    return &addresses[i];
+}
+
+int dns_addresses(void)
+{
+    return n_addresses;
+}
+
+const char *dns_address_string(int i, char *buf, size_t len)
+{
+    const struct sockaddr_storage *sa = &addresses[i].sa;
+    const void *addr = sa->ss_family == AF_INET6
+        ? (const void *)&((const struct sockaddr_in6 *)sa)->sin6_addr
+        : (const void *)&((const struct sockaddr_in *)sa)->sin_addr;
+    if (inet_ntop(sa->ss_family, addr, buf, len) == NULL)
+        snprintf(buf, len, "?");
+    return buf;
+}
+
+static void refresh_host(int fd, short event, void *_host)
+    /* input fd and event are ignored */
+{
+    struct dns_host *host = (struct dns_host *)_host;
+#ifdef USE_EVDNS
+    if (!host->system) {
+        if (evdns_lookup(host) > 0)
+            return; /* evdns_resolved() schedules the next one */
+        stats.failures++;
+        host->failed = 1;
+        schedule_refresh(host);
+        return;
+    }
+#endif
+    (void)system_lookup(host);
+    schedule_refresh(host);
+}
+
+static void stop_refresh(int fd, short event, void *arg)
+    /* input fd, event and arg are ignored */
+{
+    event_base_loopexit(dns_base, NULL);
+}
+
+static void *dns_thread(void *arg)
+    /* input arg is ignored */
+{
+    if (event_base_dispatch(dns_base) < 0)
+        perror("event_base_dispatch in the resolver");
+    return NULL;
+}
+
+int dns_start_refresh(void)
+{
+    struct dns_host *host;
+    int i, e, n = 0;
+
+    for (i = 0; i < DNS_HASH_SIZE; i++) {
+        for (host = hosts[i]; host; host = host->hash_next) {
+            if (host->numeric)
+                continue;
+            init_base();
+            evtimer_set(&host->refresh_ev, refresh_host, host);
+            event_base_set(dns_base, &host->refresh_ev);
+            schedule_refresh(host);
+            n++;
+        }
+    }
+    if (n == 0)
+        return 0; /* only IP addresses, nothing will ever change */
+    if (pipe(stop_pipe) < 0)
+        return -1;
+    event_set(&stop_ev, stop_pipe[0], EV_READ, stop_refresh, NULL);
+    event_base_set(dns_base, &stop_ev);
+    if (event_add(&stop_ev, NULL) < 0)
+        return -1;
+    refreshing = 1;
+    if ((e = pthread_create(&refresh_thread, NULL, dns_thread, NULL)) != 0) {
+        refreshing = 0;
+        errno = e;
+        return -1;
+    }
+    return 0;
+}
+
+void dns_shutdown(void)
+{
+    if (!refreshing)
+        return;
+    if (write(stop_pipe[1], "", 1) < 0)
+        perror("write to the resolver thread");
+    else
+        (void)pthread_join(refresh_thread, NULL);
+    refreshing = 0;
+}
+
+void dns_get_stats(struct dns_stats *s)
+{
+    *s = stats;
+}
@@ -0,0 +1,131 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file dns.h
+ * @brief Resolves the hostnames of all the URLs at once, asynchronously,
+ *        and keeps them up to date during the run if asked to.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#ifndef __dns_h
+#define __dns_h
+
+#include "config.h"
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <event.h>
+
+#define MAX_DNS_ADDRS 16   /* addresses kept per host, the rest are ignored */
+#define MAX_ADDRESSES 1024 /* distinct addresses over all the hosts */
+#define DNS_MIN_TTL 1      /* seconds, no host is looked up more often */
+#define DNS_DEFAULT_TTL 60 /* seconds, for answers without a TTL */
+
+/* an IPv4 or IPv6 address a host resolved to, without a port */
+struct dns_addr {
+    struct sockaddr_storage sa;
+    socklen_t len;
+};
+
+/* one per distinct hostname, however many URLs use it */
+struct dns_host {
+    char *name;
+    struct dns_host *hash_next;
+    pthread_mutex_t lock;       /* the addresses change with --dns-refresh */
+    int n_addrs;
+    int addrs[MAX_DNS_ADDRS];   /* for dns_address(), IPv4 and IPv6 alike */
+    unsigned int next;          /* the address dns_pick() hands out next */
+    uint32_t ttl;               /* seconds the addresses are good for */
+    int numeric;                /* an IP address, there is nothing to look up */
+    int system;                 /* looked up with getaddrinfo(), not evdns */
+    int failed;                 /* the last lookup didn't work */
+    /* the A and AAAA answers are collected here until both are in */
+    int pending;
+    int n_answer;
+    int answer[MAX_DNS_ADDRS];
+    uint32_t answer_ttl;
+    struct event refresh_ev;    /* fires when the ttl runs out */
+};
+
+struct dns_stats {
+    int hosts;
+    int addresses;              /* distinct, over all the hosts */
+    int lookups;                /* including those at startup */
+    int failures;               /* lookups that didn't work */
+    int changes;                /* lookups that gave different addresses */
+};
+
+/**
+ * Find the entry for a hostname, adding it if it's new. Must be called
+ * for every host before dns_resolve_all().
+ */
+struct dns_host *dns_host(const char *name);
+
+/**
+ * Look up every host added so far, A and AAAA records at once. Uses
+ * evdns where available, and the system resolver for anything evdns
+ * can't find (eg. in /etc/hosts with older libevents).
+ * @returns -1 if any host couldn't be found, after printing why.
+ */
+int dns_resolve_all(void);
+
+/**
+ * Start a thread that looks each host up again whenever its TTL runs
+ * out, for --dns-refresh.
+ * @returns -1 with errno set if the thread can't be started.
+ */
+int dns_start_refresh(void);
+
+/**
+ * The next of the host's addresses, going round all of them in turn.
+ * Safe to call from any thread while dns_start_refresh() is running.
+ * @returns its index for dns_address().
+ */
+int dns_pick(struct dns_host *host);
+
+/**
+ * True if address i is one of the host's.
+ */
+int dns_host_has(struct dns_host *host, int i);
+
+/**
+ * Address i, as returned by dns_pick(). Addresses are never removed, so
+ * the same address always has the same index.
+ */
+const struct dns_addr *dns_address(int i);
+
+/**
+ * How many distinct addresses have been seen so far.
+ */
+int dns_addresses(void);
+
+/**
+ * Write address i as text, IPv6 addresses without brackets.
+ */
+const char *dns_address_string(int i, char *buf, size_t len);
+
+/**
+ * Stop the thread started by dns_start_refresh(), if any.
+ */
+void dns_shutdown(void);
+
+void dns_get_stats(struct dns_stats *stats);
+
+#endif /* __dns_h */
@@ -27,6 +27,8 @@
 
 int format_double_timer(char *buf, size_t buflen, double time_us)
 {   
+    if (time_us < 1.0)
+        return snprintf(buf, buflen, "%6.2lfns", time_us * 1000.0);
     // start out with us
     if (time_us < 1000.0)
         return snprintf(buf, buflen, "%6.2lfus", time_us);
@@ -37,6 +39,11 @@ int format_double_timer(char *buf, size_t buflen, double time_us)
     return snprintf(buf, buflen, "%6.2lfs ", time_us);
 }
 
+int format_ns(char *buf, size_t buflen, uint64_t ns)
+{
+    return format_double_timer(buf, buflen, ns / 1000.0);
+}
+
 int format_double_timeval(char *buf, size_t buflen, struct timeval *tv)
 {
     double dtv = tv->tv_sec * 1000000.0 + tv->tv_usec;
@@ -34,6 +34,12 @@
  */
 int format_double_timer(char *buf, size_t buflen, double time_us);
 
+/**
+ * Pretty-print the given number of nanoseconds.
+ * Returns the number of bytes written.
+ */
+int format_ns(char *buf, size_t buflen, uint64_t ns);
+
 /**
  * Pretty-print the given timeval.
  * Returns the number of bytes written.
@@ -0,0 +1,186 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file header-bench.c
+ * @brief Microbenchmark of parse_response_header() against the
+ *        strstr()/sscanf() parser it replaced. Run "make bench".
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "response.h"
+
+#define ITERATIONS 1000000
+
+static const char sample[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Tue, 15 Apr 2008 16:23:13 GMT\r\n"
+    "Server: Apache/2.2.8 (Unix) mod_ssl/2.2.8 OpenSSL/0.9.8g\r\n"
+    "Last-Modified: Mon, 14 Apr 2008 09:12:45 GMT\r\n"
+    "ETag: \"4a8c1-2c5a-44ad0c9c5e940\"\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Content-Length: 11354\r\n"
+    "Cache-Control: max-age=3600\r\n"
+    "Expires: Tue, 15 Apr 2008 17:23:13 GMT\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "X-Cache: HIT from proxy.example.com\r\n"
+    "Keep-Alive: timeout=15, max=100\r\n"
+    "Connection: Keep-Alive\r\n"
+    "Content-Type: text/html; charset=ISO-8859-1\r\n"
+    "\r\n";
+
+/* --- the old parser, for comparison --- */
+
+#define HEADER_IS(line, len, name) \
+    ((len) == sizeof(name) - 1 && strncasecmp((line), (name), (len)) == 0)
+
+static int old_value_has(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+    for (; *value; value++)
+        if (strncasecmp(value, token, len) == 0)
+            return 1;
+    return 0;
+}
+
+static void old_parse_header_line(struct response *resp, const char *name,
+                                  size_t namelen, const char *value)
+{
+    if (HEADER_IS(name, namelen, "Content-Length")) {
+        resp->content_length = strtoll(value, NULL, 10);
+    } else if (HEADER_IS(name, namelen, "Transfer-Encoding")) {
+        if (old_value_has(value, "chunked"))
+            resp->chunked = 1;
+    } else if (HEADER_IS(name, namelen, "Connection")) {
+        if (old_value_has(value, "close"))
+            resp->close = 1;
+        else if (old_value_has(value, "keep-alive"))
+            resp->close = 0;
+    }
+}
+
+static ssize_t old_parse_response_header(struct response *resp, char *buf,
+                                         size_t len, size_t scan_from)
+{
+    char *end, *line, *eol;
+    int prefixlen = 0;
+
+    end = strstr(buf + scan_from, "\r\n\r\n");
+    if (end == NULL)
+        return 0; /* not done yet */
+
+    if (sscanf(buf, "HTTP/%3f %u %n", &resp->http_version,
+               &resp->resp_code, &prefixlen) != 2)
+        return -1;
+
+    resp->content_length = -1;
+    resp->chunked = 0;
+    resp->close = resp->http_version < 1.1;
+
+    eol = strstr(buf, "\r\n");
+    for (line = eol + 2; line < end + 2; line = eol + 2) {
+        char *colon, *value;
+        eol = strstr(line, "\r\n");
+        colon = memchr(line, ':', eol - line);
+        if (colon == NULL)
+            continue; /* ignore garbage lines */
+        *eol = '\0';
+        for (value = colon + 1; *value == ' ' || *value == '\t'; value++)
+            ; /* consume whitespace */
+        old_parse_header_line(resp, line, colon - line, value);
+        *eol = '\r';
+    }
+
+    eol = strstr(buf, "\r\n");
+    *eol = '\0';
+    strncpy(resp->resp_str, buf + prefixlen, sizeof(resp->resp_str) - 1);
+    return end - buf + 4;
+}
+
+/* --- the benchmark --- */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Parse the sample ITERATIONS times, as if it arrived in pieces reads
+ * of equal size, and print the time per header.
+ */
+static void run(const char *name, int old, int pieces)
+{
+    static char buf[sizeof(sample)];
+    size_t len = sizeof(sample) - 1, step = len / pieces;
+    struct response resp;
+    double start;
+    long i, total = 0;
+
+    start = now();
+    for (i = 0; i < ITERATIONS; i++) {
+        size_t have = 0;
+        ssize_t rv = 0;
+        memcpy(buf, sample, sizeof(sample));
+        memset(&resp, 0, sizeof(resp));
+        while (rv == 0 && have < len) {
+            size_t scan_from = have > 3 ? have - 3 : 0;
+            char c;
+            have = have + step > len || have + 2 * step > len
+                   ? len : have + step;
+            /* the caller \0-terminates what it has read so far */
+            c = buf[have];
+            buf[have] = '\0';
+            rv = old ? old_parse_response_header(&resp, buf, have, scan_from)
+                     : parse_response_header(&resp, buf, have);
+            buf[have] = c;
+        }
+        if (rv != (ssize_t)len || resp.resp_code != 200
+            || resp.content_length != 11354 || resp.close) {
+            fprintf(stderr, "%s: wrong result (%ld, code %u, length %lld)\n",
+                    name, (long)rv, resp.resp_code, resp.content_length);
+            exit(-1);
+        }
+        total += rv;
+    }
+    printf("%-28s %8.1lf ns/header %8.1lf MB/s\n", name,
+           (now() - start) * 1e9 / ITERATIONS,
+           total / (now() - start) / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+    printf("%lu byte header, %d iterations\n",
+           (unsigned long)sizeof(sample) - 1, ITERATIONS);
+    run("strstr/sscanf, 1 read", 1, 1);
+    run("incremental, 1 read", 0, 1);
+    run("strstr/sscanf, 4 reads", 1, 4);
+    run("incremental, 4 reads", 0, 4);
+    run("strstr/sscanf, 16 reads", 1, 16);
+    run("incremental, 16 reads", 0, 16);
+    return 0;
+}
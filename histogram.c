@@ -0,0 +1,86 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file histogram.c
+ * @brief Compact log-bucketed (HDR-style) latency histograms.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#include "histogram.h"
+
+static int bucket_index(uint64_t value)
+{
+    int msb, shift, idx;
+    if (value < (1 << HISTOGRAM_SUB_BITS))
+        return (int)value;
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - (HISTOGRAM_SUB_BITS - 1);
+    idx = shift * HISTOGRAM_HALF + (int)(value >> shift);
+    return idx < HISTOGRAM_BUCKETS ? idx : HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * The largest value that maps to the given bucket.
+ */
+static uint64_t bucket_highest(int idx)
+{
+    int shift;
+    uint64_t sub;
+    if (idx < (1 << HISTOGRAM_SUB_BITS))
+        return idx;
+    shift = idx / HISTOGRAM_HALF - 1;
+    sub = idx - shift * HISTOGRAM_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+    h->counts[bucket_index(value)]++;
+    h->count++;
+    if (value > h->max)
+        h->max = value;
+}
+
+void histogram_merge(struct histogram *h, const struct histogram *from)
+{
+    int i;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+        h->counts[i] += from->counts[i];
+    h->count += from->count;
+    if (from->max > h->max)
+        h->max = from->max;
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double pct)
+{
+    uint64_t target, seen = 0;
+    int i;
+    if (h->count == 0)
+        return 0;
+    target = (uint64_t)(pct / 100.0 * h->count + 0.5);
+    if (target < 1)
+        target = 1;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t highest = bucket_highest(i);
+            return highest < h->max ? highest : h->max;
+        }
+    }
+    return h->max;
+}
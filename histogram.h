@@ -0,0 +1,66 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file histogram.h
+ * @brief Compact log-bucketed (HDR-style) latency histograms.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#ifndef __histogram_h
+#define __histogram_h
+
+#include "config.h"
+
+#include <stdint.h>
+
+/*
+ * Values below 2^HISTOGRAM_SUB_BITS get a bucket each. Above that, every
+ * power of two is split into 2^(HISTOGRAM_SUB_BITS-1) equal buckets, so
+ * a recorded value is off by at most 1/32 (~3%) of itself. Values of
+ * 2^HISTOGRAM_MAX_BITS and up all land in the last bucket.
+ */
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_MAX_BITS 44
+#define HISTOGRAM_HALF (1 << (HISTOGRAM_SUB_BITS - 1))
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_HALF)
+
+struct histogram {
+    uint64_t count;     /* total number of recorded values */
+    uint64_t max;       /* exact largest recorded value */
+    uint32_t counts[HISTOGRAM_BUCKETS];
+};
+
+/**
+ * Record a single value. Constant time and never allocates.
+ */
+void histogram_record(struct histogram *h, uint64_t value);
+
+/**
+ * Add all the values recorded in from to h.
+ */
+void histogram_merge(struct histogram *h, const struct histogram *from);
+
+/**
+ * Find the value below which pct percent of the recorded values fall.
+ * Returns the largest value that shares a bucket with it (but never more
+ * than the largest value recorded), or 0 if nothing was recorded.
+ */
+uint64_t histogram_percentile(const struct histogram *h, double pct);
+
+#endif /* __histogram_h */
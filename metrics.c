@@ -23,113 +23,233 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
 #include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define HAVE_TSC 1
+#endif
 
 #include "formats.h"
 #include "params.h"
 #include "metrics.h"
+#include "report.h"
+
+/* In open-loop mode (--rate) everything is measured from when the request
+ * was scheduled to start, so time spent waiting for a free connection
+ * shows up in the results instead of being hidden by it. */
+#define MEASURE_FROM_CONNECT (config_opts.keepalive && config_opts.rate <= 0.0)
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return 0;
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifdef HAVE_TSC
+static int use_tsc = 0;
+static uint64_t tsc_base; /* TSC at calibration */
+static uint64_t tsc_ns_base; /* CLOCK_MONOTONIC at calibration */
+static uint64_t tsc_mult; /* nanoseconds per tick, shifted left 32 */
+
+/**
+ * Only an invariant TSC runs at a constant rate through frequency and
+ * power state changes.
+ */
+static int tsc_is_invariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+        return 0;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (edx >> 8) & 1;
+}
+#endif
+
+int initialize_clock(int tsc)
+{
+    if (!tsc)
+        return 0;
+#ifdef HAVE_TSC
+    if (!tsc_is_invariant()) {
+        fprintf(stderr, "This CPU has no invariant TSC, using "
+                "CLOCK_MONOTONIC instead\n");
+        return -1;
+    } else {
+        struct timespec nap = { 0, 20000000 }; /* 20ms */
+        uint64_t ns0, ns1, tsc0, tsc1;
+        ns0 = monotonic_ns();
+        tsc0 = __rdtsc();
+        (void)nanosleep(&nap, NULL);
+        ns1 = monotonic_ns();
+        tsc1 = __rdtsc();
+        if (tsc1 <= tsc0 || ns1 <= ns0) {
+            fprintf(stderr, "Unable to calibrate the TSC, using "
+                    "CLOCK_MONOTONIC instead\n");
+            return -1;
+        }
+        tsc_mult = ((ns1 - ns0) << 32) / (tsc1 - tsc0);
+        tsc_base = tsc1;
+        tsc_ns_base = ns1;
+        use_tsc = 1;
+        if (config_opts.verbose > 1)
+            fprintf(stderr, "TSC calibrated at %.3lf ticks/ns\n",
+                    (double)(tsc1 - tsc0) / (ns1 - ns0));
+        return 0;
+    }
+#else
+    fprintf(stderr, "No TSC on this platform, using CLOCK_MONOTONIC "
+            "instead\n");
+    return -1;
+#endif
+}
+
+uint64_t clock_ns(void)
+{
+#ifdef HAVE_TSC
+    if (use_tsc)
+        return tsc_ns_base
+               + (uint64_t)(((unsigned __int128)(__rdtsc() - tsc_base)
+                             * tsc_mult) >> 32);
+#endif
+    return monotonic_ns();
+}
 
 int measure(enum metric_type type, struct metrics *metrics)
 {
-    struct timeval *tv;
-    struct timezone tz; /* ignored */
+    uint64_t *t;
     switch (type) {
         case ME_EPOCH:
-            tv = &metrics->epoch; break;
+            t = &metrics->epoch; break;
         case ME_CONNECT:
-            tv = &metrics->connect; break;
+            t = &metrics->connect; break;
         case ME_WRITE:
-            tv = &metrics->write; break;
+            t = &metrics->write; break;
         case ME_FIRST:
-            tv = &metrics->first; break;
+            t = &metrics->first; break;
         case ME_READ:
-            tv = &metrics->read; break;
+            t = &metrics->read; break;
         case ME_CLOSE:
-            tv = &metrics->close; break;
+        default:
+            t = &metrics->close; break;
     };
-    return gettimeofday(tv, &tz);
+    *t = clock_ns();
+    return 0;
+}
+
+int start_accumulator(struct accumulator *acc, int histograms)
+{
+    memset(acc, 0, sizeof(*acc));
+    if (histograms) {
+        acc->hist = calloc(N_PHASES, sizeof(*acc->hist));
+        if (acc->hist == NULL)
+            return -1;
+    }
+    return reset_accumulator(acc);
 }
 
-int start_accumulator(struct accumulator *acc)
+int reset_accumulator(struct accumulator *acc)
 {
-    struct timezone tz; /* ignored */
+    struct histogram *hist = acc->hist;
     memset(acc, 0, sizeof(*acc));
-    acc->min.connect.tv_sec = LONG_MAX;
-    acc->min.connect.tv_usec = LONG_MAX;
-    acc->min.write.tv_sec = LONG_MAX;
-    acc->min.write.tv_usec = LONG_MAX;
-    acc->min.first.tv_sec = LONG_MAX;
-    acc->min.first.tv_usec = LONG_MAX;
-    acc->min.read.tv_sec = LONG_MAX;
-    acc->min.read.tv_usec = LONG_MAX;
-    acc->min.close.tv_sec = LONG_MAX;
-    acc->min.close.tv_usec = LONG_MAX;
-    return gettimeofday(&acc->start, &tz);
+    if (hist) {
+        memset(hist, 0, N_PHASES * sizeof(*hist));
+        acc->hist = hist;
+    }
+    acc->min.connect = UINT64_MAX;
+    acc->min.write = UINT64_MAX;
+    acc->min.first = UINT64_MAX;
+    acc->min.read = UINT64_MAX;
+    acc->min.close = UINT64_MAX;
+    acc->start = clock_ns();
+    return 0;
 }
 
 int stop_accumulator(struct accumulator *acc)
 {
-    struct timezone tz; /* ignored */
-    int ret;
     if (acc->complete)
         return -1; /* already stopped */
-    ret = gettimeofday(&acc->stop, &tz);
-    if (ret < 0)
-        return ret;
-    timersub(&acc->stop, &acc->start, &acc->tdiff); // calc the tdiff
+    acc->stop = clock_ns();
+    acc->tdiff = acc->stop - acc->start;
     acc->complete = 1;
-    return ret;
+    return 0;
+}
+
+void free_accumulator(struct accumulator *acc)
+{
+    free(acc->hist);
+    acc->hist = NULL;
 }
 
+#define UPDATE_STATS(acc, mdiff, WHICH, TYPE) \
+    do { \
+        acc->total.WHICH += mdiff.WHICH; \
+        if (mdiff.WHICH < acc->min.WHICH) \
+            acc->min.WHICH = mdiff.WHICH; \
+        if (mdiff.WHICH > acc->max.WHICH) \
+            acc->max.WHICH = mdiff.WHICH; \
+        if (acc->hist) \
+            histogram_record(&acc->hist[PHASE(TYPE)], mdiff.WHICH); \
+    } while (0)
+
 void accumulate_metrics(struct accumulator *acc, struct metrics *metrics)
 {
     struct metrics mdiff;
+    uint64_t base = MEASURE_FROM_CONNECT ? metrics->connect : metrics->epoch;
 
     // increase the total number of accumulated measurements
     acc->total_measurements++;
 
-    // calculate diff from epoch
-    timersub(&metrics->connect, &metrics->epoch, &mdiff.connect);
-    timersub(&metrics->write, &metrics->epoch, &mdiff.write);
-    timersub(&metrics->first, &metrics->epoch, &mdiff.first);
-    timersub(&metrics->read, &metrics->epoch, &mdiff.read);
-    timersub(&metrics->close, &metrics->epoch, &mdiff.close);
-
-    // add diff to total
-    timeradd(&acc->total.connect, &mdiff.connect, &acc->total.connect);
-    timeradd(&acc->total.write, &mdiff.write, &acc->total.write);
-    timeradd(&acc->total.first, &mdiff.first, &acc->total.first);
-    timeradd(&acc->total.read, &mdiff.read, &acc->total.read);
-    timeradd(&acc->total.close, &mdiff.close, &acc->total.close);
-
-    // set MINs and MAXs
-    if (timercmp(&mdiff.connect, &acc->min.connect, <)) {
-        acc->min.connect = mdiff.connect;
-    } else if (timercmp(&mdiff.connect, &acc->max.connect, >)) {
-        acc->max.connect = mdiff.connect;
-    }
-    if (timercmp(&mdiff.write, &acc->min.write, <)) {
-        acc->min.write = mdiff.write;
-    } else if (timercmp(&mdiff.write, &acc->max.write, >)) {
-        acc->max.write = mdiff.write;
-    }
-    if (timercmp(&mdiff.first, &acc->min.first, <)) {
-        acc->min.first = mdiff.first;
-    } else if (timercmp(&mdiff.first, &acc->max.first, >)) {
-        acc->max.first = mdiff.first;
-    }
-    if (timercmp(&mdiff.read, &acc->min.read, <)) {
-        acc->min.read = mdiff.read;
-    } else if (timercmp(&mdiff.read, &acc->max.read, >)) {
-        acc->max.read = mdiff.read;
+    // calculate diff from epoch (or from connect, see above)
+    mdiff.connect = metrics->connect - metrics->epoch;
+    mdiff.write = metrics->write - base;
+    mdiff.first = metrics->first - base;
+    mdiff.read = metrics->read - base;
+    mdiff.close = metrics->close - base;
+
+    // add to the totals, MINs and MAXs (a single measurement can be both)
+    if (!metrics->reused) {
+        acc->total_connects++;
+        UPDATE_STATS(acc, mdiff, connect, ME_CONNECT);
     }
-    if (timercmp(&mdiff.close, &acc->min.close, <)) {
-        acc->min.close = mdiff.close;
-    } else if (timercmp(&mdiff.close, &acc->max.close, >)) {
-        acc->max.close = mdiff.close;
+    UPDATE_STATS(acc, mdiff, write, ME_WRITE);
+    UPDATE_STATS(acc, mdiff, first, ME_FIRST);
+    UPDATE_STATS(acc, mdiff, read, ME_READ);
+    UPDATE_STATS(acc, mdiff, close, ME_CLOSE);
+}
+
+#define MERGE_STATS(acc, from, WHICH) \
+    acc->total.WHICH += from->total.WHICH; \
+    if (from->min.WHICH < acc->min.WHICH) \
+        acc->min.WHICH = from->min.WHICH; \
+    if (from->max.WHICH > acc->max.WHICH) \
+        acc->max.WHICH = from->max.WHICH
+
+void merge_accumulator(struct accumulator *acc, struct accumulator *from)
+{
+    if (from->start < acc->start)
+        acc->start = from->start;
+    if (from->stop > acc->stop)
+        acc->stop = from->stop;
+    acc->tdiff = acc->stop - acc->start;
+    acc->total_measurements += from->total_measurements;
+    acc->total_connects += from->total_connects;
+    MERGE_STATS(acc, from, connect);
+    MERGE_STATS(acc, from, write);
+    MERGE_STATS(acc, from, first);
+    MERGE_STATS(acc, from, read);
+    MERGE_STATS(acc, from, close);
+    if (acc->hist && from->hist) {
+        int i;
+        for (i = 0; i < N_PHASES; i++)
+            histogram_merge(&acc->hist[i], &from->hist[i]);
     }
 }
 
@@ -153,66 +273,121 @@ static int print_elapsed(char *buf, size_t len,
     }
 }
 
-#define PRINT_STATS(stream, acc, WHICH) \
-    (void)format_double_timer(mean, sizeof(mean), \
-                              ((acc->total.WHICH.tv_sec * 1000000.0) \
-                               + acc->total.WHICH.tv_usec) \
-                              / (double)acc->total_measurements); \
-    (void)format_double_timer(min, sizeof(min), \
-                              (acc->min.WHICH.tv_sec * 1000000.0) \
-                              + acc->min.WHICH.tv_usec); \
-    (void)format_double_timer(max, sizeof(max), \
-                              (acc->max.WHICH.tv_sec * 1000000.0) \
-                              + acc->max.WHICH.tv_usec); \
-    (void)format_double_timer(total, sizeof(total), \
-                              (acc->total.WHICH.tv_sec * 1000000.0) \
-                              + acc->total.WHICH.tv_usec); \
-    if (sizeof(#WHICH) - 1 <= 5) \
+#define PRINT_STATS(stream, acc, WHICH, COUNT) \
+    (void)format_ns(mean, sizeof(mean), acc->COUNT \
+                    ? acc->total.WHICH / acc->COUNT : 0); \
+    (void)format_ns(min, sizeof(min), acc->min.WHICH); \
+    (void)format_ns(max, sizeof(max), acc->max.WHICH); \
+    (void)format_ns(total, sizeof(total), acc->total.WHICH); \
+    if (acc->COUNT == 0) /* eg. every request was on a kept-alive socket */ \
+        i += fprintf(stream, "          " #WHICH "%s\t(none measured)\n", \
+                     sizeof(#WHICH) - 1 <= 5 ? "\t" : ""); \
+    else if (sizeof(#WHICH) - 1 <= 5) \
         i += fprintf(stream, "          " #WHICH "\t\t%s\t%s/%s\t%s\n", \
                      mean, min, max, total); \
     else \
         i += fprintf(stream, "          " #WHICH "\t%s\t%s/%s\t%s\n", \
                      mean, min, max, total)
 
+#define PRINT_PERCENTILES(stream, acc, WHICH, TYPE) \
+    do { \
+        struct histogram *h = &acc->hist[PHASE(TYPE)]; \
+        int p; \
+        i += fprintf(stream, "          " #WHICH "%s", \
+                     sizeof(#WHICH) - 1 <= 5 ? "\t" : ""); \
+        for (p = 0; p < N_PERCENTILES; p++) { \
+            (void)format_ns(pct, sizeof(pct), \
+                            histogram_percentile(h, percentiles[p])); \
+            i += fprintf(stream, "\t%s", pct); \
+        } \
+        (void)format_ns(pct, sizeof(pct), h->max); \
+        i += fprintf(stream, "\t%s\n", pct); \
+    } while (0)
+
+static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+#define N_PERCENTILES (int)(sizeof(percentiles) / sizeof(percentiles[0]))
+
 int print_accumulator(FILE *stream, struct accumulator *acc)
 {
     int i = 0;
     char mean[BUFSIZ], min[BUFSIZ], max[BUFSIZ], total[BUFSIZ];
     // print the connect metrics, mode, max/min
     i += fprintf(stream, " Metrics:  type\t\t mean\t\t   min/max\t\t total\n");
-    PRINT_STATS(stream, acc, connect);
-    PRINT_STATS(stream, acc, write);
-    PRINT_STATS(stream, acc, first);
-    PRINT_STATS(stream, acc, read);
-    PRINT_STATS(stream, acc, close);
-    (void)format_double_timer(total, sizeof(total),
-                              acc->tdiff.tv_sec * 1000000.0
-                              + acc->tdiff.tv_usec);
+    PRINT_STATS(stream, acc, connect, total_connects);
+    PRINT_STATS(stream, acc, write, total_measurements);
+    PRINT_STATS(stream, acc, first, total_measurements);
+    PRINT_STATS(stream, acc, read, total_measurements);
+    PRINT_STATS(stream, acc, close, total_measurements);
+    if (acc->hist) {
+        char pct[BUFSIZ];
+        i += fprintf(stream, " Latency:  type\t\t p50\t\t p90\t\t p99"
+                     "\t\t p99.9\t\t p99.99\t max\n");
+        PRINT_PERCENTILES(stream, acc, connect, ME_CONNECT);
+        PRINT_PERCENTILES(stream, acc, write, ME_WRITE);
+        PRINT_PERCENTILES(stream, acc, first, ME_FIRST);
+        PRINT_PERCENTILES(stream, acc, read, ME_READ);
+        PRINT_PERCENTILES(stream, acc, close, ME_CLOSE);
+    }
+    (void)format_ns(total, sizeof(total), acc->tdiff);
     i += fprintf(stream, " %d requests total in %s, %.3lf Requests/Second\n",
                  acc->total_measurements, total,
-                 ((double)acc->total_measurements
-                  / (acc->tdiff.tv_sec + (acc->tdiff.tv_usec / 1000000.0))));
+                 (double)acc->total_measurements * 1000000000.0
+                 / acc->tdiff);
     return i;
 }
 
+static const char *percentile_names[N_PERCENTILES] = {
+    "p50_ns", "p90_ns", "p99_ns", "p99_9_ns", "p99_99_ns"
+};
+
+#define REPORT_STATS(r, acc, WHICH, TYPE, COUNT) \
+    do { \
+        report_begin(r, #WHICH); \
+        report_int(r, "count", acc->COUNT); \
+        report_uint(r, "mean_ns", acc->COUNT \
+                    ? acc->total.WHICH / acc->COUNT : 0); \
+        report_uint(r, "min_ns", acc->COUNT ? acc->min.WHICH : 0); \
+        report_uint(r, "max_ns", acc->max.WHICH); \
+        report_uint(r, "total_ns", acc->total.WHICH); \
+        if (acc->hist) { \
+            struct histogram *h = &acc->hist[PHASE(TYPE)]; \
+            int p; \
+            for (p = 0; p < N_PERCENTILES; p++) \
+                report_uint(r, percentile_names[p], \
+                            histogram_percentile(h, percentiles[p])); \
+        } \
+        report_end(r); \
+    } while (0)
+
+void report_accumulator(struct report *r, struct accumulator *acc)
+{
+    report_int(r, "requests", acc->total_measurements);
+    report_int(r, "connects", acc->total_connects);
+    report_uint(r, "duration_ns", acc->tdiff);
+    report_double(r, "requests_per_second", acc->tdiff
+                  ? (double)acc->total_measurements * 1000000000.0
+                    / acc->tdiff : 0.0);
+    report_begin(r, "phases");
+    REPORT_STATS(r, acc, connect, ME_CONNECT, total_connects);
+    REPORT_STATS(r, acc, write, ME_WRITE, total_measurements);
+    REPORT_STATS(r, acc, first, ME_FIRST, total_measurements);
+    REPORT_STATS(r, acc, read, ME_READ, total_measurements);
+    REPORT_STATS(r, acc, close, ME_CLOSE, total_measurements);
+    report_end(r);
+}
+
 int print_metrics(FILE *stream, struct metrics *metrics)
 {
     char cobuf[100], wbuf[100], fbuf[100], rbuf[100], clbuf[100];
-    struct timeval co, w, f, r, cl;
+    uint64_t base = MEASURE_FROM_CONNECT ? metrics->connect : metrics->epoch;
 
     /* FIXME: print header lines every once in awhile */
 
-    timersub(&metrics->connect, &metrics->epoch, &co);
-    timersub(&metrics->write, &metrics->epoch, &w);
-    timersub(&metrics->first, &metrics->epoch, &f);
-    timersub(&metrics->read, &metrics->epoch, &r);
-    timersub(&metrics->close, &metrics->epoch, &cl);
-
-    (void)format_double_timeval(cobuf, sizeof(cobuf), &co);
-    (void)format_double_timeval(wbuf, sizeof(wbuf), &w);
-    (void)format_double_timeval(fbuf, sizeof(fbuf), &f);
-    (void)format_double_timeval(rbuf, sizeof(rbuf), &r);
-    (void)format_double_timeval(clbuf, sizeof(clbuf), &cl);
+    (void)format_ns(cobuf, sizeof(cobuf), metrics->connect - metrics->epoch);
+    (void)format_ns(wbuf, sizeof(wbuf), metrics->write - base);
+    (void)format_ns(fbuf, sizeof(fbuf), metrics->first - base);
+    (void)format_ns(rbuf, sizeof(rbuf), metrics->read - base);
+    (void)format_ns(clbuf, sizeof(clbuf), metrics->close - base);
 
     return fprintf(stream, "%s\t%s\t%s\t%s\t%s\n",
                    cobuf, wbuf, fbuf, rbuf, clbuf);
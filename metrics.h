@@ -26,8 +26,10 @@
 #define __metrics_h
 
 #include "config.h"
+#include "histogram.h"
 
 #include <stdio.h>
+#include <stdint.h>
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
@@ -75,44 +77,102 @@ enum metric_type {
     ME_CLOSE,
 };
 
+/* histograms are kept for every measured phase, indexed by type - 1 */
+#define N_PHASES ME_CLOSE
+#define PHASE(type) ((type) - ME_CONNECT)
+
+/* All times are in nanoseconds from clock_ns(). In an accumulator's
+ * total/min/max they are durations rather than points in time. */
 struct metrics {
-    struct timeval epoch;   /* when the test was started */
-    struct timeval connect; /* time when connect completed */
-    struct timeval write;   /* time when request write completed */
-    struct timeval first;   /* time when first byte of response was read */
-    struct timeval read;    /* time when response read completed */
-    struct timeval close;   /* time when close completed */
+    uint64_t epoch;         /* when the test was started (or, with --rate,
+                             * when it was scheduled to start) */
+    uint64_t connect;       /* time when connect completed */
+    uint64_t write;         /* time when request write completed */
+    uint64_t first;         /* time when first byte of response was read */
+    uint64_t read;          /* time when response read completed */
+    uint64_t close;         /* time when close completed */
+    char reused;            /* boolean, set if sent on a kept-alive
+                             * connection, in which case connect == epoch */
 };
 
 struct accumulator {
-    struct timeval start;   /* time when test was started */
-    struct timeval stop;    /* time when test was completed */
-    struct timeval tdiff;   /* timeval diff between stop and start
+    uint64_t start;         /* time when test was started */
+    uint64_t stop;          /* time when test was completed */
+    uint64_t tdiff;         /* diff between stop and start
                              * (only valid after accumulator is stopped) */
     struct metrics total;
     struct metrics min;
     struct metrics max;
     int total_measurements;
+    int total_connects;     /* measurements that included a connect */
+    struct histogram *hist; /* N_PHASES latency histograms (in ns),
+                             * or NULL if this accumulator doesn't keep them */
 
     char complete;          /* boolean, set after this accumulator is done */
 };
 
-int start_accumulator(struct accumulator *acc);
+/**
+ * Reset the accumulator and start its clock. If histograms is set, the
+ * per-phase histograms are allocated here so that accumulate_metrics()
+ * never has to.
+ * @returns -1 with errno set if the memory can't be had.
+ */
+int start_accumulator(struct accumulator *acc, int histograms);
+
+/**
+ * Throw away everything accumulated so far (keeping the histograms
+ * allocated) and restart the clock.
+ */
+int reset_accumulator(struct accumulator *acc);
 int stop_accumulator(struct accumulator *acc);
+void free_accumulator(struct accumulator *acc);
+
+/**
+ * Pick the clock behind clock_ns(): CLOCK_MONOTONIC, or if tsc is set
+ * and the CPU has an invariant TSC, the TSC calibrated against it.
+ * Must be called before any threads are started.
+ * @returns -1 (and stays on CLOCK_MONOTONIC) if the TSC can't be used.
+ */
+int initialize_clock(int tsc);
+
+/**
+ * Nanoseconds since some arbitrary point, never jumps backwards.
+ */
+uint64_t clock_ns(void);
 
 /**
  * Take a timer measurement.
- * @returns same errors as gettimeofday(2)
+ * @returns 0, the clocks we use can't fail once running
  */
 int measure(enum metric_type type, struct metrics *metrics);
 
 /**
  * Add the metrics to the accumulator.
+ * In keep-alive mode (-k) the connect time is kept separate from the
+ * request itself: write/first/read/close are measured from when the
+ * connect completed, and only requests that actually connected count
+ * towards the connect statistics. In open-loop mode (--rate) everything
+ * is measured from the scheduled start, with or without -k.
  */
 void accumulate_metrics(struct accumulator *acc, struct metrics *metrics);
 
+/**
+ * Add everything in the (stopped) accumulator from into acc, which
+ * then covers the time spanned by both. Histograms are only merged if
+ * both sides keep them.
+ */
+void merge_accumulator(struct accumulator *acc, struct accumulator *from);
+
 int print_accumulator(FILE *stream, struct accumulator *acc);
 
+struct report;
+
+/**
+ * Like print_accumulator(), but into a JSON or CSV report: the request
+ * counts and rate, then every phase's statistics and percentiles in ns.
+ */
+void report_accumulator(struct report *r, struct accumulator *acc);
+
 int print_metrics(FILE *stream, struct metrics *metrics);
 
 #endif /* __metrics_h */
@@ -23,27 +23,170 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
 #include <ctype.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "config.h"
 #include "params.h"
+#include "report.h"
 
-static char *opts = "H:C:c:n:vho";
+static const char *output_format_names[] = { "text", "json", "csv" };
+
+static const char *discard_names[] = { "read", "trunc", "splice" };
+const char *balance_names[] = { "rr", "fair", "weighted", "p2c", "random" };
+
+static char *opts = "H:C:c:n:t:T:f:m:vhok";
+
+/* long-only options are numbered past the range of the short ones */
+enum {
+    OPT_PIPELINE = 256,
+    OPT_RATE,
+    OPT_POISSON,
+    OPT_WARMUP,
+    OPT_CONNECT_TIMEOUT,
+    OPT_FIRST_BYTE_TIMEOUT,
+    OPT_TIMEOUT,
+    OPT_CLOCK,
+    OPT_INTERVAL,
+    OPT_OUTPUT,
+    OPT_TRACE,
+    OPT_DISCARD,
+    OPT_VALIDATE,
+    OPT_EXPECT_CRC,
+    OPT_RECORD_HEADER,
+    OPT_HEADER_BUFFER,
+    OPT_READ_BUFFER,
+    OPT_BALANCE,
+    OPT_WEIGHTS,
+    OPT_DNS_REFRESH,
+    OPT_BIND,
+    OPT_LINGER_RESET,
+    OPT_FASTOPEN,
+    OPT_NODELAY,
+    OPT_QUICKACK,
+    OPT_RCVBUF,
+    OPT_SNDBUF,
+    OPT_TEMPLATE,
+    OPT_CSV,
+    OPT_BODY_FILE,
+};
+
+static struct option long_opts[] = {
+    { "pipeline", required_argument, NULL, OPT_PIPELINE },
+    { "rate", required_argument, NULL, OPT_RATE },
+    { "poisson", no_argument, NULL, OPT_POISSON },
+    { "warmup", required_argument, NULL, OPT_WARMUP },
+    { "connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT },
+    { "first-byte-timeout", required_argument, NULL, OPT_FIRST_BYTE_TIMEOUT },
+    { "timeout", required_argument, NULL, OPT_TIMEOUT },
+    { "clock", required_argument, NULL, OPT_CLOCK },
+    { "interval", required_argument, NULL, OPT_INTERVAL },
+    { "output", required_argument, NULL, OPT_OUTPUT },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "discard", required_argument, NULL, OPT_DISCARD },
+    { "validate", no_argument, NULL, OPT_VALIDATE },
+    { "expect-crc", required_argument, NULL, OPT_EXPECT_CRC },
+    { "record-header", required_argument, NULL, OPT_RECORD_HEADER },
+    { "header-buffer", required_argument, NULL, OPT_HEADER_BUFFER },
+    { "read-buffer", required_argument, NULL, OPT_READ_BUFFER },
+    { "balance", required_argument, NULL, OPT_BALANCE },
+    { "weights", required_argument, NULL, OPT_WEIGHTS },
+    { "dns-refresh", no_argument, NULL, OPT_DNS_REFRESH },
+    { "bind", required_argument, NULL, OPT_BIND },
+    { "linger-reset", no_argument, NULL, OPT_LINGER_RESET },
+    { "fastopen", no_argument, NULL, OPT_FASTOPEN },
+    { "nodelay", no_argument, NULL, OPT_NODELAY },
+    { "quickack", no_argument, NULL, OPT_QUICKACK },
+    { "rcvbuf", required_argument, NULL, OPT_RCVBUF },
+    { "sndbuf", required_argument, NULL, OPT_SNDBUF },
+    { "template", no_argument, NULL, OPT_TEMPLATE },
+    { "csv", required_argument, NULL, OPT_CSV },
+    { "body-file", required_argument, NULL, OPT_BODY_FILE },
+    { NULL, 0, NULL, 0 },
+};
 
 static void print_help(FILE *stream, const char *progname)
 {
     fprintf(stream, "Usage: %s [options] url1 url2 ...\n", progname);
     fprintf(stream, " url1 ... - list of URLs, all to the same host\n");
+    fprintf(stream, " -f <file> - also fetch the URLs in this file, one per line (blank lines\n");
+    fprintf(stream, "    and lines starting with # are ignored)\n");
     fprintf(stream, " -h - this help screen\n");
     fprintf(stream, " -H <header: value> - override, set or unset header\n");
     fprintf(stream, " -C <host> - connect to this host instead of hosts in URL\n");
+    fprintf(stream, " -m <method> - request method (default GET, or POST with --body-file)\n");
+    fprintf(stream, " --body-file <file> - send this file as the body of every request, with\n");
+    fprintf(stream, "    its Content-Length (set Content-Type with -H)\n");
+    fprintf(stream, " --template - fill in placeholders in the URLs and -H values for each\n");
+    fprintf(stream, "    request: {seq} (its number), {rand:lo-hi} (a random integer) and\n");
+    fprintf(stream, "    {csv:n} (column n of the next --csv row)\n");
+    fprintf(stream, " --csv <file> - rows of comma-separated values for {csv:n}, taken in\n");
+    fprintf(stream, "    turn (no quoting), implies --template\n");
+    fprintf(stream, " --dns-refresh - look the hosts up again whenever their DNS TTL runs out,\n");
+    fprintf(stream, "    and connect to each of their addresses in turn\n");
+    fprintf(stream, " --bind <addr>[,<addr>...] - connect from each of these local addresses in\n");
+    fprintf(stream, "    turn, IPv4 ranges like 10.0.0.1-10.0.0.20 included, for more local ports\n");
+    fprintf(stream, " --linger-reset - close connections with a reset (SO_LINGER 0), leaving no\n");
+    fprintf(stream, "    sockets in TIME_WAIT\n");
+    fprintf(stream, " --fastopen - send the first request on each connection in the SYN (TCP\n");
+    fprintf(stream, "    Fast Open), the connect time then includes none of the handshake\n");
+    fprintf(stream, " --nodelay - disable Nagle's algorithm (TCP_NODELAY)\n");
+    fprintf(stream, " --quickack - acknowledge responses straight away (TCP_QUICKACK)\n");
+    fprintf(stream, " --rcvbuf <size> - socket receive buffer size (SO_RCVBUF, eg. 256k)\n");
+    fprintf(stream, " --sndbuf <size> - socket send buffer size (SO_SNDBUF)\n");
     fprintf(stream, " -c <num> - concurrency level\n");
     fprintf(stream, " -n <num> - number of requests to make total\n");
+    fprintf(stream, " -t <time> - stop starting requests after this long (eg. 90s, 10m, 1h),\n");
+    fprintf(stream, "    unlimited by -n unless it is also given\n");
+    fprintf(stream, " --warmup <time> - discard the results of requests started this early in the run\n");
+    fprintf(stream, " --connect-timeout <time> - give up on connects that take longer (default none)\n");
+    fprintf(stream, " --first-byte-timeout <time> - give up on responses that haven't started this\n");
+    fprintf(stream, "    long after the request was sent (default none)\n");
+    fprintf(stream, " --timeout <time> - give up on requests that take longer in total, 0 for no\n");
+    fprintf(stream, "    limit (default %.0lfs)\n", DEFAULT_TIMEOUT);
+    fprintf(stream, " --balance <rr|fair|weighted|p2c|random> - how to spread requests over\n");
+    fprintf(stream, "    the URLs: in turn, to the one with the fewest in flight (each getting\n");
+    fprintf(stream, "    an even share of -n), at random by --weights, to the less loaded of\n");
+    fprintf(stream, "    two picked at random, or at random (default fair)\n");
+    fprintf(stream, " --weights <num>[,<num>...] - relative weights of the URLs in order, any\n");
+    fprintf(stream, "    left out are 1 (implies --balance weighted)\n");
+    fprintf(stream, " -T <num> - number of dispatcher threads, the connections are split between them\n");
     fprintf(stream, " -M <num> - maximum number of connect errors allowed, -1 to disable\n");
     fprintf(stream, " -o - half-open mode (shutdown socket for writes after sending headers)\n");
+    fprintf(stream, " -k - keep-alive mode (reuse connections for multiple requests)\n");
+    fprintf(stream, " --pipeline <num> - write this many requests at once on each connection (implies -k)\n");
+    fprintf(stream, " --rate <num>[/s] - open-loop mode, start this many requests per second\n");
+    fprintf(stream, "    regardless of how quickly they complete (latency is measured from\n");
+    fprintf(stream, "    when each request should have started)\n");
+    fprintf(stream, " --poisson - with --rate, space the requests as a Poisson process\n");
+    fprintf(stream, " --clock <monotonic|tsc> - clock to time requests with, the TSC is cheaper\n");
+    fprintf(stream, "    to read but needs an invariant TSC (default monotonic)\n");
+    fprintf(stream, " --interval <time> - print progress to stderr this often (eg. 1s)\n");
+    fprintf(stream, " --output <text|json|csv> - format of the results, the progress reports\n");
+    fprintf(stream, "    and SIGUSR1 snapshots (json and csv times are in ns, sizes in bytes)\n");
+    fprintf(stream, " --discard <read|trunc|splice> - how to throw away response bodies,\n");
+    fprintf(stream, "    trunc (recv MSG_TRUNC) and splice (to /dev/null) don't copy them\n");
+    fprintf(stream, "    into userspace (default read)\n");
+    fprintf(stream, " --validate - checksum (crc32c) every body and count the ones that differ\n");
+    fprintf(stream, "    from the first one seen for that URL, or that don't match Content-Length\n");
+    fprintf(stream, " --expect-crc <hex>[,<hex>...] - expected checksums for the URLs in order\n");
+    fprintf(stream, "    instead of learning them, \"-\" to learn one anyway (implies --validate)\n");
+    fprintf(stream, " --record-header <name> - count the values of this response header for\n");
+    fprintf(stream, "    each URL, eg. X-Cache (may be given up to %d times)\n",
+            MAX_RECORDED_HEADERS);
+    fprintf(stream, " --header-buffer <size> - largest response header that can be read (eg. 16k),\n");
+    fprintf(stream, "    only held by connections while they read one (default %d)\n",
+            DEFAULT_HEADER_BUFFER);
+    fprintf(stream, " --read-buffer <size> - bytes of a body read at once, one buffer per\n");
+    fprintf(stream, "    dispatcher thread (default %d)\n", DEFAULT_READ_BUFFER);
+    fprintf(stream, " --trace <file> - record every request in a binary trace file, which\n");
+    fprintf(stream, "    plethora-analyze can read after the test\n");
     fprintf(stream, " -v - verbose mode (add multiple times for higher verbosity)\n");
     fprintf(stream, "Hint: use \"--\" to stop argument parsing\n");
 }
@@ -62,11 +205,38 @@ static void add_default_headers()
 {
     struct headers *header;
     for (header = default_headers; header->header != NULL; header++) {
-        struct headers *h = malloc(sizeof(*h));
+        struct headers *h = calloc(1, sizeof(*h));
+        if (h == NULL || (h->header = strdup(header->header)) == NULL
+            || (h->value = strdup(header->value)) == NULL) {
+            fprintf(stderr, "Unable to allocate headers, exiting\n");
+            exit(-2);
+        }
         RING_INIT(h);
-        h->header = header->header;
-        h->value = header->value;
-        RING_APPEND(config_opts.headers, header);
+        RING_APPEND(config_opts.headers, h);
+    }
+}
+
+/**
+ * Change the value of one of the default headers, unless the user has
+ * already overridden it with -H.
+ */
+static void set_default_header(const char *name, const char *value)
+{
+    struct headers *p = config_opts.headers;
+    while (1) {
+        if (strcasecmp(p->header, name) == 0) {
+            if (!p->overridden) {
+                free(p->value);
+                if ((p->value = strdup(value)) == NULL) {
+                    fprintf(stderr, "Unable to allocate headers, exiting\n");
+                    exit(-2);
+                }
+            }
+            return;
+        }
+        if (p->next == config_opts.headers)
+            break;
+        p = p->next;
     }
 }
 
@@ -76,10 +246,69 @@ static void initialize_params()
     config_opts.concurrency = 1;
     config_opts.count = 1;
     config_opts.halfopen = 0;
+    config_opts.pipeline = 1;
+    config_opts.threads = 1;
+    config_opts.balance = BALANCE_FAIR;
+    config_opts.timeout = DEFAULT_TIMEOUT;
+    config_opts.header_buffer = DEFAULT_HEADER_BUFFER;
+    config_opts.read_buffer = DEFAULT_READ_BUFFER;
     add_default_headers();
     config_opts.max_connect_errors = MAX_CONNECT_ERRORS;
 }
 
+/**
+ * Parse a duration such as "500ms", "30s", "10m" or "1h" into seconds.
+ * A bare number is in seconds.
+ * @returns 0 on success, -1 if the duration is malformed or negative.
+ */
+static int parse_duration(const char *str, double *seconds)
+{
+    char *end;
+    double d;
+    errno = 0;
+    d = strtod(str, &end);
+    if (errno || end == str || d < 0.0)
+        return -1;
+    if (*end == '\0' || strcmp(end, "s") == 0)
+        ; /* already in seconds */
+    else if (strcmp(end, "ms") == 0)
+        d /= 1000.0;
+    else if (strcmp(end, "m") == 0)
+        d *= 60.0;
+    else if (strcmp(end, "h") == 0)
+        d *= 3600.0;
+    else
+        return -1;
+    *seconds = d;
+    return 0;
+}
+
+/**
+ * Parse a buffer size such as "4096", "16k" or "1m" into bytes, which
+ * must be between MIN_BUFFER and MAX_BUFFER.
+ * @returns 0 on success, -1 if the size is malformed or out of range.
+ */
+static int parse_buffer_size(const char *str, size_t *size)
+{
+    char *end;
+    long l;
+    errno = 0;
+    l = strtol(str, &end, 10);
+    if (errno || end == str || l <= 0)
+        return -1;
+    if (*end == 'k' || *end == 'K') {
+        l *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        l *= 1048576;
+        end++;
+    }
+    if (*end != '\0' || l < MIN_BUFFER || l > MAX_BUFFER)
+        return -1;
+    *size = (size_t)l;
+    return 0;
+}
+
 static struct headers *parse_header_param(const char *optarg)
 {
     struct headers *header;
@@ -100,7 +329,8 @@ static struct headers *parse_header_param(const char *optarg)
         while (*h == ' ') h++; /* consume whitespace */
         header->header = h;
         while (*hp == ' ') hp++; /* consume whitespace */
-        header->value = hp;
+        /* separately allocated, so that overwrite_header() can free it */
+        header->value = strdup(hp);
         return header;
     }
 }
@@ -141,6 +371,7 @@ static void overwrite_header(struct headers **headers, struct headers *header)
             free(p->value);
             p->header = header->header;
             p->value = header->value;
+            p->overridden = 1;
             free(header);
             return;
         }
@@ -156,13 +387,13 @@ static void overwrite_header(struct headers **headers, struct headers *header)
 void parse_args(int argc, char *argv[])
 {
     long l;
-    int i;
+    int i, count_set = 0, balance_set = 0;
     const char *progname = argv[0];
     struct headers *header;
 
     initialize_params();
 
-    while ((i = getopt(argc, argv, opts)) > 0) {
+    while ((i = getopt_long(argc, argv, opts, long_opts, NULL)) > 0) {
         switch (i) {
             case 'H':
                 header = parse_header_param(optarg);
@@ -174,17 +405,43 @@ void parse_args(int argc, char *argv[])
                     overwrite_header(&config_opts.headers, header);
                 }
                 break;
+            case 'f':
+                config_opts.url_file = optarg;
+                break;
+            case 'm':
+                /* an HTTP token, as it goes straight into the request */
+                if (optarg[0] == '\0' || strspn(optarg, "ABCDEFGHIJKLMNOPQRSTU"
+                    "VWXYZabcdefghijklmnopqrstuvwxyz0123456789!#$%&'*+-.^_`|~")
+                    != strlen(optarg)) {
+                    fprintf(stderr, "invalid request method (-m): %s\n",
+                            optarg);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                config_opts.method = optarg;
+                break;
             case 'C':
                 {
                     /* split on : if present
                      * first part is config_opts.connect
                      * second part is config_opts.connect_port
+                     * an IPv6 address needs brackets to have a port
                      */
                     char *portstr;
                     config_opts.connect = strdup(optarg);
-                    portstr = strchr(config_opts.connect, ':');
-                    if (portstr)
-                        *portstr++ = '\0'; /* terminate the host part */
+                    if (config_opts.connect[0] == '['
+                        && (portstr = strchr(config_opts.connect, ']'))) {
+                        *portstr++ = '\0';
+                        memmove(config_opts.connect, config_opts.connect + 1,
+                                portstr - config_opts.connect - 1);
+                        portstr = *portstr == ':' ? portstr + 1 : NULL;
+                    } else {
+                        portstr = strchr(config_opts.connect, ':');
+                        if (portstr && strchr(portstr + 1, ':'))
+                            portstr = NULL; /* a bare IPv6 address */
+                        else if (portstr)
+                            *portstr++ = '\0'; /* terminate the host part */
+                    }
                     if (portstr && *portstr) {
                         errno = 0;
                         l = strtol(portstr, (char **)NULL, 10);
@@ -229,10 +486,258 @@ void parse_args(int argc, char *argv[])
                     exit(-1);
                 }
                 config_opts.count = (int)l;
+                count_set = 1;
+                break;
+            case 't':
+                if (parse_duration(optarg, &config_opts.duration) < 0
+                    || config_opts.duration == 0.0) {
+                    fprintf(stderr, "invalid duration (-t): %s\n", optarg);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case OPT_WARMUP:
+                if (parse_duration(optarg, &config_opts.warmup) < 0) {
+                    fprintf(stderr, "invalid warmup period (--warmup): %s\n",
+                            optarg);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case 'T':
+                errno = 0;
+                l = strtol(optarg, (char **)NULL, 10);
+                if (errno) {
+                    perror("invalid thread count (-T) value");
+                    print_help(stderr, progname);
+                    exit(-1);
+                } else if (l <= 0 || l == LONG_MAX) {
+                    fprintf(stderr, "invalid thread count (-T): %ld\n", l);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                config_opts.threads = (int)l;
                 break;
             case 'o':
                 config_opts.halfopen = 1;
                 break;
+            case 'k':
+                config_opts.keepalive = 1;
+                break;
+            case OPT_PIPELINE:
+                errno = 0;
+                l = strtol(optarg, (char **)NULL, 10);
+                if (errno) {
+                    perror("invalid pipeline depth (--pipeline) value");
+                    print_help(stderr, progname);
+                    exit(-1);
+                } else if (l <= 0 || l > MAX_PIPELINE) {
+                    fprintf(stderr, "invalid pipeline depth (--pipeline): %ld"
+                            " (must be 1 to %d)\n", l, MAX_PIPELINE);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                config_opts.pipeline = (int)l;
+                if (l > 1)
+                    config_opts.keepalive = 1;
+                break;
+            case OPT_RATE:
+                {
+                    char *end;
+                    double d;
+                    errno = 0;
+                    d = strtod(optarg, &end);
+                    if (errno) {
+                        perror("invalid request rate (--rate) value");
+                        print_help(stderr, progname);
+                        exit(-1);
+                    } else if (d <= 0.0 || (*end && strcmp(end, "/s") != 0)) {
+                        fprintf(stderr, "invalid request rate (--rate): %s\n",
+                                optarg);
+                        print_help(stderr, progname);
+                        exit(-1);
+                    }
+                    config_opts.rate = d;
+                }
+                break;
+            case OPT_POISSON:
+                config_opts.poisson = 1;
+                break;
+            case OPT_CONNECT_TIMEOUT:
+                if (parse_duration(optarg, &config_opts.connect_timeout) < 0) {
+                    fprintf(stderr, "invalid connect timeout "
+                            "(--connect-timeout): %s\n", optarg);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case OPT_FIRST_BYTE_TIMEOUT:
+                if (parse_duration(optarg,
+                                   &config_opts.first_byte_timeout) < 0) {
+                    fprintf(stderr, "invalid first byte timeout "
+                            "(--first-byte-timeout): %s\n", optarg);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case OPT_TIMEOUT:
+                if (parse_duration(optarg, &config_opts.timeout) < 0) {
+                    fprintf(stderr, "invalid request timeout (--timeout): %s\n",
+                            optarg);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case OPT_CLOCK:
+                if (strcmp(optarg, "tsc") == 0) {
+                    config_opts.tsc = 1;
+                } else if (strcmp(optarg, "monotonic") == 0) {
+                    config_opts.tsc = 0;
+                } else {
+                    fprintf(stderr, "invalid clock (--clock): %s\n", optarg);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case OPT_INTERVAL:
+                if (parse_duration(optarg, &config_opts.interval) < 0
+                    || config_opts.interval < 0.001) {
+                    fprintf(stderr, "invalid report interval (--interval): "
+                            "%s\n", optarg);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case OPT_OUTPUT:
+                if (parse_output_format(optarg, &config_opts.output) < 0) {
+                    fprintf(stderr, "invalid output format (--output): %s\n",
+                            optarg);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case OPT_DISCARD:
+                if (strcmp(optarg, "read") == 0) {
+                    config_opts.discard = DISCARD_READ;
+#ifdef __linux__
+                } else if (strcmp(optarg, "trunc") == 0) {
+                    config_opts.discard = DISCARD_TRUNC;
+#endif
+#ifdef HAVE_SPLICE
+                } else if (strcmp(optarg, "splice") == 0) {
+                    config_opts.discard = DISCARD_SPLICE;
+#endif
+                } else {
+                    fprintf(stderr, "invalid or unsupported discard mode "
+                            "(--discard): %s\n", optarg);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case OPT_EXPECT_CRC:
+                config_opts.expect_crc = optarg;
+                /* fall through */
+            case OPT_VALIDATE:
+                config_opts.validate = 1;
+                break;
+            case OPT_RECORD_HEADER:
+                if (config_opts.n_record_headers >= MAX_RECORDED_HEADERS) {
+                    fprintf(stderr, "too many headers to record "
+                            "(--record-header), at most %d\n",
+                            MAX_RECORDED_HEADERS);
+                    exit(-1);
+                }
+                config_opts.record_headers[config_opts.n_record_headers++]
+                    = optarg;
+                break;
+            case OPT_BALANCE:
+                for (l = 0; l <= BALANCE_RANDOM; l++)
+                    if (strcmp(optarg, balance_names[l]) == 0)
+                        break;
+                if (l > BALANCE_RANDOM) {
+                    fprintf(stderr, "invalid balancer (--balance): %s\n",
+                            optarg);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                config_opts.balance = (enum balance_mode)l;
+                balance_set = 1;
+                break;
+            case OPT_WEIGHTS:
+                config_opts.weights = optarg;
+                break;
+            case OPT_DNS_REFRESH:
+                config_opts.dns_refresh = 1;
+                break;
+            case OPT_BIND:
+                config_opts.bind = optarg;
+                break;
+            case OPT_LINGER_RESET:
+                config_opts.linger_reset = 1;
+                break;
+            case OPT_FASTOPEN:
+#ifdef TCP_FASTOPEN_CONNECT
+                config_opts.fastopen = 1;
+                break;
+#else
+                fprintf(stderr, "TCP Fast Open (--fastopen) isn't supported "
+                        "on this system\n");
+                exit(-1);
+#endif
+            case OPT_CSV:
+                config_opts.csv = optarg;
+                /* fall through */
+            case OPT_TEMPLATE:
+                config_opts.template = 1;
+                break;
+            case OPT_BODY_FILE:
+                config_opts.body_file = optarg;
+                break;
+            case OPT_NODELAY:
+                config_opts.nodelay = 1;
+                break;
+            case OPT_QUICKACK:
+                config_opts.quickack = 1;
+                break;
+            case OPT_RCVBUF:
+                if (parse_buffer_size(optarg, &config_opts.rcvbuf) < 0) {
+                    fprintf(stderr, "invalid receive buffer size "
+                            "(--rcvbuf): %s (must be %d to %d bytes)\n",
+                            optarg, MIN_BUFFER, MAX_BUFFER);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case OPT_SNDBUF:
+                if (parse_buffer_size(optarg, &config_opts.sndbuf) < 0) {
+                    fprintf(stderr, "invalid send buffer size "
+                            "(--sndbuf): %s (must be %d to %d bytes)\n",
+                            optarg, MIN_BUFFER, MAX_BUFFER);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case OPT_HEADER_BUFFER:
+                if (parse_buffer_size(optarg, &config_opts.header_buffer) < 0) {
+                    fprintf(stderr, "invalid header buffer size "
+                            "(--header-buffer): %s (must be %d to %d bytes)\n",
+                            optarg, MIN_BUFFER, MAX_BUFFER);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case OPT_READ_BUFFER:
+                if (parse_buffer_size(optarg, &config_opts.read_buffer) < 0) {
+                    fprintf(stderr, "invalid read buffer size "
+                            "(--read-buffer): %s (must be %d to %d bytes)\n",
+                            optarg, MIN_BUFFER, MAX_BUFFER);
+                    print_help(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case OPT_TRACE:
+                config_opts.trace = optarg;
+                break;
             case 'v':
                 config_opts.verbose++;
                 break;
@@ -244,9 +749,44 @@ void parse_args(int argc, char *argv[])
                 break;
         }
     }
+    if (config_opts.rate > 0.0 && config_opts.pipeline > 1) {
+        fprintf(stderr, "--rate can't be combined with --pipeline\n");
+        print_help(stderr, progname);
+        exit(-1);
+    }
+    if (config_opts.poisson && config_opts.rate <= 0.0) {
+        fprintf(stderr, "--poisson requires --rate\n");
+        print_help(stderr, progname);
+        exit(-1);
+    }
+    if (config_opts.validate && config_opts.discard != DISCARD_READ) {
+        fprintf(stderr, "--validate needs to read the bodies, it can't be"
+                " combined with --discard\n");
+        print_help(stderr, progname);
+        exit(-1);
+    }
+    if (config_opts.weights && !balance_set)
+        config_opts.balance = BALANCE_WEIGHTED;
+    else if (config_opts.weights && config_opts.balance != BALANCE_WEIGHTED) {
+        fprintf(stderr, "--weights only works with --balance weighted\n");
+        print_help(stderr, progname);
+        exit(-1);
+    }
+    if (config_opts.duration > 0.0 && !count_set)
+        config_opts.count = INT_MAX; /* only the clock stops the test */
+    if (config_opts.duration > 0.0
+        && config_opts.warmup >= config_opts.duration) {
+        fprintf(stderr, "--warmup must be shorter than the duration (-t)\n");
+        print_help(stderr, progname);
+        exit(-1);
+    }
+    if (config_opts.keepalive)
+        set_default_header("Connection", "keep-alive");
+    if (config_opts.method == NULL)
+        config_opts.method = config_opts.body_file ? "POST" : "GET";
     argc -= optind;
     argv += optind;
-    if (argc == 0) {
+    if (argc == 0 && config_opts.url_file == NULL) {
         fprintf(stderr, "At least one URL required...");
         print_help(stderr, progname);
         exit(-1);
@@ -260,15 +800,20 @@ void parse_args(int argc, char *argv[])
 
 void print_config_opts(FILE *stream)
 {
+    int i;
     struct urls *urls = config_opts.urls;
     struct headers *headers = config_opts.headers;
-    fprintf(stream, "Fetching these URLs\n");
-    while (1) {
+    if (urls)
+        fprintf(stream, "Fetching these URLs\n");
+    while (urls) {
         fprintf(stream, " %s\n", urls->url);
         if (urls->next == config_opts.urls)
             break;
         urls = urls->next;
     }
+    if (config_opts.url_file)
+        fprintf(stream, "Fetching the URLs in this file (-f): %s\n",
+                        config_opts.url_file);
     fprintf(stream, "Using these headers:\n");
     while (1) {
         if (headers->value)
@@ -288,11 +833,167 @@ void print_config_opts(FILE *stream)
                     config_opts.connect);
         }
     }
+    fprintf(stream, "Request method (-m): %s\n", config_opts.method);
+    if (config_opts.body_file)
+        fprintf(stream, "Request body (--body-file): %s\n",
+                config_opts.body_file);
+    if (config_opts.template)
+        fprintf(stream, "Request placeholders (--template): true\n");
+    if (config_opts.csv)
+        fprintf(stream, "Placeholder values (--csv): %s\n", config_opts.csv);
+    if (config_opts.dns_refresh)
+        fprintf(stream, "Refresh DNS as TTLs expire (--dns-refresh): true\n");
+    if (config_opts.bind)
+        fprintf(stream, "Source addresses (--bind): %s\n", config_opts.bind);
+    if (config_opts.linger_reset)
+        fprintf(stream, "Close with a reset (--linger-reset): true\n");
+    if (config_opts.fastopen || config_opts.nodelay || config_opts.quickack
+        || config_opts.rcvbuf || config_opts.sndbuf)
+        fprintf(stream, "Socket options: fastopen %s, nodelay %s, quickack %s,"
+                        " rcvbuf %lu, sndbuf %lu (0 for the default)\n",
+                        config_opts.fastopen ? "on" : "off",
+                        config_opts.nodelay ? "on" : "off",
+                        config_opts.quickack ? "on" : "off",
+                        (unsigned long)config_opts.rcvbuf,
+                        (unsigned long)config_opts.sndbuf);
     fprintf(stream, "Concurrency (-c): %d\n", config_opts.concurrency);
-    fprintf(stream, "Total request count (-n): %d\n", config_opts.count);
+    if (config_opts.count == INT_MAX)
+        fprintf(stream, "Total request count (-n): unlimited\n");
+    else
+        fprintf(stream, "Total request count (-n): %d\n", config_opts.count);
+    if (config_opts.duration > 0.0)
+        fprintf(stream, "Test duration (-t): %.3lfs\n", config_opts.duration);
+    if (config_opts.warmup > 0.0)
+        fprintf(stream, "Warm-up period (--warmup): %.3lfs\n",
+                        config_opts.warmup);
+    fprintf(stream, "Timeouts: connect (--connect-timeout) %.3lfs, "
+                    "first byte (--first-byte-timeout) %.3lfs, "
+                    "total (--timeout) %.3lfs\n",
+                    config_opts.connect_timeout,
+                    config_opts.first_byte_timeout, config_opts.timeout);
+    fprintf(stream, "Dispatcher threads (-T): %d\n", config_opts.threads);
+    fprintf(stream, "Balancer (--balance): %s%s%s\n",
+                    balance_names[config_opts.balance],
+                    config_opts.weights ? ", weights " : "",
+                    config_opts.weights ? config_opts.weights : "");
     fprintf(stream, "Shutdown socket for writes after sending headers "
                     "(halfopen) (-o): %s\n",
                     config_opts.halfopen ? "true" : "false");
+    fprintf(stream, "Keep connections alive between requests (-k): %s\n",
+                    config_opts.keepalive ? "true" : "false");
+    fprintf(stream, "Pipeline depth (--pipeline): %d\n", config_opts.pipeline);
+    if (config_opts.rate > 0.0)
+        fprintf(stream, "Open-loop request rate (--rate): %.3lf/s%s\n",
+                        config_opts.rate,
+                        config_opts.poisson ? ", Poisson arrivals" : "");
+    if (config_opts.interval > 0.0)
+        fprintf(stream, "Progress report interval (--interval): %.3lfs\n",
+                        config_opts.interval);
+    fprintf(stream, "Clock source (--clock): %s\n",
+                    config_opts.tsc ? "tsc" : "monotonic");
+    fprintf(stream, "Response body discard mode (--discard): %s\n",
+                    discard_names[config_opts.discard]);
+    if (config_opts.validate)
+        fprintf(stream, "Validate response bodies (--validate): true%s%s\n",
+                        config_opts.expect_crc ? ", expecting " : "",
+                        config_opts.expect_crc ? config_opts.expect_crc : "");
+    for (i = 0; i < config_opts.n_record_headers; i++)
+        fprintf(stream, "Recording header (--record-header): %s\n",
+                        config_opts.record_headers[i]);
+    fprintf(stream, "Buffer sizes: header (--header-buffer) %lu, "
+                    "read (--read-buffer) %lu\n",
+                    (unsigned long)config_opts.header_buffer,
+                    (unsigned long)config_opts.read_buffer);
+    if (config_opts.trace)
+        fprintf(stream, "Trace file (--trace): %s\n", config_opts.trace);
+    fprintf(stream, "Output format (--output): %s\n",
+                    output_format_names[config_opts.output]);
     fprintf(stream, "Verbosity level (-v): %d\n", config_opts.verbose);
     fprintf(stream, "\n");
 }
+
+#define SECONDS_TO_NS(s) ((uint64_t)((s) * 1000000000.0 + 0.5))
+
+void report_config_opts(struct report *r)
+{
+    struct urls *urls = config_opts.urls;
+    struct headers *headers = config_opts.headers;
+
+    report_begin(r, "config");
+    report_begin_list(r, "urls");
+    while (urls) {
+        report_string(r, NULL, urls->url);
+        if (urls->next == config_opts.urls)
+            break;
+        urls = urls->next;
+    }
+    report_end_list(r);
+    if (config_opts.url_file)
+        report_string(r, "url_file", config_opts.url_file);
+    report_begin(r, "headers");
+    while (1) {
+        /* disabled headers are reported as empty */
+        report_string(r, headers->header, headers->value ? headers->value : "");
+        if (headers->next == config_opts.headers)
+            break;
+        headers = headers->next;
+    }
+    report_end(r);
+    if (config_opts.connect) {
+        report_string(r, "connect_host", config_opts.connect);
+        report_int(r, "connect_port", config_opts.connect_port);
+    }
+    report_string(r, "method", config_opts.method);
+    if (config_opts.body_file)
+        report_string(r, "body_file", config_opts.body_file);
+    report_bool(r, "template", config_opts.template);
+    if (config_opts.csv)
+        report_string(r, "csv", config_opts.csv);
+    report_bool(r, "dns_refresh", config_opts.dns_refresh);
+    if (config_opts.bind)
+        report_string(r, "bind", config_opts.bind);
+    report_bool(r, "linger_reset", config_opts.linger_reset);
+    report_bool(r, "fastopen", config_opts.fastopen);
+    report_bool(r, "nodelay", config_opts.nodelay);
+    report_bool(r, "quickack", config_opts.quickack);
+    report_uint(r, "rcvbuf", config_opts.rcvbuf);
+    report_uint(r, "sndbuf", config_opts.sndbuf);
+    report_int(r, "concurrency", config_opts.concurrency);
+    /* -1 for unlimited */
+    report_int(r, "count", config_opts.count == INT_MAX
+                           ? -1 : config_opts.count);
+    report_uint(r, "duration_ns", SECONDS_TO_NS(config_opts.duration));
+    report_uint(r, "warmup_ns", SECONDS_TO_NS(config_opts.warmup));
+    report_uint(r, "connect_timeout_ns",
+                SECONDS_TO_NS(config_opts.connect_timeout));
+    report_uint(r, "first_byte_timeout_ns",
+                SECONDS_TO_NS(config_opts.first_byte_timeout));
+    report_uint(r, "timeout_ns", SECONDS_TO_NS(config_opts.timeout));
+    report_int(r, "threads", config_opts.threads);
+    report_string(r, "balance", balance_names[config_opts.balance]);
+    if (config_opts.weights)
+        report_string(r, "weights", config_opts.weights);
+    report_bool(r, "halfopen", config_opts.halfopen);
+    report_bool(r, "keepalive", config_opts.keepalive);
+    report_int(r, "pipeline", config_opts.pipeline);
+    report_double(r, "rate", config_opts.rate);
+    report_bool(r, "poisson", config_opts.poisson);
+    report_uint(r, "interval_ns", SECONDS_TO_NS(config_opts.interval));
+    report_string(r, "clock", config_opts.tsc ? "tsc" : "monotonic");
+    report_string(r, "discard", discard_names[config_opts.discard]);
+    report_bool(r, "validate", config_opts.validate);
+    if (config_opts.expect_crc)
+        report_string(r, "expect_crc", config_opts.expect_crc);
+    if (config_opts.n_record_headers > 0) {
+        int i;
+        report_begin_list(r, "record_headers");
+        for (i = 0; i < config_opts.n_record_headers; i++)
+            report_string(r, NULL, config_opts.record_headers[i]);
+        report_end_list(r);
+    }
+    report_uint(r, "header_buffer", config_opts.header_buffer);
+    report_uint(r, "read_buffer", config_opts.read_buffer);
+    if (config_opts.trace)
+        report_string(r, "trace", config_opts.trace);
+    report_end(r);
+}
@@ -29,8 +29,15 @@
 #include <stdio.h>
 
 #include "ring.h"
+#include "report.h"
 
 #define MAX_CONNECT_ERRORS 10
+#define MAX_PIPELINE 256
+#define DEFAULT_TIMEOUT 120.0 /* seconds */
+#define DEFAULT_HEADER_BUFFER 4096 /* bytes, the largest header we can read */
+#define DEFAULT_READ_BUFFER 131072 /* bytes read from a socket at once */
+#define MIN_BUFFER 256
+#define MAX_BUFFER (64 * 1048576)
 
 struct urls {
     char *url;
@@ -39,13 +46,37 @@ struct urls {
 
 struct headers {
     char *header;
-    char *value;
+    char *value; /* NULL if -H disabled the header */
     RING_T(struct headers);
+    int overridden; /* set once -H has replaced a default header */
 };
 
+enum discard_mode {
+    DISCARD_READ = 0,   /* read() bodies into a buffer */
+    DISCARD_TRUNC,      /* recv(MSG_TRUNC), dropped in the kernel */
+    DISCARD_SPLICE,     /* splice() through a pipe to /dev/null */
+};
+
+enum balance_mode {
+    BALANCE_RR = 0,     /* each location in turn */
+    BALANCE_FAIR,       /* the fewest requests in flight, an even share each */
+    BALANCE_WEIGHTED,   /* at random, in proportion to --weights */
+    BALANCE_P2C,        /* the less loaded of two picked at random */
+    BALANCE_RANDOM,     /* uniformly at random */
+};
+
+extern const char *balance_names[];
+
+#define MAX_RECORDED_HEADERS 8 /* same as MAX_RECORD_HEADERS in response.h */
+
 struct config_opts {
-    struct urls *urls;
+    struct urls *urls; /* from the command line, NULL if only -f gave some */
+    char *url_file; /* -f, one URL per line, NULL for none */
     struct headers *headers;
+    char *method; /* -m, GET unless there is a body */
+    char *body_file; /* --body-file sent with every request, NULL for none */
+    int template; /* fill in {placeholders} in each request (--template) */
+    char *csv; /* --csv values for {csv:n}, NULL for none */
     char *connect;
     unsigned short connect_port;
     int verbose;
@@ -53,6 +84,37 @@ struct config_opts {
     int count;
     int max_connect_errors;
     int halfopen;
+    int keepalive;
+    int pipeline; /* requests written per connection at once */
+    int threads; /* number of dispatcher threads */
+    double rate; /* open-loop requests per second, 0 for closed-loop */
+    int poisson; /* set for exponentially distributed arrivals */
+    double duration; /* seconds to keep starting requests, 0 for no limit */
+    double warmup; /* seconds of results to discard at the start */
+    double connect_timeout; /* seconds, 0 for none */
+    double first_byte_timeout; /* seconds from the write, 0 for none */
+    double timeout; /* seconds for the whole request, 0 for none */
+    int tsc; /* time with the TSC instead of CLOCK_MONOTONIC */
+    double interval; /* seconds between progress reports, 0 for none */
+    enum output_format output; /* how results are printed */
+    char *trace; /* binary per-request trace file, NULL for none */
+    enum discard_mode discard; /* how response bodies are thrown away */
+    int validate; /* checksum bodies and compare them per location */
+    char *expect_crc; /* --expect-crc list, NULL to learn them all */
+    char *record_headers[MAX_RECORDED_HEADERS]; /* values to count */
+    int n_record_headers;
+    size_t header_buffer; /* --header-buffer, per connection reading one */
+    size_t read_buffer; /* --read-buffer, per dispatcher thread */
+    enum balance_mode balance; /* how requests are spread over the URLs */
+    char *weights; /* --weights list, NULL for all equal */
+    int dns_refresh; /* look hosts up again as their TTLs run out */
+    char *bind; /* --bind source addresses, NULL to let the kernel pick */
+    int linger_reset; /* close connections with a RST (SO_LINGER 0) */
+    int fastopen; /* send the first request in the SYN (TCP Fast Open) */
+    int nodelay; /* TCP_NODELAY */
+    int quickack; /* TCP_QUICKACK, ACK responses straight away */
+    size_t rcvbuf; /* SO_RCVBUF, 0 for the system default */
+    size_t sndbuf; /* SO_SNDBUF, 0 for the system default */
 };
 
 extern struct config_opts config_opts;
@@ -61,4 +123,9 @@ void parse_args(int argc, char *argv[]);
 
 void print_config_opts(FILE *stream);
 
+/**
+ * The options in effect, as the "config" object of a JSON or CSV report.
+ */
+void report_config_opts(struct report *r);
+
 #endif /* __params_h */
@@ -27,6 +27,7 @@
 #include <string.h>
 
 #include "parse_uri.h"
+#include "arena.h"
 
 #define T_COLON           0x01        /* ':' */
 #define T_SLASH           0x02        /* '/' */
@@ -120,7 +121,7 @@ static short uri_port_of_scheme(const char *scheme_str)
     return 0;
 }
 
-struct uri *parse_uri(const char *uri)
+struct uri *parse_uri(const char *uri, struct arena *arena)
 {
     const char *s;
     const char *s1;
@@ -132,7 +133,9 @@ struct uri *parse_uri(const char *uri)
     /* Initialize the structure. parse_uri() and parse_uri_components()
      * can be called more than once per request.
      */
-    struct uri *uptr = malloc(sizeof(*uptr));
+    struct uri *uptr = arena_alloc(arena, sizeof(*uptr));
+    if (uptr == NULL)
+        return NULL;
     memset(uptr, '\0', sizeof(*uptr));
 
     /* We assume the processor has a branch predictor like most --
@@ -149,9 +152,7 @@ deal_with_path:
             ++s;
         }
         if (s != uri) {
-            uptr->path = malloc(s - uri + 1);
-            memset(uptr->path, 0, s - uri + 1);
-            memcpy(uptr->path, uri, s - uri);
+            uptr->path = arena_strmemdup(arena, uri, s - uri);
         }
         if (*s == 0) {
             return uptr;
@@ -160,18 +161,16 @@ deal_with_path:
             ++s;
             s1 = strchr(s, '#');
             if (s1) {
-                uptr->fragment = strdup(s1 + 1);
-                uptr->query = malloc(s1 - s + 1);
-                memset(uptr->query, 0, s1 - s + 1);
-                memcpy(uptr->query, s, s1 - s);
+                uptr->fragment = arena_strdup(arena, s1 + 1);
+                uptr->query = arena_strmemdup(arena, s, s1 - s);
             }
             else {
-                uptr->query = strdup(s);
+                uptr->query = arena_strdup(arena, s);
             }
             return uptr;
         }
         /* otherwise it's a fragment */
-        uptr->fragment = strdup(s + 1);
+        uptr->fragment = arena_strdup(arena, s + 1);
         return uptr;
     }
 
@@ -185,18 +184,14 @@ deal_with_path:
         goto deal_with_path;        /* backwards predicted taken! */
     }
 
-    uptr->scheme = malloc(s - uri + 1);
-    memset(uptr->scheme, 0, s - uri + 1);
-    memcpy(uptr->scheme, uri, s - uri);
+    uptr->scheme = arena_strmemdup(arena, uri, s - uri);
     s += 3;
     hostinfo = s;
     while ((uri_delims[*(unsigned char *)s] & NOTEND_HOSTINFO) == 0) {
         ++s;
     }
     uri = s;        /* whatever follows hostinfo is start of uri */
-    uptr->hostinfo = malloc(uri - hostinfo + 1);
-    memset(uptr->hostinfo, 0, uri - hostinfo + 1);
-    memcpy(uptr->hostinfo, hostinfo, uri - hostinfo);
+    uptr->hostinfo = arena_strmemdup(arena, hostinfo, uri - hostinfo);
 
     /* If there's a username:password@host:port, the @ we want is the last @...
      * too bad there's no memrchr()... For the C purists, note that hostinfo
@@ -229,21 +224,15 @@ deal_with_host:
         }
         if (s == NULL) {
             /* we expect the common case to have no port */
-            uptr->hostname = malloc(uri - hostinfo - v6_offset2 + 1);
-            memset(uptr->hostname, 0, uri - hostinfo - v6_offset2 + 1);
-            memcpy(uptr->hostname, hostinfo + v6_offset1,
-                                   uri - hostinfo - v6_offset2);
+            uptr->hostname = arena_strmemdup(arena, hostinfo + v6_offset1,
+                                             uri - hostinfo - v6_offset2);
             uptr->port = uri_port_of_scheme(uptr->scheme);
             goto deal_with_path;
         }
-        uptr->hostname = malloc(s - hostinfo - v6_offset2 + 1);
-        memset(uptr->hostname, 0, s - hostinfo - v6_offset2 + 1);
-        memcpy(uptr->hostname, hostinfo + v6_offset1,
-                               s - hostinfo - v6_offset2);
+        uptr->hostname = arena_strmemdup(arena, hostinfo + v6_offset1,
+                                         s - hostinfo - v6_offset2);
         ++s;
-        uptr->port_str = malloc(uri - s + 1);
-        memset(uptr->port_str, 0, uri - s + 1);
-        memcpy(uptr->port_str, s, uri - s);
+        uptr->port_str = arena_strmemdup(arena, s, uri - s);
         if (uri != s) {
             port = strtol(uptr->port_str, &endstr, 10);
             uptr->port = port;
@@ -260,18 +249,12 @@ deal_with_host:
     /* first colon delimits username:password */
     s1 = memchr(hostinfo, ':', s - hostinfo);
     if (s1) {
-        uptr->user = malloc(s1 - hostinfo + 1);
-        memset(uptr->user, 0, s1 - hostinfo + 1);
-        memcpy(uptr->user, hostinfo, s1 - hostinfo);
+        uptr->user = arena_strmemdup(arena, hostinfo, s1 - hostinfo);
         ++s1;
-        uptr->password = malloc(s - s1 + 1);
-        memset(uptr->password, 0, s - s1 + 1);
-        memcpy(uptr->password, s1, s - s1);
+        uptr->password = arena_strmemdup(arena, s1, s - s1);
     }
     else {
-        uptr->user = malloc(s - hostinfo + 1);
-        memset(uptr->user, 0, s - hostinfo + 1);
-        memcpy(uptr->user, hostinfo, s - hostinfo);
+        uptr->user = arena_strmemdup(arena, hostinfo, s - hostinfo);
     }
     hostinfo = s + 1;
     goto deal_with_host;
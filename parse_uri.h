@@ -40,6 +40,13 @@ struct uri {
     short port;
 };
 
-struct uri *parse_uri(const char *uri);
+struct arena;
+
+/**
+ * Split a URI into its parts, which are allocated from the arena (like
+ * APR's pool) along with the struct itself.
+ * @returns NULL if the URI is malformed.
+ */
+struct uri *parse_uri(const char *uri, struct arena *arena);
 
 #endif /* __parse_uri_h */
@@ -0,0 +1,409 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file plethora-analyze.c
+ * @brief Offline analysis of plethora --trace files: latency
+ *        histograms, a time series and the slowest requests.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "metrics.h"
+#include "formats.h"
+#include "histogram.h"
+#include "trace.h"
+
+#define MAX_RESP_CODE 600
+#define READ_RECORDS 4096
+
+static const char *phase_names[N_PHASES] = {
+    "connect", "write", "first", "read", "close"
+};
+
+static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+#define N_PERCENTILES (int)(sizeof(percentiles) / sizeof(percentiles[0]))
+
+/* everything counted for one location, or for all of them */
+struct summary {
+    unsigned long long requests;
+    unsigned long long http_errors, socket_errors;
+    unsigned long long connect_timeouts, first_byte_timeouts;
+    unsigned long long request_timeouts;
+    unsigned long long invalid_bodies;
+    unsigned long long bytes;
+    unsigned long long codes[MAX_RESP_CODE];
+    uint64_t total[N_PHASES];
+    struct histogram hist[N_PHASES];
+};
+
+/* one step of the time series */
+struct bucket {
+    unsigned long long requests, errors, bytes;
+    struct histogram read;
+};
+
+static struct trace_header header;
+static char **urls;
+static struct summary totals;
+static struct summary *by_location;
+static struct bucket *buckets;
+static size_t n_buckets;
+static uint64_t bucket_ns = 1000000000ULL;
+static struct trace_record *slowest; /* sorted, slowest first */
+static int n_slowest, max_slowest = 10;
+static int include_warmup;
+static unsigned long long n_skipped;
+
+static void usage(FILE *stream, const char *progname)
+{
+    fprintf(stream, "Usage: %s [options] tracefile\n", progname);
+    fprintf(stream, " -h - this help screen\n");
+    fprintf(stream, " -i <seconds> - time series step (default 1)\n");
+    fprintf(stream, " -n <num> - number of slowest requests to list (default 10)\n");
+    fprintf(stream, " -a - include requests from the --warmup period\n");
+}
+
+/* the time from the start of the request that each phase is measured from */
+static uint64_t phase_base(const struct trace_record *rec)
+{
+    if ((header.flags & TRACE_FROM_CONNECT) && rec->connect)
+        return rec->connect;
+    return rec->epoch;
+}
+
+static uint64_t read_time(const struct trace_record *rec)
+{
+    return rec->read ? rec->read - phase_base(rec) : 0;
+}
+
+static void summarize(struct summary *s, const struct trace_record *rec)
+{
+    uint64_t base, stamps[N_PHASES];
+    int i;
+
+    switch (rec->error) {
+        case 0:
+            break;
+        case TRACE_INVALID_BODY:
+            s->invalid_bodies++;
+            break;
+        case TRACE_HTTP_ERROR:
+            s->http_errors++;
+            break;
+        case TRACE_CONNECT_TIMEOUT:
+            s->connect_timeouts++;
+            return;
+        case TRACE_FIRST_BYTE_TIMEOUT:
+            s->first_byte_timeouts++;
+            return;
+        case TRACE_REQUEST_TIMEOUT:
+            s->request_timeouts++;
+            return;
+        default:
+            s->socket_errors++;
+            return;
+    }
+    if (rec->resp_code < MAX_RESP_CODE)
+        s->codes[rec->resp_code]++;
+    if (rec->error == TRACE_HTTP_ERROR)
+        return;
+
+    s->requests++;
+    s->bytes += rec->responselen;
+    if (!rec->reused && rec->connect) {
+        s->total[PHASE(ME_CONNECT)] += rec->connect - rec->epoch;
+        histogram_record(&s->hist[PHASE(ME_CONNECT)],
+                         rec->connect - rec->epoch);
+    }
+    base = phase_base(rec);
+    stamps[PHASE(ME_WRITE)] = rec->write;
+    stamps[PHASE(ME_FIRST)] = rec->first;
+    stamps[PHASE(ME_READ)] = rec->read;
+    stamps[PHASE(ME_CLOSE)] = rec->close;
+    for (i = PHASE(ME_WRITE); i < N_PHASES; i++) {
+        if (stamps[i] < base)
+            continue; /* not measured, eg. a kept-alive socket's close */
+        s->total[i] += stamps[i] - base;
+        histogram_record(&s->hist[i], stamps[i] - base);
+    }
+}
+
+static void add_to_series(const struct trace_record *rec)
+{
+    size_t b = (rec->epoch - header.start) / bucket_ns;
+    if (rec->epoch < header.start)
+        b = 0;
+    if (b >= n_buckets) {
+        size_t n = n_buckets ? n_buckets : 64;
+        while (n <= b)
+            n *= 2;
+        buckets = realloc(buckets, n * sizeof(*buckets));
+        if (buckets == NULL) {
+            perror("realloc");
+            exit(-2);
+        }
+        memset(buckets + n_buckets, 0, (n - n_buckets) * sizeof(*buckets));
+        n_buckets = n;
+    }
+    if (rec->error && rec->error != TRACE_INVALID_BODY) {
+        buckets[b].errors++;
+        return;
+    }
+    buckets[b].requests++;
+    buckets[b].bytes += rec->responselen;
+    histogram_record(&buckets[b].read, read_time(rec));
+}
+
+static void add_to_slowest(const struct trace_record *rec)
+{
+    uint64_t t = read_time(rec);
+    int i;
+    if ((rec->error && rec->error != TRACE_INVALID_BODY) || max_slowest == 0)
+        return;
+    if (n_slowest == max_slowest && t <= read_time(&slowest[n_slowest - 1]))
+        return;
+    if (n_slowest < max_slowest)
+        n_slowest++;
+    for (i = n_slowest - 1; i > 0 && read_time(&slowest[i - 1]) < t; i--)
+        slowest[i] = slowest[i - 1];
+    slowest[i] = *rec;
+}
+
+static void analyze(const struct trace_record *rec)
+{
+    if (!include_warmup && rec->epoch < header.start + header.warmup) {
+        n_skipped++;
+        return;
+    }
+    summarize(&totals, rec);
+    if (rec->location < header.n_locations)
+        summarize(&by_location[rec->location], rec);
+    add_to_series(rec);
+    add_to_slowest(rec);
+}
+
+static void read_trace(FILE *f, const char *path)
+{
+    struct trace_record *recs;
+    size_t n, i;
+    uint32_t len;
+
+    if (fread(&header, sizeof(header), 1, f) != 1
+        || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s: not a plethora trace file\n", path);
+        exit(-1);
+    }
+    if (header.version != TRACE_VERSION
+        || header.record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s: unsupported trace version %u (record size %u)\n",
+                path, header.version, header.record_size);
+        exit(-1);
+    }
+    urls = calloc(header.n_locations, sizeof(*urls));
+    by_location = calloc(header.n_locations, sizeof(*by_location));
+    recs = malloc(READ_RECORDS * sizeof(*recs));
+    slowest = malloc((max_slowest + 1) * sizeof(*slowest));
+    if (!urls || !by_location || !recs || !slowest) {
+        perror("malloc");
+        exit(-2);
+    }
+    for (i = 0; i < header.n_locations; i++) {
+        if (fread(&len, sizeof(len), 1, f) != 1
+            || (urls[i] = malloc(len + 1)) == NULL
+            || fread(urls[i], 1, len, f) != len) {
+            fprintf(stderr, "%s: truncated trace header\n", path);
+            exit(-1);
+        }
+        urls[i][len] = '\0';
+    }
+    while ((n = fread(recs, sizeof(*recs), READ_RECORDS, f)) > 0)
+        for (i = 0; i < n; i++)
+            analyze(&recs[i]);
+    if (ferror(f)) {
+        perror(path);
+        exit(-1);
+    }
+    free(recs);
+}
+
+static void print_summary(FILE *stream, struct summary *s)
+{
+    char buf[BUFSIZ];
+    int i, p;
+
+    fprintf(stream, " %llu requests, %llu HTTP errors, %llu socket errors\n",
+            s->requests, s->http_errors, s->socket_errors);
+    if (s->connect_timeouts || s->first_byte_timeouts || s->request_timeouts)
+        fprintf(stream, " Timeouts: %llu connect, %llu first byte,"
+                " %llu total\n", s->connect_timeouts,
+                s->first_byte_timeouts, s->request_timeouts);
+    if (s->invalid_bodies)
+        fprintf(stream, " Unexpected bodies (--validate): %llu\n",
+                s->invalid_bodies);
+    fprintf(stream, " Status codes:");
+    for (i = 0; i < MAX_RESP_CODE; i++)
+        if (s->codes[i])
+            fprintf(stream, " %d x %llu", i, s->codes[i]);
+    (void)format_bytes(buf, sizeof(buf), s->bytes);
+    fprintf(stream, "\n Data received: %s\n", buf);
+    fprintf(stream, " Latency:  type\t\t mean\t\t p50\t\t p90\t\t p99"
+            "\t\t p99.9\t\t max\n");
+    for (i = 0; i < N_PHASES; i++) {
+        struct histogram *h = &s->hist[i];
+        if (h->count == 0) {
+            fprintf(stream, "          %s%s\t(none measured)\n",
+                    phase_names[i], strlen(phase_names[i]) <= 5 ? "\t" : "");
+            continue;
+        }
+        (void)format_ns(buf, sizeof(buf), s->total[i] / h->count);
+        fprintf(stream, "          %s%s\t%s", phase_names[i],
+                strlen(phase_names[i]) <= 5 ? "\t" : "", buf);
+        for (p = 0; p < N_PERCENTILES; p++) {
+            (void)format_ns(buf, sizeof(buf),
+                            histogram_percentile(h, percentiles[p]));
+            fprintf(stream, "\t%s", buf);
+        }
+        (void)format_ns(buf, sizeof(buf), h->max);
+        fprintf(stream, "\t%s\n", buf);
+    }
+}
+
+static void print_series(FILE *stream)
+{
+    char p50[BUFSIZ], p99[BUFSIZ], max[BUFSIZ], bytes[BUFSIZ];
+    double secs = bucket_ns / 1000000000.0;
+    size_t b, last = 0;
+
+    for (b = 0; b < n_buckets; b++)
+        if (buckets[b].requests || buckets[b].errors)
+            last = b + 1;
+    fprintf(stream, "--- TIME SERIES (every %.3lfs):\n", secs);
+    fprintf(stream, "     time\t    req/s\t  err/s\t   bytes/s"
+            "\tread p50\t     p99\t     max\n");
+    for (b = 0; b < last; b++) {
+        struct bucket *k = &buckets[b];
+        (void)format_ns(p50, sizeof(p50), histogram_percentile(&k->read, 50.0));
+        (void)format_ns(p99, sizeof(p99), histogram_percentile(&k->read, 99.0));
+        (void)format_ns(max, sizeof(max), k->read.max);
+        (void)format_double_bytes(bytes, sizeof(bytes), k->bytes / secs);
+        fprintf(stream, " %7.1lfs\t%9.1lf\t%7.1lf\t%8s/s\t%s\t%s\t%s\n",
+                b * secs, k->requests / secs, k->errors / secs, bytes,
+                p50, p99, max);
+    }
+}
+
+static void print_slowest(FILE *stream)
+{
+    char at[BUFSIZ], c[BUFSIZ], w[BUFSIZ], f[BUFSIZ], r[BUFSIZ];
+    int i;
+
+    fprintf(stream, "--- SLOWEST %d REQUESTS (by read time):\n", n_slowest);
+    fprintf(stream, "       at\t connect\t   write\t   first\t    read"
+            "\tcode\t   bytes\tthread\turl\n");
+    for (i = 0; i < n_slowest; i++) {
+        struct trace_record *rec = &slowest[i];
+        uint64_t base = phase_base(rec);
+        (void)format_ns(at, sizeof(at), rec->epoch - header.start);
+        (void)format_ns(c, sizeof(c), rec->reused || !rec->connect
+                        ? 0 : rec->connect - rec->epoch);
+        (void)format_ns(w, sizeof(w), rec->write - base);
+        (void)format_ns(f, sizeof(f), rec->first - base);
+        (void)format_ns(r, sizeof(r), rec->read - base);
+        fprintf(stream, " %s\t%s\t%s\t%s\t%s\t%4u\t%8llu\t%6u\t%s\n",
+                at, c, w, f, r, rec->resp_code,
+                (unsigned long long)rec->responselen, rec->thread,
+                rec->location < header.n_locations
+                ? urls[rec->location] : "?");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *progname = argv[0];
+    FILE *f;
+    double secs;
+    uint32_t i;
+    int c;
+
+    while ((c = getopt(argc, argv, "i:n:ah")) != -1) {
+        switch (c) {
+            case 'i':
+                secs = atof(optarg);
+                if (secs < 0.001) {
+                    fprintf(stderr, "invalid time series step (-i): %s\n",
+                            optarg);
+                    usage(stderr, progname);
+                    exit(-1);
+                }
+                bucket_ns = (uint64_t)(secs * 1000000000.0);
+                break;
+            case 'n':
+                max_slowest = atoi(optarg);
+                if (max_slowest < 0) {
+                    fprintf(stderr, "invalid number of requests (-n): %s\n",
+                            optarg);
+                    usage(stderr, progname);
+                    exit(-1);
+                }
+                break;
+            case 'a':
+                include_warmup = 1;
+                break;
+            case 'h':
+            default:
+                usage(stderr, progname);
+                exit(-1);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(stderr, progname);
+        exit(-1);
+    }
+    if ((f = fopen(argv[optind], "rb")) == NULL) {
+        perror(argv[optind]);
+        exit(-1);
+    }
+    read_trace(f, argv[optind]);
+    fclose(f);
+
+    if (n_skipped)
+        printf("Skipped %llu requests started during the warm-up period\n\n",
+               n_skipped);
+    if (header.n_locations > 1) {
+        for (i = 0; i < header.n_locations; i++) {
+            printf("Statistics for URL %u: %s\n", i + 1, urls[i]);
+            print_summary(stdout, &by_location[i]);
+            printf("\n");
+        }
+    }
+    printf("--- TOTALS:\n");
+    print_summary(stdout, &totals);
+    printf("\n");
+    print_series(stdout);
+    printf("\n");
+    print_slowest(stdout);
+    return 0;
+}
@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <signal.h>
 #include <event.h>
 
 #include "params.h"
@@ -38,25 +39,34 @@ int main(int argc, char *argv[])
 {
     int rc = 0;
 
-    event_init();
-
     parse_args(argc, argv);
 
-    if (config_opts.verbose > 0)
+    /* falls back to CLOCK_MONOTONIC by itself if the TSC won't do */
+    (void)initialize_clock(config_opts.tsc);
+
+    /* kept-alive connections may be closed by the server at any time,
+     * we want to see EPIPE from write() rather than be killed */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (config_opts.verbose > 0 && config_opts.output == OUTPUT_TEXT)
         print_config_opts(stdout);
 
     initialize_balancer();
     initialize_dispatcher();
 
     /* it doesn't make any connections before this call */
-    rc = event_dispatch();
+    rc = run_dispatcher();
     if (rc < 0)
-        perror("event_dispatch");
-    else if (config_opts.verbose > 2)
+        fprintf(stderr, "dispatcher failed\n");
+    else if (config_opts.verbose > 2 && config_opts.output == OUTPUT_TEXT)
         printf("done\n");
 
-    balancer_display(stdout);
-    dispatcher_display(stdout);
+    if (config_opts.output == OUTPUT_TEXT) {
+        balancer_display(stdout);
+        dispatcher_display(stdout);
+    } else {
+        report_results(stdout, 1);
+    }
 
     return 0;
 }
@@ -0,0 +1,217 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file report.c
+ * @brief Machine-readable (JSON and CSV) result output.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "report.h"
+
+int parse_output_format(const char *str, enum output_format *format)
+{
+    if (strcmp(str, "text") == 0)
+        *format = OUTPUT_TEXT;
+    else if (strcmp(str, "json") == 0)
+        *format = OUTPUT_JSON;
+    else if (strcmp(str, "csv") == 0)
+        *format = OUTPUT_CSV;
+    else
+        return -1;
+    return 0;
+}
+
+static void json_string(FILE *stream, const char *s)
+{
+    fputc('"', stream);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(stream, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(stream, "\\u%04x", *s);
+        else
+            fputc(*s, stream);
+    }
+    fputc('"', stream);
+}
+
+static void csv_string(FILE *stream, const char *s)
+{
+    if (strpbrk(s, ",\"\r\n") == NULL) {
+        fputs(s, stream);
+        return;
+    }
+    fputc('"', stream);
+    for (; *s; s++) {
+        if (*s == '"')
+            fputc('"', stream);
+        fputc(*s, stream);
+    }
+    fputc('"', stream);
+}
+
+/**
+ * Add the next path component for a value or object and, for JSON,
+ * write out whatever has to come before it.
+ */
+static void push_name(struct report *r, const char *name)
+{
+    char num[32];
+    size_t len = r->pathlen[r->depth];
+    if (r->format == OUTPUT_JSON) {
+        if (r->count[r->depth] > 0)
+            fputc(',', r->stream);
+        if (name && !r->is_list[r->depth]) {
+            json_string(r->stream, name);
+            fputc(':', r->stream);
+        }
+    } else {
+        if (r->is_list[r->depth] || name == NULL) {
+            snprintf(num, sizeof(num), "%d", r->count[r->depth] + 1);
+            name = num;
+        }
+        snprintf(r->path + len, sizeof(r->path) - len, "%s%s",
+                 len ? "." : "", name);
+    }
+    r->count[r->depth]++;
+}
+
+/* start a CSV row for the value just named */
+static void csv_row(struct report *r)
+{
+    csv_string(r->stream, r->path);
+    fputc(',', r->stream);
+    r->path[r->pathlen[r->depth]] = '\0';
+}
+
+static void nest(struct report *r, const char *name, int list)
+{
+    push_name(r, name);
+    if (r->depth + 1 >= REPORT_MAX_DEPTH) {
+        fprintf(stderr, "report nested too deeply, internal error!\n");
+        return;
+    }
+    r->depth++;
+    r->count[r->depth] = 0;
+    r->is_list[r->depth] = list;
+    r->pathlen[r->depth] = strlen(r->path);
+    if (r->format == OUTPUT_JSON)
+        fputc(list ? '[' : '{', r->stream);
+}
+
+static void unnest(struct report *r)
+{
+    if (r->format == OUTPUT_JSON)
+        fputc(r->is_list[r->depth] ? ']' : '}', r->stream);
+    r->depth--;
+    r->path[r->pathlen[r->depth]] = '\0';
+}
+
+void report_open(struct report *r, FILE *stream, enum output_format format)
+{
+    memset(r, 0, sizeof(*r));
+    r->stream = stream;
+    r->format = format;
+    if (format == OUTPUT_JSON)
+        fputc('{', stream);
+    else
+        fprintf(stream, "metric,value\n");
+}
+
+void report_close(struct report *r)
+{
+    if (r->format == OUTPUT_JSON)
+        fputc('}', r->stream);
+    fputc('\n', r->stream);
+    fflush(r->stream);
+}
+
+void report_begin(struct report *r, const char *name)
+{
+    nest(r, name, 0);
+}
+
+void report_end(struct report *r)
+{
+    unnest(r);
+}
+
+void report_begin_list(struct report *r, const char *name)
+{
+    nest(r, name, 1);
+}
+
+void report_end_list(struct report *r)
+{
+    unnest(r);
+}
+
+void report_int(struct report *r, const char *name, long long value)
+{
+    push_name(r, name);
+    if (r->format == OUTPUT_CSV)
+        csv_row(r);
+    fprintf(r->stream, "%lld", value);
+    if (r->format == OUTPUT_CSV)
+        fputc('\n', r->stream);
+}
+
+void report_uint(struct report *r, const char *name, uint64_t value)
+{
+    push_name(r, name);
+    if (r->format == OUTPUT_CSV)
+        csv_row(r);
+    fprintf(r->stream, "%" PRIu64, value);
+    if (r->format == OUTPUT_CSV)
+        fputc('\n', r->stream);
+}
+
+void report_double(struct report *r, const char *name, double value)
+{
+    push_name(r, name);
+    if (r->format == OUTPUT_CSV)
+        csv_row(r);
+    fprintf(r->stream, "%.3lf", value);
+    if (r->format == OUTPUT_CSV)
+        fputc('\n', r->stream);
+}
+
+void report_string(struct report *r, const char *name, const char *value)
+{
+    push_name(r, name);
+    if (r->format == OUTPUT_CSV) {
+        csv_row(r);
+        csv_string(r->stream, value);
+        fputc('\n', r->stream);
+    } else {
+        json_string(r->stream, value);
+    }
+}
+
+void report_bool(struct report *r, const char *name, int value)
+{
+    push_name(r, name);
+    if (r->format == OUTPUT_CSV)
+        csv_row(r);
+    fputs(value ? "true" : "false", r->stream);
+    if (r->format == OUTPUT_CSV)
+        fputc('\n', r->stream);
+}
@@ -0,0 +1,81 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file report.h
+ * @brief Machine-readable (JSON and CSV) result output.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#ifndef __report_h
+#define __report_h
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum output_format {
+    OUTPUT_TEXT = 0,    /* the usual tables, not handled here */
+    OUTPUT_JSON,
+    OUTPUT_CSV,
+};
+
+#define REPORT_MAX_DEPTH 8
+
+/**
+ * A report is a tree of named objects, lists and values. As JSON it is
+ * written out as exactly that. As CSV every value becomes a
+ * "metric,value" row, named by its path through the tree, eg.
+ * "totals.phases.read.p99_ns,1234567". List elements are numbered from 1.
+ * Times are always integer nanoseconds and sizes integer bytes.
+ */
+struct report {
+    FILE *stream;
+    enum output_format format;
+    int depth;
+    int count[REPORT_MAX_DEPTH]; /* things written so far at each depth */
+    int is_list[REPORT_MAX_DEPTH];
+    char path[BUFSIZ]; /* CSV: where we are in the tree */
+    size_t pathlen[REPORT_MAX_DEPTH];
+};
+
+void report_open(struct report *r, FILE *stream, enum output_format format);
+void report_close(struct report *r);
+
+/**
+ * Start a named object, or an unnamed one (name NULL) inside a list.
+ */
+void report_begin(struct report *r, const char *name);
+void report_end(struct report *r);
+
+void report_begin_list(struct report *r, const char *name);
+void report_end_list(struct report *r);
+
+void report_int(struct report *r, const char *name, long long value);
+void report_uint(struct report *r, const char *name, uint64_t value);
+void report_double(struct report *r, const char *name, double value);
+void report_string(struct report *r, const char *name, const char *value);
+void report_bool(struct report *r, const char *name, int value);
+
+/**
+ * Parse "text", "json" or "csv".
+ * @returns -1 if it's none of those.
+ */
+int parse_output_format(const char *str, enum output_format *format);
+
+#endif /* __report_h */
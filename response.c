@@ -0,0 +1,349 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file response.c
+ * @brief HTTP response header parsing and body framing routines.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "response.h"
+#include "crc32c.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_SCAN 1
+#endif
+
+#define HEADER_IS(line, len, name) \
+    ((len) == sizeof(name) - 1 && strncasecmp((line), (name), (len)) == 0)
+
+static const char *record_names[MAX_RECORD_HEADERS];
+static size_t record_lens[MAX_RECORD_HEADERS];
+static int n_record = 0;
+
+int response_record_header(const char *name)
+{
+    if (n_record >= MAX_RECORD_HEADERS)
+        return -1;
+    record_names[n_record] = name;
+    record_lens[n_record] = strlen(name);
+    return n_record++;
+}
+
+/**
+ * Case-insensitive search for token within a header value.
+ */
+static int value_has(const char *value, size_t len, const char *token)
+{
+    size_t tlen = strlen(token);
+    for (; len >= tlen; value++, len--)
+        if (strncasecmp(value, token, tlen) == 0)
+            return 1;
+    return 0;
+}
+
+/**
+ * Look at a single "name: value" header line.
+ */
+static void parse_header_line(struct response *resp, const char *name,
+                              size_t namelen, const char *value,
+                              size_t valuelen)
+{
+    int i;
+    if (HEADER_IS(name, namelen, "Content-Length")) {
+        /* the line always ends in a \n, so strtoll() can't run off */
+        resp->content_length = strtoll(value, NULL, 10);
+    } else if (HEADER_IS(name, namelen, "Transfer-Encoding")) {
+        if (value_has(value, valuelen, "chunked"))
+            resp->chunked = 1;
+    } else if (HEADER_IS(name, namelen, "Connection")) {
+        if (value_has(value, valuelen, "close"))
+            resp->close = 1;
+        else if (value_has(value, valuelen, "keep-alive"))
+            resp->close = 0;
+    }
+    for (i = 0; i < n_record; i++) {
+        if (namelen == record_lens[i]
+            && strncasecmp(name, record_names[i], namelen) == 0) {
+            resp->recorded[i] = value;
+            resp->recorded_len[i] = valuelen;
+        }
+    }
+}
+
+/**
+ * Parse "HTTP/x.y nnn reason", which has been \0-terminated.
+ * @returns -1 if it isn't a status line.
+ */
+static int parse_status_line(struct response *resp, char *line)
+{
+    char *p = line;
+    int major, minor = 0, code = 0, i;
+
+    if (strncmp(p, "HTTP/", 5) != 0 || *(p += 5) < '0' || *p > '9')
+        return -1;
+    for (major = 0; *p >= '0' && *p <= '9'; p++)
+        major = major * 10 + *p - '0';
+    if (*p == '.' && p[1] >= '0' && p[1] <= '9')
+        for (p++; *p >= '0' && *p <= '9'; p++)
+            minor = minor * 10 + *p - '0';
+    if (*p != ' ')
+        return -1;
+    while (*p == ' ')
+        p++;
+    for (i = 0; i < 3; i++, p++) {
+        if (*p < '0' || *p > '9')
+            return -1;
+        code = code * 10 + *p - '0';
+    }
+    if (*p != ' ' && *p != '\0')
+        return -1;
+    while (*p == ' ')
+        p++;
+    resp->http_version = major + minor / 10.0;
+    resp->resp_code = code;
+    strncpy(resp->resp_str, p, sizeof(resp->resp_str) - 1);
+    return 0;
+}
+
+/**
+ * The header is complete, work out how the body is framed.
+ */
+static void header_done(struct response *resp)
+{
+    if (resp->resp_code == 101) {
+        resp->bstate = BODY_DONE;
+        resp->close = 1; /* it isn't talking HTTP any more */
+    } else if (resp->head || resp->resp_code == 204
+               || resp->resp_code == 304) {
+        resp->bstate = BODY_DONE; /* these never have a body */
+    } else if (resp->chunked) {
+        resp->bstate = BODY_CHUNK_SIZE;
+        resp->remaining = 0;
+    } else if (resp->content_length >= 0) {
+        resp->remaining = resp->content_length;
+        resp->bstate = resp->remaining ? BODY_LENGTH : BODY_DONE;
+    } else {
+        resp->bstate = BODY_EOF;
+        resp->close = 1; /* no way to tell where the next response starts */
+    }
+}
+
+/**
+ * Deal with the '\n' or ':' at buf[i].
+ * @returns the length of the header if this was the end of it, 0 if
+ *          not, or -1 if it's malformed.
+ */
+static ssize_t header_char(struct response *resp, char *buf, size_t i)
+{
+    size_t end, value;
+
+    if (buf[i] == ':') {
+        /* the first one on each line, and never in the status line */
+        if (resp->colon == 0 && resp->line > resp->status)
+            resp->colon = i;
+        return 0;
+    }
+
+    /* a line ends at the \n, or the \r before it */
+    end = i > resp->line && buf[i - 1] == '\r' ? i - 1 : i;
+    if (resp->line == resp->status) {
+        char c = buf[end];
+        int rv;
+        buf[end] = '\0';
+        rv = parse_status_line(resp, buf + resp->status);
+        buf[end] = c;
+        if (rv < 0)
+            return -1;
+        resp->content_length = -1;
+        resp->chunked = 0;
+        resp->body_bytes = 0;
+        resp->crc = CRC32C_INIT;
+        /* HTTP/1.0 connections are only persistent if the server says so */
+        resp->close = resp->http_version < 1.1;
+    } else if (end == resp->line && resp->resp_code >= 100
+               && resp->resp_code <= 199 && resp->resp_code != 101) {
+        /* an interim response (eg. 100 Continue), the real one follows */
+        resp->status = i + 1;
+        memset(resp->recorded, 0, sizeof(resp->recorded));
+        memset(resp->recorded_len, 0, sizeof(resp->recorded_len));
+    } else if (end == resp->line) {
+        header_done(resp);
+        return i + 1;
+    } else if (resp->colon > resp->line) {
+        for (value = resp->colon + 1;
+             value < end && (buf[value] == ' ' || buf[value] == '\t');
+             value++)
+            ; /* consume whitespace */
+        parse_header_line(resp, buf + resp->line, resp->colon - resp->line,
+                          buf + value, end - value);
+    }
+    /* anything else is a garbage line, ignore it */
+    resp->line = i + 1;
+    resp->colon = 0;
+    return 0;
+}
+
+ssize_t parse_response_header(struct response *resp, char *buf, size_t len)
+{
+    size_t i = resp->hscan;
+    ssize_t rv;
+
+#ifdef HAVE_SSE2_SCAN
+    {
+        const __m128i lf = _mm_set1_epi8('\n');
+        const __m128i colon = _mm_set1_epi8(':');
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+            unsigned mask = _mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(v, lf),
+                             _mm_cmpeq_epi8(v, colon)));
+            while (mask) {
+                size_t at = i + __builtin_ctz(mask);
+                mask &= mask - 1;
+                if ((rv = header_char(resp, buf, at)) != 0)
+                    return rv;
+            }
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (buf[i] == '\n' || buf[i] == ':') {
+            if ((rv = header_char(resp, buf, i)) != 0)
+                return rv;
+        }
+    }
+    resp->hscan = len;
+    return 0;
+}
+
+static int hexval(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static void body_data(struct response *resp, const char *p, size_t len)
+{
+    resp->body_bytes += len;
+    if (resp->validate)
+        resp->crc = crc32c_update(resp->crc, p, len);
+}
+
+ssize_t consume_body(struct response *resp, const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len;
+
+    while (p < end) {
+        switch (resp->bstate) {
+            case BODY_EOF:
+                body_data(resp, p, end - p);
+                return len;
+            case BODY_LENGTH:
+            case BODY_CHUNK_DATA:
+                if (resp->remaining > (unsigned long long)(end - p)) {
+                    resp->remaining -= end - p;
+                    body_data(resp, p, end - p);
+                    return len;
+                }
+                body_data(resp, p, resp->remaining);
+                p += resp->remaining;
+                resp->remaining = 0;
+                resp->bstate = resp->bstate == BODY_LENGTH
+                               ? BODY_DONE : BODY_CHUNK_DATA_END;
+                break;
+            case BODY_CHUNK_SIZE:
+                if (hexval(*p) >= 0) {
+                    resp->remaining = (resp->remaining << 4) | hexval(*p);
+                } else if (*p == '\n') {
+                    resp->bstate = resp->remaining ? BODY_CHUNK_DATA
+                                                   : BODY_CHUNK_TRAILER;
+                } else if (*p == ';' || *p == ' ' || *p == '\t'
+                           || *p == '\r') {
+                    resp->bstate = BODY_CHUNK_EXT;
+                } else {
+                    return -1;
+                }
+                p++;
+                break;
+            case BODY_CHUNK_EXT:
+                if (*p++ == '\n')
+                    resp->bstate = resp->remaining ? BODY_CHUNK_DATA
+                                                   : BODY_CHUNK_TRAILER;
+                break;
+            case BODY_CHUNK_DATA_END:
+                if (*p++ == '\n')
+                    resp->bstate = BODY_CHUNK_SIZE;
+                break;
+            case BODY_CHUNK_TRAILER:
+                if (*p == '\r')
+                    resp->bstate = BODY_CHUNK_TRAILER_END;
+                else if (*p == '\n')
+                    resp->bstate = BODY_DONE;
+                else
+                    resp->bstate = BODY_CHUNK_TRAILER_LINE;
+                p++;
+                break;
+            case BODY_CHUNK_TRAILER_LINE:
+                if (*p++ == '\n')
+                    resp->bstate = BODY_CHUNK_TRAILER;
+                break;
+            case BODY_CHUNK_TRAILER_END:
+                resp->bstate = *p++ == '\n' ? BODY_DONE
+                                            : BODY_CHUNK_TRAILER_LINE;
+                break;
+            case BODY_DONE:
+                return p - buf;
+        }
+    }
+    return p - buf;
+}
+
+size_t body_skippable(const struct response *resp, size_t max)
+{
+    switch (resp->bstate) {
+        case BODY_EOF:
+            return max;
+        case BODY_LENGTH:
+        case BODY_CHUNK_DATA:
+            return resp->remaining < max ? resp->remaining : max;
+        default:
+            return 0;
+    }
+}
+
+void skip_body(struct response *resp, size_t len)
+{
+    resp->body_bytes += len;
+    if (resp->bstate == BODY_EOF)
+        return;
+    resp->remaining -= len;
+    if (resp->remaining == 0)
+        resp->bstate = resp->bstate == BODY_LENGTH
+                       ? BODY_DONE : BODY_CHUNK_DATA_END;
+}
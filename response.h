@@ -0,0 +1,133 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file response.h
+ * @brief HTTP response header parsing and body framing routines.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#ifndef __response_h
+#define __response_h
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <stdint.h>
+
+enum body_state {
+    BODY_EOF = 0,           /* body is delimited by the server closing */
+    BODY_LENGTH,            /* body is delimited by Content-Length */
+    BODY_CHUNK_SIZE,        /* reading a chunk-size line */
+    BODY_CHUNK_EXT,         /* skipping chunk extensions up to the LF */
+    BODY_CHUNK_DATA,        /* reading chunk data */
+    BODY_CHUNK_DATA_END,    /* skipping the CRLF after chunk data */
+    BODY_CHUNK_TRAILER,     /* at the start of a trailer line */
+    BODY_CHUNK_TRAILER_LINE,/* skipping a non-empty trailer line */
+    BODY_CHUNK_TRAILER_END, /* got the CR of the final empty line */
+    BODY_DONE,
+};
+
+/* the reason phrase is cut short to this, including the \0 */
+#define MAX_RESP_STR 64
+
+/* headers that can be picked out with response_record_header() */
+#define MAX_RECORD_HEADERS 8
+
+struct response {
+    float http_version;
+    unsigned int resp_code; /* response code */
+    char resp_str[MAX_RESP_STR]; /* response string, copied out of the
+                             * buffer so it outlives it */
+    long long content_length; /* -1 if no Content-Length was sent */
+    int chunked;            /* set for Transfer-Encoding: chunked */
+    int close;              /* set if the connection can't be reused */
+
+    enum body_state bstate;
+    unsigned long long remaining; /* bytes left in the body or chunk */
+
+    unsigned long long body_bytes; /* body so far, without chunk framing */
+    int validate;           /* set by the caller to checksum the body */
+    int head;               /* set by the caller for a HEAD request, whose
+                             * response has no body whatever it says */
+    uint32_t crc;           /* running CRC32C of the body, if validating */
+
+    /* values of the response_record_header() headers, NULL if not sent.
+     * They point into the buffer, so are only good until it is reused. */
+    const char *recorded[MAX_RECORD_HEADERS];
+    size_t recorded_len[MAX_RECORD_HEADERS];
+
+    /* where parse_response_header() has got to, all 0 to start with */
+    size_t hscan;           /* bytes of the header looked at so far */
+    size_t line;            /* start of the line being scanned */
+    size_t colon;           /* first ':' in that line, 0 if none yet */
+    size_t status;          /* start of the status line, past any interim
+                             * (1xx) responses */
+};
+
+/**
+ * Parse as much of the response header at the start of buf as has been
+ * read, len bytes. The struct must be zeroed before the first call for
+ * each response, and it remembers where it got to, so each byte is only
+ * looked at once however the header is split across reads. Lines are
+ * found 16 bytes at a time with SSE2 where available.
+ * The status line is briefly \0-terminated in place while it is parsed.
+ * @returns the length of the header including the final empty line,
+ *          0 if the header is not complete yet, or -1 if it is malformed.
+ */
+ssize_t parse_response_header(struct response *resp, char *buf, size_t len);
+
+/**
+ * Have parse_response_header() keep the value of this header in
+ * resp->recorded[] (at the returned index) for every response.
+ * Must be called before any responses are parsed.
+ * @returns the index, or -1 if there are already MAX_RECORD_HEADERS.
+ */
+int response_record_header(const char *name);
+
+/**
+ * Feed body bytes through the framing state machine. The body itself
+ * (without any chunk framing) is counted in body_bytes and, if validate
+ * is set, added to the CRC32C in crc.
+ * @returns the number of bytes belonging to this response's body (any
+ *          bytes beyond that belong to whatever the server sent next),
+ *          or -1 if the chunked encoding is malformed.
+ */
+ssize_t consume_body(struct response *resp, const char *buf, size_t len);
+
+/**
+ * Account for len body bytes that were thrown away unread. Only valid in
+ * the states where the bytes themselves don't matter, see
+ * body_skippable(): any amount for BODY_EOF, otherwise no more than
+ * resp->remaining.
+ */
+void skip_body(struct response *resp, size_t len);
+
+/**
+ * How many of the next body bytes can be thrown away unread, or 0 if
+ * they have to go through consume_body(). Unlimited bodies (BODY_EOF)
+ * return max.
+ */
+size_t body_skippable(const struct response *resp, size_t max);
+
+/**
+ * True once the whole body has been consumed. Bodies delimited by EOF
+ * are never done, the caller has to wait for the server to close.
+ */
+#define response_done(resp) ((resp)->bstate == BODY_DONE)
+
+#endif /* __response_h */
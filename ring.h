@@ -77,5 +77,19 @@
         } \
     } while (0);
 
+/* Remove nodeptr from wherever it is in the ring */
+#define RING_REMOVE(headptr, nodeptr) \
+    do { \
+        if (nodeptr->next == nodeptr) { /* last node */ \
+            headptr = NULL; \
+        } else { \
+            if (headptr == nodeptr) \
+                headptr = nodeptr->next; \
+            nodeptr->prev->next = nodeptr->next; \
+            nodeptr->next->prev = nodeptr->prev; \
+        } \
+        nodeptr->next = nodeptr->prev = NULL; \
+    } while (0);
+
 #endif /* __ring_h */
 
@@ -0,0 +1,313 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file template.c
+ * @brief Requests with placeholders (--template) that are filled in
+ *        differently for each request, and sent as iovecs of the fixed
+ *        text and the values in between.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "template.h"
+#include "arena.h"
+
+/* the errno for a --csv file with nothing in it, ENODATA isn't everywhere */
+#ifdef ENODATA
+#define NO_ROWS ENODATA
+#else
+#define NO_ROWS EINVAL
+#endif
+
+enum part_kind {
+    PART_TEXT,
+    PART_SEQ,
+    PART_RAND,
+    PART_CSV,
+};
+
+struct template_part {
+    enum part_kind kind;
+    const char *text;       /* PART_TEXT, pointing into the request */
+    size_t len;
+    long long lo, hi;       /* PART_RAND */
+    int column;             /* PART_CSV, from 0 */
+};
+
+struct template {
+    int n_parts;
+    int n_vars;
+    struct template_part parts[1]; /* n_parts of them */
+};
+
+/* the --csv file, see template_load_csv() */
+struct csv_row {
+    const char *line;
+    size_t len;
+};
+
+static char *csv_file;
+static struct csv_row *csv_rows;
+static size_t n_csv_rows;
+
+int template_load_csv(const char *path)
+{
+    struct stat st;
+    char *p, *end, *eol;
+    size_t n = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        (void)close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        (void)close(fd);
+        errno = NO_ROWS;
+        return -1;
+    }
+    csv_file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    (void)close(fd);
+    if (csv_file == MAP_FAILED)
+        return -1;
+    end = csv_file + st.st_size;
+    for (p = csv_file; p < end; p = eol + 1) {
+        if ((eol = memchr(p, '\n', end - p)) == NULL)
+            eol = end;
+        n++;
+    }
+    csv_rows = malloc(n * sizeof(*csv_rows));
+    if (csv_rows == NULL)
+        return -1;
+    for (p = csv_file; p < end; p = eol + 1) {
+        size_t len;
+        if ((eol = memchr(p, '\n', end - p)) == NULL)
+            eol = end;
+        len = eol - p;
+        if (len > 0 && p[len - 1] == '\r')
+            len--;
+        if (len == 0)
+            continue;
+        csv_rows[n_csv_rows].line = p;
+        csv_rows[n_csv_rows++].len = len;
+    }
+    if (n_csv_rows == 0) {
+        errno = NO_ROWS;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Parse the placeholder at p (just past the '{'), up to end.
+ * @returns its length up to and including the '}', 0 if it isn't one.
+ */
+static size_t parse_placeholder(const char *p, const char *end,
+                                struct template_part *part)
+{
+    const char *close = memchr(p, '}', end - p);
+    char spec[64], *q;
+    size_t len;
+    if (close == NULL || (len = close - p) >= sizeof(spec))
+        return 0;
+    memcpy(spec, p, len);
+    spec[len] = '\0';
+    if (strcmp(spec, "seq") == 0) {
+        part->kind = PART_SEQ;
+    } else if (strncmp(spec, "rand:", 5) == 0) {
+        part->kind = PART_RAND;
+        part->lo = strtoll(spec + 5, &q, 10);
+        if (q == spec + 5 || *q != '-')
+            goto bad;
+        part->hi = strtoll(q + 1, &q, 10);
+        if (*q != '\0' || part->hi < part->lo)
+            goto bad;
+    } else if (strncmp(spec, "csv:", 4) == 0) {
+        part->kind = PART_CSV;
+        part->column = (int)strtol(spec + 4, &q, 10) - 1;
+        if (*q != '\0' || part->column < 0)
+            goto bad;
+        if (csv_rows == NULL) {
+            fprintf(stderr, "{%s} needs a --csv file\n", spec);
+            exit(-1);
+        }
+    } else {
+        return 0;
+    }
+    return len + 1;
+bad:
+    fprintf(stderr, "invalid placeholder (--template): {%s}\n", spec);
+    exit(-1);
+}
+
+struct template *template_compile(const char *text, size_t len,
+                                  struct arena *arena)
+{
+    struct template_part parts[2 * MAX_TEMPLATE_VARS + 1];
+    const char *p = text, *end = text + len, *brace;
+    struct template *t;
+    int n = 0, vars = 0;
+
+    while ((brace = memchr(p, '{', end - p)) != NULL) {
+        struct template_part var;
+        size_t used = parse_placeholder(brace + 1, end, &var);
+        if (used == 0) {
+            /* not one of ours, it stays part of the text */
+            if (n > 0 && parts[n - 1].kind == PART_TEXT
+                && parts[n - 1].text + parts[n - 1].len == p) {
+                parts[n - 1].len += brace + 1 - p;
+            } else {
+                parts[n].kind = PART_TEXT;
+                parts[n].text = p;
+                parts[n++].len = brace + 1 - p;
+            }
+            p = brace + 1;
+            continue;
+        }
+        if (vars == MAX_TEMPLATE_VARS) {
+            fprintf(stderr, "too many placeholders (--template), at most "
+                    "%d per request\n", MAX_TEMPLATE_VARS);
+            exit(-1);
+        }
+        if (brace > p) {
+            if (n > 0 && parts[n - 1].kind == PART_TEXT
+                && parts[n - 1].text + parts[n - 1].len == p) {
+                parts[n - 1].len += brace - p;
+            } else {
+                parts[n].kind = PART_TEXT;
+                parts[n].text = p;
+                parts[n++].len = brace - p;
+            }
+        }
+        parts[n++] = var;
+        vars++;
+        p = brace + 1 + used;
+    }
+    if (vars == 0)
+        return NULL;
+    if (p < end) {
+        if (parts[n - 1].kind == PART_TEXT
+            && parts[n - 1].text + parts[n - 1].len == p) {
+            parts[n - 1].len += end - p;
+        } else {
+            parts[n].kind = PART_TEXT;
+            parts[n].text = p;
+            parts[n++].len = end - p;
+        }
+    }
+    t = arena_alloc(arena, sizeof(*t) + (n - 1) * sizeof(parts[0]));
+    if (t == NULL) {
+        fprintf(stderr, "Unable to allocate templates, exiting\n");
+        exit(-2);
+    }
+    t->n_parts = n;
+    t->n_vars = vars;
+    memcpy(t->parts, parts, n * sizeof(parts[0]));
+    return t;
+}
+
+int template_vars(const struct template *t)
+{
+    return t->n_vars;
+}
+
+/**
+ * Write a number in decimal at the end of buf (TEMPLATE_NUMBER_LEN bytes).
+ * @returns where it starts.
+ */
+static char *format_number(long long value, char *buf)
+{
+    char *p = buf + TEMPLATE_NUMBER_LEN;
+    unsigned long long v = value < 0 ? -(unsigned long long)value : value;
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    if (value < 0)
+        *--p = '-';
+    return p;
+}
+
+/**
+ * Column n of a --csv row, empty if the row is short.
+ */
+static void csv_column(const struct csv_row *row, int n, struct iovec *iov)
+{
+    const char *p = row->line, *end = row->line + row->len, *comma;
+    for (; n > 0 && p <= end; n--) {
+        comma = memchr(p, ',', end - p);
+        p = comma ? comma + 1 : end + 1;
+    }
+    if (p > end) {
+        iov->iov_base = (void *)end;
+        iov->iov_len = 0;
+        return;
+    }
+    comma = memchr(p, ',', end - p);
+    iov->iov_base = (void *)p;
+    iov->iov_len = (comma ? comma : end) - p;
+}
+
+int template_expand(const struct template *t, uint64_t seq,
+                    unsigned short rand48[3], struct iovec *iov,
+                    char *scratch, size_t *len)
+{
+    int i;
+    size_t total = 0;
+    for (i = 0; i < t->n_parts; i++) {
+        const struct template_part *part = &t->parts[i];
+        char *p;
+        unsigned long long r;
+        switch (part->kind) {
+        case PART_TEXT:
+            iov[i].iov_base = (void *)part->text;
+            iov[i].iov_len = part->len;
+            break;
+        case PART_SEQ:
+            p = format_number((long long)seq, scratch);
+            goto number;
+        case PART_RAND:
+            r = ((unsigned long long)nrand48(rand48) << 31) | nrand48(rand48);
+            p = format_number(part->lo + (long long)(r % (unsigned long long)
+                                        (part->hi - part->lo + 1)), scratch);
+            goto number;
+        case PART_CSV:
+            csv_column(&csv_rows[(seq - 1) % n_csv_rows], part->column,
+                       &iov[i]);
+            break;
+        number:
+            iov[i].iov_base = p;
+            iov[i].iov_len = scratch + TEMPLATE_NUMBER_LEN - p;
+            scratch += TEMPLATE_NUMBER_LEN;
+            break;
+        }
+        total += iov[i].iov_len;
+    }
+    *len = total;
+    return t->n_parts;
+}
@@ -0,0 +1,76 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file template.h
+ * @brief Requests with placeholders (--template) that are filled in
+ *        differently for each request, and sent as iovecs of the fixed
+ *        text and the values in between.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#ifndef __template_h
+#define __template_h
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define MAX_TEMPLATE_VARS 16    /* placeholders in one request */
+#define TEMPLATE_NUMBER_LEN 24  /* bytes a {seq} or {rand} value can take */
+
+struct template;
+struct arena;
+
+/**
+ * Read the --csv file whose columns {csv:N} refers to. It is mapped
+ * copy-on-write and used where it lies: one row per line, blank lines
+ * ignored, columns split on commas (there is no quoting).
+ * @returns -1 with errno set if it can't be read.
+ */
+int template_load_csv(const char *path);
+
+/**
+ * Find the placeholders in a request:
+ *   {seq}         - the number of the request, counting from 1
+ *   {rand:lo-hi}  - a random integer from lo to hi inclusive
+ *   {csv:n}       - column n (from 1) of the next row of the --csv file,
+ *                   going round the rows in order
+ * Anything else in braces is left as it is.
+ * @returns NULL if there are none, exits on a malformed one.
+ */
+struct template *template_compile(const char *text, size_t len,
+                                  struct arena *arena);
+
+/**
+ * The number of placeholders in the template.
+ */
+int template_vars(const struct template *t);
+
+/**
+ * Point iov at request number seq: the fixed text and the values of the
+ * placeholders, numbers written into scratch (TEMPLATE_NUMBER_LEN bytes
+ * for each placeholder). Uses up to 2 * template_vars() + 1 iovecs.
+ * @returns the number of iovecs, with the total length in *len.
+ */
+int template_expand(const struct template *t, uint64_t seq,
+                    unsigned short rand48[3], struct iovec *iov,
+                    char *scratch, size_t *len);
+
+#endif /* __template_h */
@@ -0,0 +1,115 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file timer_wheel.c
+ * @brief Hashed timer wheel implementation.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h" /* for clock_ns() */
+#include "timer_wheel.h"
+
+/* slot number used for timers in wheel->firing */
+#define WHEEL_FIRING WHEEL_SLOTS
+
+void timer_wheel_init(struct timer_wheel *wheel, long tick_usec)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->tick_usec = tick_usec;
+    wheel->start = clock_ns();
+}
+
+void wheel_timer_init(struct wheel_timer *timer, wheel_callback callback,
+                      void *arg)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->slot = WHEEL_IDLE;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+static struct wheel_timer **slot_head(struct timer_wheel *wheel, int slot)
+{
+    return slot == WHEEL_FIRING ? &wheel->firing : &wheel->slots[slot];
+}
+
+void wheel_timer_del(struct timer_wheel *wheel, struct wheel_timer *timer)
+{
+    struct wheel_timer **head;
+    if (timer->slot == WHEEL_IDLE)
+        return;
+    head = slot_head(wheel, timer->slot);
+    RING_REMOVE((*head), timer);
+    timer->slot = WHEEL_IDLE;
+}
+
+void wheel_timer_add(struct timer_wheel *wheel, struct wheel_timer *timer,
+                     long long usec)
+{
+    wheel_timer_del(wheel, timer);
+    /* round up, and the tick in progress doesn't count */
+    timer->expires = wheel->now + 1
+                     + (usec + wheel->tick_usec - 1) / wheel->tick_usec;
+    timer->slot = (int)(timer->expires & (WHEEL_SLOTS - 1));
+    RING_APPEND(wheel->slots[timer->slot], timer);
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel)
+{
+    unsigned long long target, tick;
+
+    target = (clock_ns() - wheel->start) / 1000 / wheel->tick_usec;
+    if (target <= wheel->now)
+        return;
+
+    /* if we fell a whole turn behind, every slot gets looked at once */
+    tick = target - wheel->now > WHEEL_SLOTS ? target - WHEEL_SLOTS + 1
+                                             : wheel->now + 1;
+    /* timers added by the callbacks are relative to the new time */
+    wheel->now = target;
+
+    for (; tick <= target; tick++) {
+        int slot = (int)(tick & (WHEEL_SLOTS - 1));
+        struct wheel_timer *timer;
+
+        /* move the slot aside, so callbacks can safely add to it and
+         * delete from it */
+        wheel->firing = wheel->slots[slot];
+        wheel->slots[slot] = NULL;
+        if (wheel->firing) {
+            timer = wheel->firing;
+            do {
+                timer->slot = WHEEL_FIRING;
+                timer = timer->next;
+            } while (timer != wheel->firing);
+        }
+        for (timer = wheel->firing; timer; timer = wheel->firing) {
+            RING_POP(wheel->firing, timer);
+            if (timer->expires <= target) {
+                timer->slot = WHEEL_IDLE;
+                timer->callback(timer, timer->arg);
+            } else { /* due a later time around */
+                timer->slot = slot;
+                RING_APPEND(wheel->slots[slot], timer);
+            }
+        }
+    }
+}
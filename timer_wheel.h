@@ -0,0 +1,90 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file timer_wheel.h
+ * @brief Hashed timer wheel, for keeping a timeout on every connection
+ *        without a libevent timer for each one.
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#ifndef __timer_wheel_h
+#define __timer_wheel_h
+
+#include "config.h"
+
+#include <stdint.h>
+
+#include "ring.h"
+
+/* must be a power of two */
+#define WHEEL_SLOTS 1024
+
+/* slot of a timer that isn't scheduled */
+#define WHEEL_IDLE (-1)
+
+struct wheel_timer;
+
+typedef void (*wheel_callback)(struct wheel_timer *timer, void *arg);
+
+struct wheel_timer {
+    RING_T(struct wheel_timer);
+    unsigned long long expires; /* tick on which this fires */
+    int slot; /* WHEEL_IDLE, or where it is in the wheel */
+    wheel_callback callback;
+    void *arg;
+};
+
+/**
+ * Timers are hashed into slots by the tick they expire on. Each tick
+ * only the slot for that tick is looked at, timers in it that are due
+ * a later time around the wheel are left there.
+ */
+struct timer_wheel {
+    struct wheel_timer *slots[WHEEL_SLOTS];
+    struct wheel_timer *firing; /* the slot currently being processed */
+    uint64_t start; /* clock_ns() when the wheel was started */
+    long tick_usec;
+    unsigned long long now; /* the last tick processed */
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, long tick_usec);
+
+void wheel_timer_init(struct wheel_timer *timer, wheel_callback callback,
+                      void *arg);
+
+/**
+ * Schedule the timer to fire after at least usec microseconds, replacing
+ * any time it was already scheduled for. Constant time.
+ */
+void wheel_timer_add(struct timer_wheel *wheel, struct wheel_timer *timer,
+                     long long usec);
+
+/**
+ * Unschedule the timer, if it was scheduled. Constant time.
+ */
+void wheel_timer_del(struct timer_wheel *wheel, struct wheel_timer *timer);
+
+#define wheel_timer_pending(timer) ((timer)->slot != WHEEL_IDLE)
+
+/**
+ * Bring the wheel up to the current time, firing whatever timers came
+ * due since the last call. Callbacks may add and delete any timers.
+ */
+void timer_wheel_advance(struct timer_wheel *wheel);
+
+#endif /* __timer_wheel_h */
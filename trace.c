@@ -0,0 +1,252 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file trace.c
+ * @brief Binary per-request trace log (--trace).
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "params.h"
+#include "balancer.h"
+#include "trace.h"
+
+static int trace_fd = -1;
+static pthread_t writer;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+static struct trace_buffer *full_head, *full_tail; /* waiting to be written */
+static struct trace_buffer *free_list;
+static int n_buffers; /* allocated so far */
+static int closing;
+static int write_errno; /* set once a write has failed */
+static unsigned long long n_written, n_dropped;
+
+static int write_all(const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t rv = write(trace_fd, p, len);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += rv;
+        len -= rv;
+    }
+    return 0;
+}
+
+static void *trace_writer(void *arg)
+    /* input arg is ignored */
+{
+    struct trace_buffer *buf;
+    pthread_mutex_lock(&trace_lock);
+    while (1) {
+        while (full_head == NULL && !closing)
+            pthread_cond_wait(&trace_cond, &trace_lock);
+        if (full_head == NULL)
+            break;
+        buf = full_head;
+        full_head = buf->next;
+        if (full_head == NULL)
+            full_tail = NULL;
+        pthread_mutex_unlock(&trace_lock);
+
+        /* the dispatchers carry on while this blocks on the disk */
+        if (!write_errno) {
+            if (write_all(buf->records, buf->n * sizeof(buf->records[0])) < 0)
+                write_errno = errno;
+            else
+                n_written += buf->n;
+        }
+
+        pthread_mutex_lock(&trace_lock);
+        buf->n = 0;
+        buf->next = free_list;
+        free_list = buf;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return NULL;
+}
+
+int trace_open(const char *path, uint64_t start, uint64_t warmup,
+               uint32_t flags)
+{
+    struct trace_header hdr;
+    uint32_t i, n = balancer_locations();
+    char buf[65536]; /* the URLs are gathered up, there may be millions */
+    size_t used = 0;
+    int e;
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0)
+        return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(struct trace_record);
+    hdr.start = start;
+    hdr.warmup = warmup;
+    hdr.n_locations = n;
+    hdr.flags = flags;
+    if (write_all(&hdr, sizeof(hdr)) < 0)
+        goto failed;
+    for (i = 0; i < n; i++) {
+        const char *url = balancer_location_url(i);
+        uint32_t len = strlen(url);
+        if (used + sizeof(len) + len > sizeof(buf)) {
+            if (write_all(buf, used) < 0)
+                goto failed;
+            used = 0;
+        }
+        if (sizeof(len) + len > sizeof(buf)) {
+            if (write_all(&len, sizeof(len)) < 0 || write_all(url, len) < 0)
+                goto failed;
+            continue;
+        }
+        memcpy(buf + used, &len, sizeof(len));
+        memcpy(buf + used + sizeof(len), url, len);
+        used += sizeof(len) + len;
+    }
+    if (used > 0 && write_all(buf, used) < 0)
+        goto failed;
+
+    if ((e = pthread_create(&writer, NULL, trace_writer, NULL)) != 0) {
+        errno = e;
+        goto failed;
+    }
+    return 0;
+
+failed:
+    e = errno;
+    close(trace_fd);
+    trace_fd = -1;
+    errno = e;
+    return -1;
+}
+
+/**
+ * Hand a buffer to the writer. Must be called with trace_lock held.
+ */
+static void queue_buffer(struct trace_buffer *buf)
+{
+    buf->next = NULL;
+    if (full_tail)
+        full_tail->next = buf;
+    else
+        full_head = buf;
+    full_tail = buf;
+    pthread_cond_signal(&trace_cond);
+}
+
+/**
+ * Queue a full buffer for the writer and get an empty one in its place.
+ * Must be called with trace_lock held.
+ */
+static struct trace_buffer *swap_buffer(struct trace_buffer *buf)
+{
+    struct trace_buffer *fresh;
+    if (buf)
+        queue_buffer(buf);
+    if ((fresh = free_list) != NULL) {
+        free_list = fresh->next;
+    } else if (n_buffers < TRACE_MAX_BUFFERS
+               && (fresh = malloc(sizeof(*fresh))) != NULL) {
+        n_buffers++;
+    }
+    if (fresh)
+        fresh->n = 0;
+    return fresh;
+}
+
+struct trace_record *trace_append(struct trace_buffer **bufp)
+{
+    struct trace_buffer *buf = *bufp;
+    if (buf == NULL || buf->n >= TRACE_BUFFER_RECORDS) {
+        pthread_mutex_lock(&trace_lock);
+        buf = *bufp = swap_buffer(buf);
+        if (buf == NULL)
+            n_dropped++;
+        pthread_mutex_unlock(&trace_lock);
+        if (buf == NULL)
+            return NULL;
+    }
+    return &buf->records[buf->n++];
+}
+
+void trace_flush(struct trace_buffer **bufp)
+{
+    struct trace_buffer *buf = *bufp;
+    if (buf == NULL)
+        return;
+    pthread_mutex_lock(&trace_lock);
+    if (buf->n > 0) {
+        queue_buffer(buf);
+    } else {
+        buf->next = free_list;
+        free_list = buf;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    *bufp = NULL;
+}
+
+int trace_close(void)
+{
+    struct trace_buffer *buf;
+    int rc = 0;
+
+    if (trace_fd < 0)
+        return 0;
+    pthread_mutex_lock(&trace_lock);
+    closing = 1;
+    pthread_cond_signal(&trace_cond);
+    pthread_mutex_unlock(&trace_lock);
+    pthread_join(writer, NULL);
+
+    if (write_errno) {
+        errno = write_errno;
+        perror("writing trace");
+        rc = -1;
+    }
+    if (close(trace_fd) < 0) {
+        perror("closing trace");
+        rc = -1;
+    }
+    trace_fd = -1;
+    if (n_dropped)
+        fprintf(stderr, "trace: %llu records dropped, the disk couldn't keep"
+                " up\n", n_dropped);
+    if (config_opts.verbose > 0)
+        fprintf(stderr, "trace: %llu records written\n", n_written);
+    while ((buf = free_list) != NULL) {
+        free_list = buf->next;
+        free(buf);
+    }
+    return rc;
+}
@@ -0,0 +1,116 @@
+/* $Id$ */
+/* Copyright 2006-2007 Codemass, Inc.  All rights reserved.
+ * Use is subject to license terms.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * @file trace.h
+ * @brief Binary per-request trace log (--trace).
+ * @author Aaron Bannert (aaron@codemass.com)
+ */
+
+#ifndef __trace_h
+#define __trace_h
+
+#include "config.h"
+
+#include <stdint.h>
+
+/*
+ * A trace file is a struct trace_header, then n_locations URLs (each a
+ * uint32_t length and that many bytes, not \0-terminated), then
+ * struct trace_records until the end of the file. Everything is in the
+ * byte order of the machine that wrote it.
+ */
+#define TRACE_MAGIC "PLETHTRC"
+#define TRACE_VERSION 1
+
+/* header flags */
+#define TRACE_FROM_CONNECT 0x1 /* phases after connect are measured from it,
+                                * like MEASURE_FROM_CONNECT in metrics.c */
+
+/* record error codes, other than 0 (success) and errno values */
+#define TRACE_HTTP_ERROR (-1)
+#define TRACE_CONNECT_TIMEOUT (-2)
+#define TRACE_FIRST_BYTE_TIMEOUT (-3)
+#define TRACE_REQUEST_TIMEOUT (-4)
+#define TRACE_INVALID_BODY (-5) /* completed, but failed --validate */
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;   /* sizeof(struct trace_record) */
+    uint64_t start;         /* clock_ns() when the test started */
+    uint64_t warmup;        /* ns of the --warmup period */
+    uint32_t n_locations;
+    uint32_t flags;
+};
+
+struct trace_record {
+    uint64_t epoch;         /* the six struct metrics timestamps, in ns, */
+    uint64_t connect;       /* 0 for the ones the request didn't get to */
+    uint64_t write;
+    uint64_t first;
+    uint64_t read;
+    uint64_t close;
+    uint64_t responselen;   /* bytes read for the response */
+    uint32_t location;      /* index into the header's URLs */
+    int32_t error;          /* 0, errno or one of the TRACE_*s above */
+    uint16_t resp_code;
+    uint8_t reused;
+    uint8_t pad;
+    uint32_t thread;        /* dispatcher thread (-T) that made it */
+};
+
+/* records in each buffer, so the file is written ~1MB at a time */
+#define TRACE_BUFFER_RECORDS 16384
+/* if the disk can't keep up with this many full buffers, drop records */
+#define TRACE_MAX_BUFFERS 32
+
+struct trace_buffer {
+    int n;
+    struct trace_buffer *next;
+    struct trace_record records[TRACE_BUFFER_RECORDS];
+};
+
+/**
+ * Create the trace file, write its header and start the thread that
+ * writes it out.
+ * @returns -1 with errno set on failure.
+ */
+int trace_open(const char *path, uint64_t start, uint64_t warmup,
+               uint32_t flags);
+
+/**
+ * Get the next free record in a dispatcher thread's buffer, handing it
+ * to the writer thread first if it's full. *bufp starts out NULL.
+ * Never blocks; returns NULL (and the record is counted as dropped) if
+ * the writer has fallen too far behind.
+ */
+struct trace_record *trace_append(struct trace_buffer **bufp);
+
+/**
+ * Hand whatever is left in a thread's buffer to the writer.
+ */
+void trace_flush(struct trace_buffer **bufp);
+
+/**
+ * Wait for everything flushed so far to be written and close the file.
+ * @returns -1 if any of it couldn't be written.
+ */
+int trace_close(void);
+
+#endif /* __trace_h */